@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+namespace TCP {
+
+class BufferPool {
+ public:
+  static constexpr size_t kMinClassSize = 64;
+  static constexpr size_t kMaxClassSize = 1 << 20;
+  static constexpr size_t kMaxCachedBytes = 4 << 20;
+
+  static void* Allocate(size_t size);
+  static void Free(void* pointer, size_t size) noexcept;
+
+  static size_t GetClassSize(size_t size) noexcept;
+};
+
+class Buffer {
+ public:
+  Buffer() noexcept = default;
+  explicit Buffer(size_t size);
+  Buffer(const Buffer& other) noexcept;
+  Buffer(Buffer&& other) noexcept;
+  ~Buffer();
+
+  Buffer& operator=(const Buffer& other) noexcept;
+  Buffer& operator=(Buffer&& other) noexcept;
+
+  char* Data() const noexcept;
+  size_t Size() const noexcept;
+  size_t Capacity() const noexcept;
+  bool IsUnique() const noexcept;
+  bool IsEmpty() const noexcept;
+
+  void Resize(size_t size);
+  void Reset() noexcept;
+
+ private:
+  struct Header {
+    std::atomic<uint32_t> references;
+    size_t capacity;
+    size_t size;
+  };
+
+  Header* header_ = nullptr;
+};
+
+class PoolResource : public std::pmr::memory_resource {
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void* pointer, size_t bytes,
+                     size_t alignment) override;
+  bool do_is_equal(
+      const std::pmr::memory_resource& other) const noexcept override;
+};
+
+std::pmr::memory_resource* GetPoolResource() noexcept;
+
+}  // namespace TCP
@@ -3,20 +3,53 @@
 #define BLOCK_SIZE 1024
 #define MS_RECV_TIMEOUT 1000
 
+#include <sys/uio.h>
+
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <deque>
 #include <list>
+#include <memory>
+#include <memory_resource>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <semaphore>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
+#include "tcp-buffer.hpp"
+#include "tcp-heartbeat.hpp"
+#include "tcp-send-queue.hpp"
+#include "tcp-shm.hpp"
 #include "tcp-supply.hpp"
+#include "tcp-trace.hpp"
 
 namespace TCP {
 
 class TcpServer;
+class RpcClient;
+class RpcRequest;
+class RpcResponse;
+class RpcServer;
+class ResilientSession;
+class ResilientServer;
+class Connector;
+class PubSubServer;
+template <typename... Messages>
+class MessageRegistry;
+
+// messages of one ReceiveMany call. The views point into buffer, which the
+// batch owns
+struct MessageBatch {
+  Buffer buffer;
+  std::vector<std::string_view> messages;
+};
 
 class TcpClient {
  public:
@@ -26,6 +59,11 @@ class TcpClient {
   TcpClient(const char* addr, int port, int ms_ping_threshold,
             logging_foo f_logger = LoggerCap);
   TcpClient(const char* addr, int port, logging_foo f_logger = LoggerCap);
+  TcpClient(const char* addr, int port, int ms_ping_threshold,
+            int ms_loop_period, const SocketOptions& options,
+            logging_foo f_logger = LoggerCap);
+  TcpClient(const char* addr, int port, const SocketOptions& options,
+            logging_foo f_logger = LoggerCap);
   TcpClient(TcpClient&&) noexcept;
   ~TcpClient();
 
@@ -36,7 +74,14 @@ class TcpClient {
   void Connect(const char* addr, int port, int ms_ping_threshold,
                logging_foo f_logger = LoggerCap);
   void Connect(const char* addr, int port, logging_foo f_logger = LoggerCap);
+  void Connect(const char* addr, int port, int ms_ping_threshold,
+               int ms_loop_period, const SocketOptions& options,
+               logging_foo f_logger = LoggerCap);
+  void Connect(const char* addr, int port, const SocketOptions& options,
+               logging_foo f_logger = LoggerCap);
 
+  // may be called from several threads at once; each thread's messages keep
+  // their order
   template <typename... Args>
   void Send(const Args&... args) {
     LClient logger(LClient::FSend, this, logger_);
@@ -48,78 +93,175 @@ class TcpClient {
     logger.Log("Peer is connected", Debug);
 
     logger.Log("Getting string from args", Debug);
-    std::string input;
+    std::string& input = GetSendBuffer();
+    if (Tracer::IsEnabled()) {
+      Tracer::Begin(Tracer::Now());
+    } else {
+      Tracer::End();
+    }
     FromArgs(input, args...);
+    Tracer::Mark(TSerialize);
     logger.Log("Sending message", Debug);
     StrSend(input, logger);
+    Tracer::End();
     logger.Log("Message sent", Info);
   }
 
+  void SendFile(int fd, off_t offset, size_t length);
+
   std::string RecvStr(int ms_timeout);
+  std::pmr::string RecvStr(int ms_timeout,
+                           std::pmr::memory_resource* resource);
+  std::optional<size_t> RecvChunks(int ms_timeout, const chunk_foo& sink);
+  std::optional<size_t> RecvToFile(int fd, int ms_timeout);
+  // up to max_count messages that are already complete in the socket
+  // buffer, read with a few large reads. Waits up to ms_timeout for the
+  // first one and is empty on timeout
+  MessageBatch ReceiveMany(size_t max_count, int ms_timeout);
+  // the views live until handler returns. Returns the number of messages
+  size_t ReceiveMany(size_t max_count, int ms_timeout,
+                     const std::function<void(std::string_view)>& handler);
 
   template <typename... Args>
   bool Receive(int ms_timeout, Args&... args) {
+    return Receive(ms_timeout, GetPoolResource(), args...);
+  }
+  template <typename... Args>
+  bool Receive(int ms_timeout, std::pmr::memory_resource* resource,
+               Args&... args) {
     LClient logger(LClient::FRecv, this, logger_);
 
-    auto recv_str = RecvStr(ms_timeout);
+    auto recv_str = RecvStr(ms_timeout, resource);
     if (recv_str.empty()) {
       return false;
     }
 
     logger.Log("Setting args from string", Debug);
-    std::stringstream stream;
-    stream << recv_str;
-    ToArgs(stream, args...);
+    ToArgs(GetRecvStream(recv_str.data(), recv_str.size()), args...);
+    Tracer::Mark(TDeserialize);
+    Tracer::End();
     logger.Log("Message received", Info);
     return true;
   }
 
+  // disconnects at once, also while other threads are inside Send or
+  // Receive. The connection is freed with the client
   void StopClient() noexcept;
   bool IsAvailable();
   bool IsConnected() noexcept;
 
   int GetPing();
+  // phi-accrual suspicion that the peer is lost, infinity once disconnected
+  double GetSuspicion() noexcept;
 
   int GetMsPingThreshold() const noexcept;
 
  private:
-  int main_socket_;
-  int heartbeat_socket_;
+  static constexpr size_t kBatchSize = 1 << 18;
+
+  int main_socket_ = -1;
+  int heartbeat_socket_ = -1;
 
   int ping_threshold_;
   int loop_period_;
-
-  std::thread heartbeat_thread_;
-
-  TcpClient** this_pointer_ = nullptr;
-  std::mutex* this_mutex_ = nullptr;
-
-  bool is_active_ = false;
-
-  int ms_ping_ = 0;
+  // usable SO_SNDBUF of the main socket, read once the client is built
+  int send_room_ = 0;
+
+  SocketOptions options_;
+  ShmChannel* shm_channel_ = nullptr;
+  SendQueue* send_queue_ = nullptr;
+  HeartBeat* heartbeat_ = nullptr;
+  // loop of options_.reactors that runs the heartbeat
+  size_t reactor_ = 0;
+  // connection count of the accepting server, released on stop
+  std::shared_ptr<std::atomic<int>> live_counter_;
+
+  int64_t flags_ = 0;
+
+  // broadcast frames waiting for room in the socket buffer, sent by the
+  // broadcast workers of TcpServer. client is null once the client is gone
+  struct Backlog {
+    std::mutex mutex;
+    TcpClient* client;
+    std::deque<Buffer> frames;
+    // queued for a broadcast worker or being drained by one
+    bool is_scheduled = false;
+  };
+  std::atomic<std::shared_ptr<Backlog>> backlog_;
+
+  std::atomic<bool> is_active_ = false;
 
   logging_foo logger_ = LoggerCap;
 
   TcpClient(int heartbeat_socket, int main_socket, int ping_threshold,
-            int loop_period, logging_foo f_logger);
-
-  static void HeartBeatClient(TcpClient** this_pointer,
-                              std::mutex* this_mutex) noexcept;
-  static void HeartBeatServer(TcpClient** this_pointer,
-                              std::mutex* this_mutex) noexcept;
+            int loop_period, const SocketOptions& options, int64_t flags,
+            ShmChannel* shm_channel, logging_foo f_logger,
+            HeartBeat::Role role = HeartBeat::Pinger,
+            const std::string& heartbeat_partial = {});
+
+  // stops like StopClient. Sockets handed to another process are left
+  // open instead of being shut down
+  void Stop(bool is_shutting_down) noexcept;
+  // frees the sockets and objects of a stopped connection. Only where no
+  // other thread can use the client: destruction, assignment, Connect
+  void Release() noexcept;
+  // points a moved-in backlog at this client
+  void AdoptBacklog() noexcept;
+
+  void StartHeartBeat(HeartBeat::Role role,
+                      const std::string& heartbeat_partial = {});
 
   // From string to args
   template <IFriendly T>
-  void ToArg(std::stringstream& stream, T& var) {
+  static void ToArg(std::stringstream& stream, T& var) {
     if (stream.rdbuf()->in_avail() == 0) {
       return;
     }
-    stream >> var;
+    if constexpr (std::is_floating_point_v<T> ||
+                  (std::is_integral_v<T> && sizeof(T) > 1)) {
+      ParseArithmetic(stream, var);
+    } else {
+      stream >> var;
+    }
+  }
+
+  // from_chars takes the common token. Anything it would read differently
+  // goes to operator>>, so received arguments parse as they always did
+  template <typename T>
+  static void ParseArithmetic(std::stringstream& stream, T& var) {
+    char buffer[64];
+    size_t length = 0;
+    stream >> std::ws;
+    auto* buf = stream.rdbuf();
+    auto start = buf->pubseekoff(0, std::ios::cur, std::ios::in);
+    int symbol = buf->sgetc();
+    for (; symbol != EOF && !isspace(symbol) && length < sizeof(buffer);
+         symbol = buf->snextc()) {
+      buffer[length++] = symbol;
+    }
+
+    T value;
+    auto answ = std::from_chars(buffer, buffer + length, value);
+    bool is_parsed = answ.ec == std::errc() &&
+                     answ.ptr == buffer + length &&
+                     (symbol == EOF || isspace(symbol));
+    if constexpr (std::is_floating_point_v<T>) {
+      is_parsed = is_parsed && std::isfinite(value);
+    }
+    if (!is_parsed) {
+      buf->pubseekpos(start, std::ios::in);
+      stream >> var;
+      return;
+    }
+    var = value;
+    if (symbol == EOF) {
+      stream.setstate(std::ios::eofbit);
+    }
   }
 
   template <typename T>
     requires(!IFriendly<T>)
-  void ToArg(std::stringstream& stream, T& var) {
+  static void ToArg(std::stringstream& stream, T& var) {
     if (stream.rdbuf()->in_avail() == 0) {
       return;
     }
@@ -133,9 +275,9 @@ class TcpClient {
     }
   }
 
-  void ToArgs(std::stringstream& stream);
+  static void ToArgs(std::stringstream& stream);
   template <typename Head, typename... Tail>
-  void ToArgs(std::stringstream& stream, Head& head, Tail&... tail) {
+  static void ToArgs(std::stringstream& stream, Head& head, Tail&... tail) {
     ToArg(stream, head);
     if (stream.eof()) {
       return;
@@ -145,20 +287,41 @@ class TcpClient {
 
   // From args to string
   template <OFriendly T>
-  void FromArg(std::string& output, const T& var) {
-    std::stringstream stream;
-    stream << var;
-    std::string str = stream.str();
-
-    if (!output.empty()) {
-      output.push_back(' ');
+  static void FromArg(std::string& output, const T& var) {
+    if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+      if (!output.empty()) {
+        output.push_back(' ');
+      }
+      output += std::string_view(var);
+    } else if constexpr (std::is_floating_point_v<T> ||
+                         (std::is_integral_v<T> && sizeof(T) > 1)) {
+      char buffer[64];
+      std::to_chars_result result;
+      if constexpr (std::is_floating_point_v<T>) {
+        result = std::to_chars(buffer, buffer + sizeof(buffer), var,
+                               std::chars_format::general, 6);
+      } else {
+        result = std::to_chars(buffer, buffer + sizeof(buffer), var);
+      }
+      if (!output.empty()) {
+        output.push_back(' ');
+      }
+      output.append(buffer, result.ptr);
+    } else {
+      std::stringstream stream;
+      stream << var;
+      std::string str = stream.str();
+
+      if (!output.empty()) {
+        output.push_back(' ');
+      }
+      output += str;
     }
-    output += str;
   }
 
   template <typename T>
     requires(!OFriendly<T>)
-  void FromArg(std::string& output, const T& var) {
+  static void FromArg(std::string& output, const T& var) {
     if (!output.empty()) {
       output.push_back(' ');
     }
@@ -169,20 +332,89 @@ class TcpClient {
     }
   }
 
-  void FromArgs(std::string& output);
+  static void FromArgs(std::string& output);
   template <typename Head, typename... Tail>
-  void FromArgs(std::string& output, const Head& head, const Tail&... tail) {
+  static void FromArgs(std::string& output, const Head& head,
+                       const Tail&... tail) {
     FromArg(output, head);
 
     FromArgs(output, tail...);
   }
 
-  std::string StrRecv(int ms_timeout, Logger& logger);
   void StrSend(const std::string& message, Logger& logger);
+  // frames are shared by every receiver of a broadcast
+  static Buffer MakeFrame(const std::string& message);
+  void SendFrame(const Buffer& frame);
+  // whether length bytes fit into the socket buffer without blocking
+  bool HasSendRoom(size_t length) noexcept;
+  void EnqueueSend(SendRequest& request, Logger& logger);
+  void FlushSendQueue() noexcept;
+  bool FlushFileRequest(SendRequest* request) noexcept;
+
+  static std::string& GetSendBuffer();
+  static std::stringstream& GetRecvStream(const char* data, size_t size);
+
+  template <typename String>
+  bool StrRecv(int ms_timeout, Logger& logger, String& result) {
+    auto length = RecvHeader(ms_timeout, logger);
+    if (!length.has_value()) {
+      return false;
+    }
+
+    logger.Log("Receiving main data", Debug);
+    result.resize(length.value());
+    if (MainRecvAll(result.data(), result.size()) != result.size()) {
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
+    RecvTerminator(logger);
+    Tracer::Mark(TKernelRecv);
+    while (!result.empty() && result.back() == '\0') {
+      result.pop_back();
+    }
+
+    logger.Log("Message received", Info);
+    return true;
+  }
+
+  void RecvBatch(size_t max_count, int ms_timeout, MessageBatch& batch,
+                 Logger& logger);
+  size_t ParseFrames(MessageBatch& batch, size_t offset, size_t length,
+                     size_t max_count) noexcept;
+  // one message the slow way, false on timeout
+  bool RecvFrame(MessageBatch& batch, size_t& offset, int ms_timeout,
+                 Logger& logger);
+  static void GrowBatch(MessageBatch& batch, size_t size);
+
+  std::optional<size_t> RecvHeader(int ms_timeout, Logger& logger);
+  // whether a whole message is buffered, or the connection is broken, so a
+  // receive cannot block
+  bool IsMessageReady() noexcept;
+  void RecvTerminator(Logger& logger);
+  // a non-zero stamp travels as a third number when the digits leave room
+  static void FillControlBlock(char* control_block, size_t length,
+                               int64_t stamp = 0) noexcept;
+  size_t SendFileData(int fd, off_t offset, size_t length) noexcept;
+
+  ssize_t MainSend(std::string message, size_t length) noexcept;
+  ssize_t MainSendAll(const char* data, size_t length) noexcept;
+  ssize_t MainSendv(iovec* io, int count) noexcept;
+  std::string MainRecv(size_t length) noexcept;
+  size_t MainRecvAll(char* data, size_t length) noexcept;
+  std::optional<int> MainWait(int ms_timeout, Logger& logger);
 
   void CheckReceiveError();
 
   friend TcpServer;
+  friend RpcClient;
+  friend RpcRequest;
+  friend RpcResponse;
+  friend RpcServer;
+  friend ResilientSession;
+  friend ResilientServer;
+  friend Connector;
+  friend PubSubServer;
+  template <typename... Messages>
+  friend class MessageRegistry;
 };
 
 }  // namespace TCP
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "tcp-client.hpp"
+#include "tcp-event-loop.hpp"
+
+namespace TCP {
+
+struct ConnectTarget {
+  std::string addr;
+  int port;
+};
+
+struct ConnectResult {
+  // stays inactive when error is set
+  TcpClient client;
+  std::optional<TcpException> error;
+};
+
+// Runs the client handshakes of many connections at once on the shared
+// event loop, so a fleet connects in about the time of its slowest peer.
+// Host names are looked up on a few threads while handshakes run. Candidate
+// addresses of a target are tried one after another, and shared memory
+// transport is never requested
+class Connector {
+ public:
+  Connector(int ms_ping_threshold, int ms_loop_period,
+            const SocketOptions& options, logging_foo f_logger = LoggerCap);
+  Connector(logging_foo f_logger = LoggerCap);
+  Connector(const Connector&) = delete;
+
+  Connector& operator=(const Connector&) = delete;
+
+  // results keep the order of targets; must not be called on the loop
+  // thread
+  std::vector<ConnectResult> ConnectMany(
+      const std::vector<ConnectTarget>& targets);
+
+ private:
+  static constexpr size_t kMessageSize = kULLMaxDigits + 1;
+  // threads looking up host names of one batch
+  static constexpr size_t kResolverCount = 16;
+
+  enum Stage { HeartBeatConnect, Password, MainConnect, Signal, Done };
+
+  struct Attempt {
+    std::vector<Endpoint> endpoints;
+    size_t endpoint = 0;
+    Stage stage = HeartBeatConnect;
+    int heartbeat_socket = -1;
+    int main_socket = -1;
+    int64_t flags = 0;
+    char message[kMessageSize + 1] = {};
+    size_t size = 0;
+    TimerWheel::TimerId deadline = 0;
+    TcpClient client;
+    std::optional<TcpException> error;
+  };
+
+  int ping_threshold_;
+  int loop_period_;
+  SocketOptions options_;
+  logging_foo logger_;
+
+  EventLoop* loop_;
+
+  std::mutex mutex_;
+  std::condition_variable done_cv_;
+  size_t remaining_ = 0;
+
+  // owned by the loop thread while a batch runs
+  std::vector<Attempt> attempts_;
+
+  // resolver threads only. Hands the attempt to the loop thread
+  void Resolve(size_t index, const ConnectTarget& target,
+               Logger& logger) noexcept;
+  void Start(size_t index, int error) noexcept;
+  void OnEvent(size_t index) noexcept;
+
+  int OpenSocket(const Endpoint& endpoint) noexcept;
+  // true once length bytes arrived, empty on a broken connection
+  std::optional<bool> Receive(Attempt& attempt, int socket,
+                              size_t length) noexcept;
+  // every stage has a deadline, shorter while other addresses remain
+  void Await(size_t index, int socket, uint32_t events) noexcept;
+  void OnTimeout(size_t index) noexcept;
+  void Complete(size_t index) noexcept;
+  void Fail(size_t index, TcpException::ExceptionType type,
+            int error = 0) noexcept;
+  void Finish(size_t index, bool is_closing) noexcept;
+
+  static int GetSocketError(int socket) noexcept;
+};
+
+}  // namespace TCP
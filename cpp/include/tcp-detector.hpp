@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace TCP {
+
+// Phi-accrual failure detector over heartbeat inter-arrival times. Suspicion
+// grows with silence relative to the observed interval distribution, so
+// jittery links tolerate longer gaps while steady ones are judged quickly
+class FailureDetector {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr size_t kWindowSize = 64;
+
+  FailureDetector(int ms_expected_interval, int ms_acceptable_pause) noexcept;
+
+  void Reset(Clock::time_point now) noexcept;
+  void AddArrival(Clock::time_point now) noexcept;
+
+  double GetSuspicion(Clock::time_point now) const noexcept;
+  int64_t GetMsSinceArrival(Clock::time_point now) const noexcept;
+
+ private:
+  int ms_expected_interval_;
+  int ms_acceptable_pause_;
+
+  mutable std::mutex mutex_;
+  double intervals_[kWindowSize] = {};
+  size_t count_ = 0;
+  size_t next_ = 0;
+  double sum_ = 0;
+  double square_sum_ = 0;
+  Clock::time_point last_arrival_;
+
+  void AddInterval(double interval) noexcept;
+};
+
+}  // namespace TCP
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tcp-supply.hpp"
+#include "tcp-timer.hpp"
+
+namespace TCP {
+
+using event_foo = std::function<void(uint32_t events)>;
+
+// epoll reactor with a timer wheel. Callbacks run on the loop thread and
+// must not block; every method may be called from any thread
+class EventLoop {
+ public:
+  EventLoop(logging_foo f_logger = LoggerCap);
+  // pins the loop thread to cpu, a negative cpu leaves it unpinned
+  EventLoop(int cpu, logging_foo f_logger = LoggerCap);
+  EventLoop(const EventLoop&) = delete;
+  ~EventLoop();
+
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  static EventLoop& GetDefault();
+
+  void Watch(int fd, uint32_t events, event_foo callback);
+  void Modify(int fd, uint32_t events);
+  // called on the loop thread, guarantees no further callback for fd
+  void Unwatch(int fd) noexcept;
+
+  TimerWheel::TimerId RunAfter(int64_t ms_delay, task_foo callback);
+  bool Cancel(TimerWheel::TimerId id) noexcept;
+
+  void Post(task_foo task);
+  // runs task on the loop thread and waits for it to finish
+  void RunSync(const task_foo& task);
+
+  bool IsLoopThread() const noexcept;
+  // watched descriptors, the load measure of a reactor
+  size_t GetWatchCount() const noexcept;
+
+ private:
+  static constexpr int kMaxEvents = 256;
+
+  struct Watcher {
+    uint32_t generation;
+    std::shared_ptr<event_foo> callback;
+  };
+
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::atomic<bool> is_active_ = true;
+
+  std::mutex mutex_;
+  TimerWheel wheel_;
+  std::unordered_map<int, Watcher> watchers_;
+  std::atomic<size_t> watch_count_ = 0;
+  uint32_t generation_ = 0;
+  std::vector<task_foo> tasks_;
+
+  logging_foo logger_;
+
+  std::thread thread_;
+  std::thread::id thread_id_;
+
+  void Loop() noexcept;
+  void Dispatch(uint64_t data, uint32_t events, Logger& logger) noexcept;
+  void RunTimers(Logger& logger) noexcept;
+  void RunTasks(Logger& logger) noexcept;
+  void Wake() noexcept;
+};
+
+enum ReactorPolicy { RoundRobin, LeastLoaded };
+
+// Event loops pinned to cores that shard heartbeats. Connections built with
+// SocketOptions::reactors get one loop of the pool for their heartbeat
+// sockets and timers. Main socket I/O still runs on the threads calling
+// Send and Receive, and the listener and handshake on the default loop. The
+// pool has to outlive the connections
+class ReactorPool {
+ public:
+  // cores[i] pins loop i, a missing or negative core leaves it unpinned
+  ReactorPool(size_t count, const std::vector<int>& cores = {},
+              ReactorPolicy policy = RoundRobin,
+              logging_foo f_logger = LoggerCap);
+  ReactorPool(const ReactorPool&) = delete;
+  ~ReactorPool();
+
+  ReactorPool& operator=(const ReactorPool&) = delete;
+
+  size_t GetSize() const noexcept;
+  EventLoop& Get(size_t index);
+  // index of the loop the next connection should go to
+  size_t Pick() noexcept;
+
+ private:
+  std::vector<EventLoop*> loops_;
+  ReactorPolicy policy_;
+  std::atomic<size_t> next_ = 0;
+};
+
+}  // namespace TCP
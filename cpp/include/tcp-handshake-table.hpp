@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace TCP {
+
+// Fixed-capacity open-addressing table of half-open connections keyed by
+// their handshake password. Linear probing with backward-shift deletion, so
+// there are no tombstones and lookups stay short at any age
+class HandshakeTable {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Stats {
+    size_t size;
+    size_t capacity;
+    uint64_t inserted;
+    uint64_t completed;
+    uint64_t expired;
+    uint64_t evicted;
+  };
+
+  explicit HandshakeTable(size_t capacity);
+
+  // returns the socket evicted to make room, the caller closes it
+  std::optional<int> Insert(uint64_t password, int socket,
+                            Clock::time_point deadline);
+  std::optional<int> Take(uint64_t password) noexcept;
+  bool Contains(uint64_t password) const noexcept;
+
+  // removes entries past their deadline and returns their sockets
+  std::vector<int> Expire(Clock::time_point now);
+  std::vector<int> Clear();
+  // password and socket of every entry, left in place
+  std::vector<std::pair<uint64_t, int>> GetEntries() const;
+
+  Stats GetStats() const noexcept;
+
+ private:
+  struct Slot {
+    uint64_t password = 0;
+    int socket = -1;
+    Clock::time_point deadline;
+  };
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  size_t capacity_;
+  size_t size_ = 0;
+
+  uint64_t inserted_ = 0;
+  uint64_t completed_ = 0;
+  uint64_t expired_ = 0;
+  uint64_t evicted_ = 0;
+
+  size_t GetHome(uint64_t password) const noexcept;
+  std::optional<size_t> Find(uint64_t password) const noexcept;
+  void Erase(size_t index) noexcept;
+};
+
+}  // namespace TCP
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "tcp-detector.hpp"
+#include "tcp-event-loop.hpp"
+#include "tcp-shm.hpp"
+#include "tcp-supply.hpp"
+
+namespace TCP {
+
+// Liveness of one connection, driven by an EventLoop. The server side of a
+// connection pings, the client side answers with its processing delay
+class HeartBeat {
+ public:
+  enum Role { Pinger, Responder };
+
+  HeartBeat(Role role, int socket, int main_socket, ShmChannel* shm_channel,
+            int ping_threshold, int loop_period, bool is_piggyback,
+            double phi_threshold, logging_foo f_logger);
+  HeartBeat(const HeartBeat&) = delete;
+  ~HeartBeat();
+
+  HeartBeat& operator=(const HeartBeat&) = delete;
+
+  void Start(EventLoop& loop);
+  void Stop() noexcept;
+
+  // -1 once the peer is considered disconnected
+  int GetPing() const noexcept;
+  // phi of the silence since the last heartbeat, infinity once disconnected
+  double GetSuspicion() const noexcept;
+
+  void AddReceived(size_t bytes) noexcept;
+  void AddSent(size_t bytes) noexcept;
+
+  // unfinished message of the socket, carried along when the socket is
+  // handed to another process. Only while the heartbeat is not running
+  std::string GetPartial() const;
+  void SetPartial(const std::string& partial) noexcept;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr size_t kMessageSize = kULLMaxDigits + 1;
+  // sent by a responder that hears nothing in place of a delay. Pingers
+  // that predate it ignore it as a delay without a ping
+  static constexpr int64_t kPingRequest = -1;
+
+  Role role_;
+  int socket_;
+  int main_socket_;
+  ShmChannel* shm_channel_;
+  int ping_threshold_;
+  int loop_period_;
+  bool is_piggyback_;
+  double phi_threshold_;
+
+  logging_foo logger_;
+
+  FailureDetector detector_;
+
+  std::atomic<int> ms_ping_ = 0;
+  std::atomic<uint64_t> bytes_received_ = 0;
+  std::atomic<uint64_t> bytes_sent_ = 0;
+
+  // owned by the loop thread
+  EventLoop* loop_ = nullptr;
+  TimerWheel::TimerId timer_ = 0;
+  bool is_running_ = false;
+  bool is_waiting_reply_ = false;
+  uint64_t traffic_mark_ = 0;
+  uint64_t delivered_mark_ = 0;
+  Clock::time_point ping_time_;
+  char message_[kMessageSize + 1] = {};
+  size_t message_size_ = 0;
+
+  void OnReadable(uint32_t events) noexcept;
+  void OnTimer() noexcept;
+  void OnDelay(int64_t delay, Logger& logger) noexcept;
+  void OnPing(int64_t ping, int64_t delay, Logger& logger) noexcept;
+  bool SendPing(Clock::time_point now, Logger& logger) noexcept;
+  bool SendValue(int64_t value, const char* reason, Logger& logger) noexcept;
+
+  void Schedule(int64_t ms_delay) noexcept;
+  void Fail(const char* reason, Logger& logger) noexcept;
+  void Detach() noexcept;
+
+  bool IsSuspected(Clock::time_point now) const noexcept;
+  // is_delivering is set when main traffic of this side reached the peer
+  bool IsTrafficObserved(bool& is_delivering) noexcept;
+  // delivered counts the bytes of this side the peer has taken in
+  uint64_t GetTrafficMark(uint64_t& delivered) noexcept;
+  std::optional<int> GetTransportPing() noexcept;
+
+  static int64_t MsSince(Clock::time_point time) noexcept;
+};
+
+}  // namespace TCP
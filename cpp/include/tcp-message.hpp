@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "tcp-client.hpp"
+
+namespace TCP {
+
+// A message type lists its fields in the order they travel:
+//   struct Quote {
+//     std::string symbol;
+//     double price;
+//     auto Tie() const { return std::tie(symbol, price); }
+//   };
+template <typename T>
+concept TypedMessage = std::is_default_constructible_v<T> && requires(T val) {
+  std::tuple_size<decltype(val.Tie())>::value;
+};
+
+// Maps every message type to its position in Messages. The position is sent
+// as the first number of the frame and picks the decoder from a table built
+// at compile time, so receivers never compare type names.
+// The handler is called with the decoded message and must accept every type:
+//   Registry::Receive(client, 100, Overloaded{[](const Quote&) {...}, ...});
+template <typename... Messages>
+class MessageRegistry {
+  static_assert((TypedMessage<Messages> && ...),
+                "every message needs a default constructor and Tie()");
+
+ public:
+  static constexpr size_t kSize = sizeof...(Messages);
+
+  template <typename T>
+    requires(std::is_same_v<T, Messages> || ...)
+  static constexpr uint32_t GetId() noexcept {
+    uint32_t id = 0;
+    ((std::is_same_v<T, Messages> ? false : (++id, true)) && ...);
+    return id;
+  }
+
+  template <typename T>
+  static void Send(TcpClient& client, const T& message) {
+    std::apply(
+        [&client](const auto&... fields) {
+          client.Send(GetId<T>(), fields...);
+        },
+        message.Tie());
+  }
+
+  // false on timeout, like TcpClient::Receive
+  template <typename Handler>
+  static bool Receive(TcpClient& client, int ms_timeout, Handler&& handler) {
+    auto message = client.RecvStr(ms_timeout, GetPoolResource());
+    if (message.empty()) {
+      return false;
+    }
+    if (!Dispatch(TcpClient::GetRecvStream(message.data(), message.size()),
+                  handler)) {
+      LClient(LClient::FRecv, &client, client.logger_)
+          .Log("Unknown message id", Warning);
+      throw TcpException(TcpException::Receiving, client.logger_);
+    }
+    return true;
+  }
+
+  // false when the frame does not start with a known message id
+  template <typename Handler>
+  static bool Dispatch(std::stringstream& stream, Handler&& handler) {
+    uint32_t id = kSize;
+    TcpClient::ToArg(stream, id);
+    if (stream.fail() || id >= kSize) {
+      return false;
+    }
+    kTable<std::remove_reference_t<Handler>>[id](stream, handler);
+    return true;
+  }
+
+ private:
+  template <typename Handler>
+  using Decoder = void (*)(std::stringstream&, Handler&);
+
+  template <typename T, typename Handler>
+  static void Decode(std::stringstream& stream, Handler& handler) {
+    T message;
+    if (!stream.eof()) {
+      // the fields belong to a non-const local, so writing through them is
+      // well defined
+      std::apply(
+          [&stream](const auto&... fields) {
+            TcpClient::ToArgs(
+                stream,
+                const_cast<std::remove_cvref_t<decltype(fields)>&>(fields)...);
+          },
+          message.Tie());
+    }
+    handler(std::as_const(message));
+  }
+
+  template <typename Handler>
+  static constexpr std::array<Decoder<Handler>, kSize> kTable = {
+      &Decode<Messages, Handler>...};
+};
+
+template <typename... Handlers>
+struct Overloaded : Handlers... {
+  using Handlers::operator()...;
+};
+template <typename... Handlers>
+Overloaded(Handlers...) -> Overloaded<Handlers...>;
+
+}  // namespace TCP
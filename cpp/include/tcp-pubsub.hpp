@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "tcp-server.hpp"
+
+namespace TCP {
+
+const char kPubSubSubscribe[] = "s";
+const char kPubSubUnsubscribe[] = "u";
+
+struct PubSubOptions {
+  // messages a subscriber may lag behind before its queue is conflated
+  size_t max_queue = 1024;
+  int sender_threads = 2;
+  // how soon a subscriber with a full socket buffer is retried
+  int ms_retry = 10;
+};
+
+const PubSubOptions kDefPubSubOptions = {};
+
+struct PubSubStats {
+  uint64_t published;
+  uint64_t delivered;
+  // replaced by a newer message of the same topic
+  uint64_t conflated;
+  // evicted from a full queue that held nothing of the same topic
+  uint64_t dropped;
+};
+
+// Topic based fan-out over the clients of a TcpServer. A client subscribes
+// with Send(kPubSubSubscribe, topic) and receives every published message as
+// "topic args...". A subscriber that falls behind keeps only the latest
+// message of each topic once its queue is full
+class PubSubServer {
+ public:
+  PubSubServer(TcpServer& server,
+               const PubSubOptions& options = kDefPubSubOptions,
+               logging_foo f_logger = LoggerCap);
+  PubSubServer(const PubSubServer&) = delete;
+  ~PubSubServer();
+
+  PubSubServer& operator=(const PubSubServer&) = delete;
+
+  // returns the number of subscribers of the topic
+  template <typename... Args>
+  size_t Publish(const std::string& topic, const Args&... args) {
+    std::string message;
+    TcpClient::FromArgs(message, topic, args...);
+    return PublishStr(topic, message);
+  }
+  size_t PublishStr(const std::string& topic, const std::string& message);
+
+  size_t GetSubscriberCount() noexcept;
+  PubSubStats GetStats() const noexcept;
+
+  // closes the listener of the underlying server
+  void Stop() noexcept;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr int kControlPeriod = 100;
+  // frames one subscriber may send before yielding its sender thread
+  static constexpr size_t kMaxFlushBurst = 64;
+
+  struct Message {
+    std::string topic;
+    Buffer frame;
+  };
+
+  struct Subscriber {
+    Subscriber(TcpClient&& client) noexcept;
+
+    TcpClient client;
+
+    std::mutex mutex;
+    std::deque<std::shared_ptr<const Message>> queue;
+    // queued for a sender thread or being flushed by one
+    bool is_scheduled = false;
+    bool is_closed = false;
+
+    // owned by the controller thread
+    std::set<std::string> topics;
+  };
+
+  using SubscriberList = std::vector<std::shared_ptr<Subscriber>>;
+  using TopicIndex =
+      std::unordered_map<std::string, std::shared_ptr<const SubscriberList>>;
+
+  TcpServer& server_;
+  PubSubOptions options_;
+  logging_foo logger_;
+
+  std::atomic<bool> is_active_ = true;
+
+  // readers take a snapshot, writers copy it under index_mutex_
+  std::atomic<std::shared_ptr<const TopicIndex>> index_;
+  std::mutex index_mutex_;
+
+  std::mutex subscribers_mutex_;
+  SubscriberList subscribers_;
+  int wake_fd_ = -1;
+
+  std::mutex ready_mutex_;
+  std::condition_variable ready_cv_;
+  std::deque<std::shared_ptr<Subscriber>> ready_;
+  std::deque<std::pair<Clock::time_point, std::shared_ptr<Subscriber>>>
+      delayed_;
+
+  std::atomic<uint64_t> published_ = 0;
+  std::atomic<uint64_t> delivered_ = 0;
+  std::atomic<uint64_t> conflated_ = 0;
+  std::atomic<uint64_t> dropped_ = 0;
+
+  std::thread accept_thread_;
+  std::thread control_thread_;
+  std::vector<std::thread> sender_threads_;
+
+  void AcceptLoop() noexcept;
+  void ControlLoop() noexcept;
+  void SendLoop() noexcept;
+
+  void Serve(const std::shared_ptr<Subscriber>& subscriber, Logger& logger);
+  void Subscribe(const std::shared_ptr<Subscriber>& subscriber,
+                 const std::string& topic, bool is_subscribe);
+  void Remove(const std::shared_ptr<Subscriber>& subscriber) noexcept;
+  static void UpdateTopic(TopicIndex& index, const std::string& topic,
+                          const std::shared_ptr<Subscriber>& subscriber,
+                          bool is_subscribe);
+
+  // true when the subscriber has to be handed to a sender thread
+  bool Enqueue(Subscriber& subscriber,
+               const std::shared_ptr<const Message>& message) noexcept;
+  void Flush(std::shared_ptr<Subscriber> subscriber) noexcept;
+  void Wake() noexcept;
+};
+
+}  // namespace TCP
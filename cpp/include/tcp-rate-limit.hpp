@@ -0,0 +1,25 @@
+#pragma once
+
+#include <chrono>
+
+namespace TCP {
+
+// Classic token bucket: rate tokens per second, at most burst saved up.
+// Not thread safe, meant to be owned by a single event loop
+class TokenBucket {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // a non-positive rate disables limiting
+  TokenBucket(double rate, double burst) noexcept;
+
+  bool TryTake(Clock::time_point now) noexcept;
+
+ private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  Clock::time_point last_refill_;
+};
+
+}  // namespace TCP
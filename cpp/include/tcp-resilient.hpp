@@ -0,0 +1,212 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "tcp-event-loop.hpp"
+#include "tcp-server.hpp"
+
+namespace TCP {
+
+const char kResilientHello[] = "h";
+const char kResilientData[] = "d";
+const char kResilientAck[] = "a";
+
+struct ResilienceOptions {
+  int ms_min_backoff = 50;
+  int ms_max_backoff = 5000;
+  // how long a broken session waits to be resumed before it is lost
+  int ms_session_timeout = 30000;
+  size_t max_unacked = 1 << 16;
+};
+
+const ResilienceOptions kDefResilienceOptions = {};
+
+// Ordered, exactly-once message stream that outlives its connections. Every
+// message carries a sequence number and is kept until the peer acknowledges
+// it, so a resumed session replays whatever the broken connection lost
+class ResilientSession {
+ public:
+  ResilientSession(const ResilienceOptions& options,
+                   logging_foo f_logger = LoggerCap);
+  ResilientSession(const ResilientSession&) = delete;
+  virtual ~ResilientSession();
+
+  ResilientSession& operator=(const ResilientSession&) = delete;
+
+  template <typename... Args>
+  void Send(const Args&... args) {
+    std::string body;
+    TcpClient::FromArgs(body, args...);
+    SendStr(body);
+  }
+
+  template <typename... Args>
+  bool Receive(int ms_timeout, Args&... args) {
+    auto message = RecvStr(ms_timeout);
+    if (message.empty()) {
+      return false;
+    }
+    std::stringstream stream;
+    stream << message;
+    TcpClient::ToArgs(stream, args...);
+    return true;
+  }
+
+  // while disconnected, messages are queued for replay
+  void SendStr(const std::string& message);
+  // waits through reconnections; throws once the session is lost
+  std::string RecvStr(int ms_timeout);
+
+  void Close() noexcept;
+  bool IsActive() noexcept;
+  bool IsConnected() noexcept;
+
+  uint64_t GetSessionId() noexcept;
+  size_t GetUnacked() noexcept;
+
+ protected:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr uint64_t kAckPeriod = 32;
+
+  ResilienceOptions options_;
+  logging_foo logger_;
+
+  std::mutex mutex_;
+  std::condition_variable state_cv_;
+  bool is_active_ = true;
+  uint64_t session_id_ = 0;
+  std::shared_ptr<TcpClient> client_;
+  Clock::time_point detach_time_;
+
+  void Attach(std::shared_ptr<TcpClient> client, uint64_t peer_received);
+  void Detach(const std::shared_ptr<TcpClient>& client) noexcept;
+  uint64_t GetReceived() noexcept;
+  // true once the session stayed detached past its timeout
+  bool IsExpired() noexcept;
+
+ private:
+  struct Message {
+    uint64_t seq;
+    std::string body;
+  };
+
+  // keeps messages on the wire in sequence order
+  std::mutex send_mutex_;
+
+  uint64_t next_seq_ = 1;
+  std::deque<Message> unacked_;
+  uint64_t received_seq_ = 0;
+  uint64_t acked_received_ = 0;
+
+  void Acknowledge(uint64_t ack) noexcept;
+};
+
+class ResilientClient : public ResilientSession {
+ public:
+  ResilientClient(const char* addr, int port, int ms_ping_threshold,
+                  int ms_loop_period, const SocketOptions& socket_options,
+                  const ResilienceOptions& options,
+                  logging_foo f_logger = LoggerCap);
+  ResilientClient(const char* addr, int port,
+                  logging_foo f_logger = LoggerCap);
+  ~ResilientClient() override;
+
+ private:
+  std::string addr_;
+  int port_;
+  int ping_threshold_;
+  int loop_period_;
+  SocketOptions socket_options_;
+
+  std::mt19937 random_;
+  std::thread reconnect_thread_;
+
+  void Resume();
+  void ReconnectLoop() noexcept;
+};
+
+// Accepts resilient sessions from a TcpServer. Connections that resume a
+// known session are attached to it instead of being returned again
+class ResilientServer {
+ public:
+  ResilientServer(TcpServer& server,
+                  const ResilienceOptions& options = kDefResilienceOptions,
+                  logging_foo f_logger = LoggerCap);
+  ResilientServer(const ResilientServer&) = delete;
+  ~ResilientServer();
+
+  ResilientServer& operator=(const ResilientServer&) = delete;
+
+  std::shared_ptr<ResilientSession> AcceptSession();
+  // closes the listener of the underlying server
+  void Stop() noexcept;
+
+ private:
+  class Session : public ResilientSession {
+   public:
+    Session(uint64_t session_id, const ResilienceOptions& options,
+            logging_foo f_logger);
+
+    using ResilientSession::Attach;
+    using ResilientSession::GetReceived;
+    using ResilientSession::IsExpired;
+  };
+
+  // how often a shared memory connection is checked for its hello
+  static constexpr int kHelloPollPeriod = 10;
+
+  struct PendingHello {
+    std::shared_ptr<TcpClient> client;
+    TimerWheel::TimerId deadline = 0;
+    TimerWheel::TimerId poll_timer = 0;
+  };
+
+  TcpServer& server_;
+  ResilienceOptions options_;
+  logging_foo logger_;
+
+  std::atomic<bool> is_active_ = true;
+  std::mutex mutex_;
+  std::condition_variable accept_cv_;
+  bool is_accepting_ = true;
+  std::queue<std::shared_ptr<ResilientSession>> accepted_;
+  std::map<uint64_t, std::shared_ptr<Session>> sessions_;
+  // connections whose hello has fully arrived
+  std::condition_variable ready_cv_;
+  std::queue<std::shared_ptr<TcpClient>> ready_;
+
+  EventLoop* loop_;
+  // owned by the loop thread
+  TimerWheel::TimerId sweep_timer_ = 0;
+  std::map<uint64_t, PendingHello> hellos_;
+  uint64_t next_hello_ = 0;
+
+  std::thread accept_thread_;
+  std::thread handshake_thread_;
+
+  void AcceptLoop() noexcept;
+  void HandshakeLoop() noexcept;
+  void Handshake(std::shared_ptr<TcpClient> client, Logger& logger);
+  void Sweep() noexcept;
+
+  // loop thread only. A hello is read once it is whole, so a slow peer
+  // holds up nobody else
+  void AwaitHello(std::shared_ptr<TcpClient> client) noexcept;
+  void CheckHello(uint64_t id) noexcept;
+  void DropHello(uint64_t id) noexcept;
+};
+
+}  // namespace TCP
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "tcp-client.hpp"
+#include "tcp-event-loop.hpp"
+
+namespace TCP {
+
+const char kRpcRequest[] = "q";
+const char kRpcResponse[] = "r";
+const char kRpcFailure[] = "e";
+
+class RpcResponse {
+ public:
+  enum Status { Ok, Failure, Expired, Disconnected };
+
+  RpcResponse() noexcept = default;
+  RpcResponse(Status status, std::string body, logging_foo f_logger);
+
+  Status GetStatus() const noexcept;
+  bool IsOk() const noexcept;
+  const std::string& GetBody() const noexcept;
+
+  template <typename... Args>
+  void Get(Args&... args) const {
+    CheckStatus();
+    std::stringstream stream;
+    stream << body_;
+    TcpClient::ToArgs(stream, args...);
+  }
+
+ private:
+  Status status_ = Disconnected;
+  std::string body_;
+  logging_foo logger_ = LoggerCap;
+
+  void CheckStatus() const;
+};
+
+using RpcCallback = std::function<void(RpcResponse)>;
+
+class RpcClient {
+ public:
+  RpcClient(TcpClient& client, logging_foo f_logger = LoggerCap);
+  RpcClient(const RpcClient&) = delete;
+  ~RpcClient();
+
+  RpcClient& operator=(const RpcClient&) = delete;
+
+  template <typename... Args>
+  std::future<RpcResponse> Call(int ms_timeout, const std::string& method,
+                                const Args&... args) {
+    auto promise = std::make_shared<std::promise<RpcResponse>>();
+    auto future = promise->get_future();
+    CallAsync(
+        ms_timeout,
+        [promise](RpcResponse response) {
+          promise->set_value(std::move(response));
+        },
+        method, args...);
+    return future;
+  }
+
+  // callback is invoked from the receiver thread, or from the event loop
+  // thread when the request expires
+  template <typename... Args>
+  void CallAsync(int ms_timeout, RpcCallback callback,
+                 const std::string& method, const Args&... args) {
+    std::string body;
+    TcpClient::FromArgs(body, args...);
+    Request(ms_timeout, std::move(callback), method, body);
+  }
+
+  size_t GetInFlight();
+  void Stop() noexcept;
+
+ private:
+  struct Pending {
+    RpcCallback callback;
+    TimerWheel::TimerId deadline;
+  };
+
+  TcpClient& client_;
+  EventLoop* loop_;
+  logging_foo logger_;
+
+  std::atomic<bool> is_active_ = true;
+  uint64_t next_id_ = 1;
+  std::map<uint64_t, Pending> pending_;
+  std::mutex pending_mutex_;
+
+  std::thread receive_thread_;
+
+  void Request(int ms_timeout, RpcCallback callback, const std::string& method,
+               const std::string& body);
+  void ReceiveLoop() noexcept;
+  void Expire(uint64_t id) noexcept;
+  void FailAll(RpcResponse::Status status) noexcept;
+};
+
+class RpcServer;
+
+class RpcRequest {
+ public:
+  const std::string& GetMethod() const noexcept;
+  const std::string& GetBody() const noexcept;
+
+  template <typename... Args>
+  void Get(Args&... args) const {
+    std::stringstream stream;
+    stream << body_;
+    TcpClient::ToArgs(stream, args...);
+  }
+
+  template <typename... Args>
+  void Reply(const Args&... args) {
+    std::string body;
+    TcpClient::FromArgs(body, args...);
+    Respond(kRpcResponse, body);
+  }
+  void Fail(const std::string& reason);
+
+ private:
+  RpcServer* server_;
+  TcpClient* client_;
+  uint64_t id_;
+  std::string method_;
+  std::string body_;
+
+  RpcRequest(RpcServer* server, TcpClient* client, uint64_t id,
+             std::string method, std::string body);
+
+  void Respond(const char* kind, const std::string& body);
+
+  friend RpcServer;
+};
+
+using RpcHandler = std::function<void(RpcRequest&)>;
+
+class RpcServer {
+ public:
+  RpcServer(logging_foo f_logger = LoggerCap);
+
+  void Register(const std::string& method, RpcHandler handler);
+  bool Serve(TcpClient& client, int ms_timeout);
+
+ private:
+  std::map<std::string, RpcHandler> handlers_;
+  std::mutex handlers_mutex_;
+
+  logging_foo logger_;
+
+  void Respond(TcpClient& client, const char* kind, uint64_t id,
+               const std::string& body);
+
+  friend RpcRequest;
+};
+
+}  // namespace TCP
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+
+#include "tcp-supply.hpp"
+
+namespace TCP {
+
+struct SendRequest {
+  enum State { Pending, Done, Failed };
+  // set by the writer while it wakes the owner
+  static constexpr int kWaking = 1 << 2;
+
+  const char* data = nullptr;
+  size_t size = 0;
+  // file requests stream size bytes of fd starting from offset
+  int fd = -1;
+  off_t offset = 0;
+  // data already holds control block and terminator
+  bool is_framed = false;
+
+  char control_block[(kULLMaxDigits + 1) * 2] = {};
+  SendRequest* next = nullptr;
+
+  std::atomic<int> state = Pending;
+  int error = 0;
+
+  void Complete(bool is_sent, int send_error) noexcept;
+  // the final state, once the writer no longer touches the request and the
+  // owner may destroy it
+  State AwaitResult() const noexcept;
+};
+
+// Lock-free multi-producer queue with a single combining writer. Producers
+// push requests; whoever takes the writer lock flushes everything pending
+class SendQueue {
+ public:
+  static const int kMaxBatch = 256;
+
+  void Push(SendRequest* request) noexcept;
+  // returns pending requests in push order
+  SendRequest* TakeAll() noexcept;
+
+  bool TryLock() noexcept;
+  // returns true if requests were pushed while the lock was held
+  bool Unlock() noexcept;
+
+ private:
+  std::atomic<SendRequest*> head_ = nullptr;
+  std::atomic<bool> is_locked_ = false;
+};
+
+}  // namespace TCP
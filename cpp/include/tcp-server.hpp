@@ -1,51 +1,240 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
-#include <semaphore>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "tcp-client.hpp"
+#include "tcp-event-loop.hpp"
+#include "tcp-handshake-table.hpp"
+#include "tcp-rate-limit.hpp"
 
 namespace TCP {
 
+enum BroadcastPolicy {
+  // receivers whose socket buffer cannot take the message, or that still
+  // have queued broadcasts, miss it
+  SkipSlow,
+  // slow receivers get the message queued; broadcast workers send it once
+  // their socket buffer has room. Later broadcasts queue behind it
+  QueueSlow
+};
+
+struct BroadcastResult {
+  size_t sent = 0;
+  size_t skipped = 0;
+  size_t failed = 0;
+  // queued for slow receivers, not sent yet
+  size_t queued = 0;
+};
+
+struct Handoff {
+  // unix socket the new process waits on for the old one
+  std::string path;
+  int ms_timeout = 10000;
+};
+
 class TcpServer {
  public:
   TcpServer(int port, int ms_ping_threshold, int ms_loop_period,
             logging_foo f_logger = LoggerCap);
   TcpServer(int port, int ms_ping_threshold, logging_foo f_logger = LoggerCap);
   TcpServer(int port, logging_foo f_logger = LoggerCap);
+  TcpServer(int port, int ms_ping_threshold, int ms_loop_period,
+            const SocketOptions& options, logging_foo f_logger = LoggerCap);
+  TcpServer(int port, const SocketOptions& options,
+            logging_foo f_logger = LoggerCap);
+  TcpServer(const std::string& unix_path, int ms_ping_threshold,
+            int ms_loop_period, const SocketOptions& options,
+            logging_foo f_logger = LoggerCap);
+  TcpServer(const std::string& unix_path, int ms_ping_threshold,
+            int ms_loop_period, logging_foo f_logger = LoggerCap);
+  TcpServer(const std::string& unix_path, logging_foo f_logger = LoggerCap);
+  // zero-downtime restart, new process side: waits for HandOff of the old
+  // process and serves its listener. The inherited connections come out of
+  // AcceptConnection like new ones
+  TcpServer(const Handoff& handoff,
+            const SocketOptions& options = kDefSocketOptions,
+            logging_foo f_logger = LoggerCap);
   ~TcpServer();
 
+  // connections accepted before the listener closed are still returned,
+  // after them it throws ConnectionBreak
   TcpClient AcceptConnection();
+  // per-core handoff: only connections whose heartbeat runs on loop reactor
+  // of SocketOptions::reactors
+  TcpClient AcceptConnection(size_t reactor);
 
   void CloseListener() noexcept;
   bool IsListenerOpen() const noexcept;
 
+  // old process side: passes the listener, the handshakes in progress, the
+  // connections waiting in AcceptConnection and clients to the new process.
+  // clients must be idle. Only once the new process confirms are they
+  // stopped without disconnecting their peers and the listener closed here;
+  // otherwise everything resumes and the call throws. Both processes must
+  // run as the same user. Shared memory connections cannot move; queued
+  // ones stay in AcceptConnection here. Returns the number of connections
+  // handed off
+  size_t HandOff(const Handoff& handoff,
+                 const std::vector<TcpClient*>& clients);
+
+  // serializes and frames args once, then hands the same buffer to every
+  // client from several threads. Disconnected clients count as failed
+  template <typename... Args>
+  BroadcastResult Broadcast(const std::vector<TcpClient*>& clients,
+                            BroadcastPolicy policy, const Args&... args) {
+    std::string message;
+    TcpClient::FromArgs(message, args...);
+    return BroadcastFrame(clients, TcpClient::MakeFrame(message), policy);
+  }
+
+  HandshakeTable::Stats GetHandshakeStats();
+  // accepted connections that have not been stopped yet, queued included
+  int GetConnectionCount() const noexcept;
+  // peers turned away by admission control
+  uint64_t GetRejectedCount() const noexcept;
+
  private:
   static const int kMaxClientLength = 1024;
+  static constexpr size_t kBroadcastBatch = 64;
+  static constexpr size_t kMinBroadcastPerThread = 256;
+  // frames a slow receiver may lag behind before broadcasts skip it
+  static constexpr size_t kMaxBacklog = 1024;
+  // how soon a slow receiver with a full socket buffer is retried
+  static constexpr int kBacklogRetry = 10;
+  static constexpr size_t kHandoffRecordSize = 4096;
 
   int listener_;
-  bool is_active_ = true;
+  std::atomic<bool> is_active_ = true;
   int port_;
+  std::string unix_path_;
 
   int ping_threshold_;
   int loop_period_;
 
-  std::queue<TcpClient> accepted_;
-  std::mutex accept_mutex_;
-  std::counting_semaphore<kMaxClientLength> accepter_semaphore_ =
-      std::counting_semaphore<kMaxClientLength>(0);
+  SocketOptions options_;
+
+  struct AcceptQueue {
+    std::mutex mutex;
+    std::condition_variable accept_cv;
+    std::queue<TcpClient> accepted;
+  };
+
+  // one per reactor, so threads of different cores do not share a lock
+  std::vector<AcceptQueue> accept_queues_;
+  std::atomic<size_t> pending_ = 0;
+  std::atomic<size_t> next_queue_ = 0;
+  // wakes AcceptConnection calls that take from any queue
+  std::mutex any_mutex_;
+  std::condition_variable any_cv_;
+
+  std::shared_ptr<std::atomic<int>> live_counter_ =
+      std::make_shared<std::atomic<int>>(0);
+  std::atomic<uint64_t> rejected_ = 0;
+
+  static constexpr size_t kMessageSize = kULLMaxDigits + 1;
+
+  struct Handshake {
+    char message[kMessageSize + 1] = {};
+    size_t size = 0;
+    TimerWheel::TimerId deadline = 0;
+  };
 
-  std::map<uint64_t, int> uncomplete_client_;
+  // received in a handoff, adopted once the old process is told so
+  struct InheritedConnection {
+    int heartbeat_socket;
+    int main_socket;
+    int ping_threshold;
+    int loop_period;
+    int64_t flags;
+    std::string partial;
+  };
+  // password is 0 while the config is still being read
+  struct InheritedHandshake {
+    int socket;
+    uint64_t password;
+    std::string partial;
+  };
+
+  // owned by the loop thread
+  EventLoop* loop_;
+  TimerWheel::TimerId resume_timer_ = 0;
+  TimerWheel::TimerId expiry_timer_ = 0;
+  std::map<int, Handshake> handshakes_;
+  HandshakeTable uncomplete_client_;
+  TokenBucket accept_bucket_;
+
+  // broadcast workers, started by the first broadcast
+  using Clock = std::chrono::steady_clock;
+  using BacklogPtr = std::shared_ptr<TcpClient::Backlog>;
+  std::mutex workers_mutex_;
+  std::condition_variable workers_cv_;
+  bool is_working_ = true;
+  std::deque<std::function<void()>> jobs_;
+  std::deque<BacklogPtr> ready_;
+  std::deque<std::pair<Clock::time_point, BacklogPtr>> delayed_;
+  std::vector<std::thread> workers_;
 
   logging_foo logger_;
 
-  std::thread accept_thread_;
-  void AcceptLoop() noexcept;
+  void OnListenerReadable() noexcept;
+  void WatchHandshake(int client) noexcept;
+  void OnHandshakeReadable(int client) noexcept;
+  void OnHandshakeMessage(int client, const std::string& message) noexcept;
+  void DropHandshake(int client, bool is_closing) noexcept;
+  void ExpireHalfOpen() noexcept;
+  const char* CheckAdmission() noexcept;
+  void Reject(int client, const char* reason) noexcept;
+
+  BroadcastResult BroadcastFrame(const std::vector<TcpClient*>& clients,
+                                 const Buffer& frame, BroadcastPolicy policy);
+  // false when the frame cannot be queued
+  bool QueueFrame(TcpClient* client, const Buffer& frame) noexcept;
+  // runs task over batches of [0, count) on the caller and the workers
+  void RunParallel(size_t count, const std::function<void(size_t)>& task);
+  void StartWorkers();
+  void StopWorkers() noexcept;
+  void WorkLoop() noexcept;
+  void Drain(BacklogPtr backlog) noexcept;
+
+  void PushAccepted(TcpClient tcp_client);
+  void QueueAccepted(TcpClient tcp_client);
+  std::optional<TcpClient> TakeAccepted(AcceptQueue& queue);
+  void ReleaseAccepters() noexcept;
+
+  void StopListening(bool is_unlinking) noexcept;
+  int AwaitHandoff(const Handoff& handoff, Logger& logger);
+  void ReceiveHandoff(int channel, int ms_timeout,
+                      std::vector<InheritedConnection>& connections,
+                      std::vector<InheritedHandshake>& handshakes,
+                      Logger& logger);
+  void AdoptHandoff(std::vector<InheritedConnection>& connections,
+                    std::vector<InheritedHandshake>& handshakes,
+                    Logger& logger);
+  bool SendHandoff(int channel,
+                   const std::vector<InheritedHandshake>& handshakes,
+                   const std::vector<TcpClient*>& moving, Logger& logger);
 
   void ConnectListener();
+  void StartAccepting();
+  // loop thread only. Pausing keeps handshakes, so resuming continues them
+  void PauseAccepting() noexcept;
+  void ResumeAccepting();
+
+  int64_t GetSupportedFlags() const noexcept;
+  bool OfferShmChannel(int client, int64_t flags,
+                       ShmChannel*& shm_channel) noexcept;
 };
 
 }  // namespace TCP
\ No newline at end of file
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+
+#include "tcp-supply.hpp"
+
+namespace TCP {
+
+class ShmChannel {
+ public:
+  static const int kFdCount = 3;
+
+  ShmChannel(size_t ring_size, int us_spin, logging_foo f_logger);
+  ShmChannel(const int* fds, int us_spin, logging_foo f_logger);
+  ShmChannel(const ShmChannel&) = delete;
+  ~ShmChannel();
+
+  ShmChannel& operator=(const ShmChannel&) = delete;
+
+  const int* GetFds() const noexcept;
+
+  size_t Send(const char* data, size_t length, int ms_timeout) noexcept;
+  size_t Recv(char* data, size_t length, int ms_timeout) noexcept;
+  std::optional<int> WaitForData(int ms_timeout, Logger& logger);
+  // copies up to length received bytes without consuming them. Returns
+  // every byte received so far, which may be more than length
+  size_t Peek(char* data, size_t length) noexcept;
+  bool IsClosed() const noexcept;
+  // changes whenever the peer produces or consumes data
+  uint64_t GetTrafficMark() const noexcept;
+  // changes whenever the peer consumes data of this side
+  uint64_t GetDeliveredMark() const noexcept;
+
+  // marks both rings closed and wakes every waiter of both peers. The
+  // mapping stays, so threads still inside Send or Recv are safe
+  void Shutdown() noexcept;
+  void Close() noexcept;
+
+ private:
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+    std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> closed;
+  };
+  struct Header {
+    uint64_t ring_size;
+    Ring rings[2];
+  };
+
+  static const size_t kHeaderSize = 4096;
+
+  int fds_[kFdCount] = {-1, -1, -1};
+  bool is_server_;
+  int us_spin_;
+
+  size_t ring_size_ = 0;
+  size_t map_size_ = 0;
+  char* memory_ = nullptr;
+
+  Ring* tx_ = nullptr;
+  Ring* rx_ = nullptr;
+  char* tx_data_ = nullptr;
+  char* rx_data_ = nullptr;
+  int tx_event_ = -1;
+  int rx_event_ = -1;
+  // the peer's indices as last seen, which may only move forward
+  std::atomic<uint64_t> tx_tail_seen_ = 0;
+  std::atomic<uint64_t> rx_head_seen_ = 0;
+
+  logging_foo logger_;
+
+  void Map();
+
+  // the peer writes one index of each ring, so every load is checked
+  // before it sizes a copy. A violation shuts the channel down with EPIPE
+  bool LoadIndices(Ring* ring, std::atomic<uint64_t>& seen, bool is_head_seen,
+                   uint64_t& head, uint64_t& tail) noexcept;
+  bool IsReadable() const noexcept;
+  bool WaitForSpace(int ms_timeout) noexcept;
+};
+
+}  // namespace TCP
@@ -1,18 +1,25 @@
 #pragma once
 
+#include <sys/socket.h>
+
 #include <chrono>
 #include <concepts>
 #include <exception>
 #include <functional>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace TCP {
 
+class ReactorPool;
+
 enum MessagePriority { Error = 0, Warning = 1, Info = 2, Debug = 3 };
 using logging_foo = std::function<void(const std::string&, const std::string&,
                                        const std::string&, int priority)>;
 
+using chunk_foo = std::function<void(const char*, size_t)>;
+
 void LoggerCap(const std::string& l_module, const std::string& l_action,
                const std::string& l_event, int priority);
 
@@ -33,7 +40,10 @@ class TcpException : public std::exception {
 
     IncomeChecking,
 
-    Multithreading
+    Multithreading,
+
+    Timeout,
+    Remote
   };
 
   TcpException(ExceptionType type, logging_foo f_logger, int error = 0,
@@ -52,6 +62,9 @@ class TcpException : public std::exception {
 class Logger {
  public:
   void Log(const std::string& event, int priority);
+  void Log(const char* event, int priority);
+
+  bool IsEnabled() const noexcept;
 
  protected:
   logging_foo logger_;
@@ -68,7 +81,9 @@ class LServer : public Logger {
     FAccepter,
     FLoopAccepter,
     FConnectListener,
-    FCloseListener
+    FCloseListener,
+    FBroadcast,
+    FHandOff
   };
 
   LServer(LAction action, void* pointer, logging_foo logger);
@@ -93,7 +108,8 @@ class LClient : public Logger {
     FRecv,
     FIsAvailable,
     FStopClient,
-    FIsConnected
+    FIsConnected,
+    FConnectMany
   };
 
   LClient(LAction action, void* pointer, logging_foo logger);
@@ -105,6 +121,80 @@ class LClient : public Logger {
   std::string GetModule() const override;
   std::string GetAction() const override;
 };
+class LRpc : public Logger {
+ public:
+  enum LAction {
+    FConstructor,
+    FDestructor,
+    FCall,
+    FReceiveLoop,
+    FDispatch,
+    FReply
+  };
+
+  LRpc(LAction action, void* pointer, logging_foo logger);
+
+ private:
+  LAction action_;
+  void* pointer_ = nullptr;
+
+  std::string GetModule() const override;
+  std::string GetAction() const override;
+};
+class LEventLoop : public Logger {
+ public:
+  enum LAction { FConstructor, FDestructor, FLoop };
+
+  LEventLoop(LAction action, void* pointer, logging_foo logger);
+
+ private:
+  LAction action_;
+  void* pointer_ = nullptr;
+
+  std::string GetModule() const override;
+  std::string GetAction() const override;
+};
+class LResilient : public Logger {
+ public:
+  enum LAction {
+    FConstructor,
+    FDestructor,
+    FSend,
+    FRecv,
+    FReconnectLoop,
+    FAccepter,
+    FSweeper
+  };
+
+  LResilient(LAction action, void* pointer, logging_foo logger);
+
+ private:
+  LAction action_;
+  void* pointer_ = nullptr;
+
+  std::string GetModule() const override;
+  std::string GetAction() const override;
+};
+class LPubSub : public Logger {
+ public:
+  enum LAction {
+    FConstructor,
+    FDestructor,
+    FPublish,
+    FAccepter,
+    FController,
+    FSender
+  };
+
+  LPubSub(LAction action, void* pointer, logging_foo logger);
+
+ private:
+  LAction action_;
+  void* pointer_ = nullptr;
+
+  std::string GetModule() const override;
+  std::string GetAction() const override;
+};
 class LException : public Logger {
  public:
   LException(logging_foo logger);
@@ -116,15 +206,126 @@ class LException : public Logger {
 
 const int kULLMaxDigits = 20;
 
+const size_t kStreamChunkSize = 1 << 16;
+
 const int kDefPingThreshold = 1000;
 const int kDefLoopPeriod = 100;
 
+struct SocketOptions {
+  bool no_delay = false;
+  bool quick_ack = false;
+  int send_buffer = 0;
+  int receive_buffer = 0;
+  // microseconds, best effort: raising it above net.core.busy_poll needs
+  // CAP_NET_ADMIN, so a refusal is not treated as an error
+  int busy_poll = 0;
+  int ms_user_timeout = 0;
+  // happy eyeballs: head start of each candidate address before the next
+  // one joins the connection race
+  int ms_attempt_delay = 250;
+
+  bool keep_alive = true;
+  int keep_idle = 60;
+  int keep_interval = 60;
+  int keep_count = 3;
+
+  int listen_backlog = 1024;
+  // peers that got a password but have not opened their main socket yet
+  int max_half_open = 4096;
+  // admission control, 0 disables a limit. Peers over a limit get the term
+  // signal right after their config instead of a password. max_pending
+  // bounds connections waiting in AcceptConnection's queue
+  int max_pending = 1024;
+  int max_connections = 0;
+  // accepted connections per second, with bursts of up to accept_burst
+  double accept_rate = 0;
+  int accept_burst = 64;
+
+  // main traffic toward the peer replaces heartbeat pings while it flows; a
+  // side that hears nothing asks for a ping
+  bool piggyback_liveness = true;
+  // phi-accrual suspicion at which the peer is declared lost before the ping
+  // threshold passes. A steady link then needs about four silent loop
+  // periods. 0 keeps the fixed ping threshold alone
+  double phi_threshold = 8;
+
+  // applies to unix domain connections only, where both peers share the host
+  bool shared_memory = true;
+  int shm_ring_size = 1 << 20;
+  int us_shm_spin = 0;
+
+  // heartbeats run on a loop of this pool instead of the default loop, main
+  // socket I/O is not moved. An accepting server hands connections out
+  // through one queue per loop
+  ReactorPool* reactors = nullptr;
+};
+
+const SocketOptions kDefSocketOptions = {};
+const SocketOptions kLowLatencyOptions = {.no_delay = true,
+                                          .quick_ack = true,
+                                          .busy_poll = 50,
+                                          .ms_user_timeout = 5000,
+                                          .keep_idle = 10,
+                                          .keep_interval = 5,
+                                          .keep_count = 3,
+                                          .us_shm_spin = 50};
+const SocketOptions kBulkThroughputOptions = {.send_buffer = 4 << 20,
+                                              .receive_buffer = 4 << 20,
+                                              .ms_user_timeout = 30000};
+
+const char kUnixPrefix[] = "unix:";
+
+enum HandshakeFlag { ShmTransport = 1 << 0, PiggybackLiveness = 1 << 1 };
+int64_t GetHandshakeFlags(const std::string& message) noexcept;
+
+bool WriteAll(int fd, const char* data, size_t length) noexcept;
+bool DrainPipe(int pipe_out, int fd, size_t length, bool& direct) noexcept;
+
+bool SendFds(int dp, const int* fds, int count) noexcept;
+// whether the peer of a unix socket runs as the effective user of this
+// process
+bool IsSameUser(int dp) noexcept;
+int RecvFds(int dp, int* fds, int count) noexcept;
+// one message with descriptors attached, for message preserving sockets.
+// RecvRecord sets length to the received size and returns like RecvFds
+bool SendRecord(int dp, const char* data, size_t length, const int* fds,
+                int count) noexcept;
+int RecvRecord(int dp, char* data, size_t& length, int* fds,
+               int count) noexcept;
+
+bool IsUnixAddress(const char* addr) noexcept;
+// removes a socket file left by a dead listener. Fails with EADDRINUSE when
+// the path is live or not a socket, so nothing else gets deleted
+bool UnlinkStaleSocket(const std::string& path) noexcept;
+std::optional<socklen_t> MakeAddress(const char* addr, int port,
+                                     sockaddr_storage& storage) noexcept;
+
+struct Endpoint {
+  sockaddr_storage addr;
+  socklen_t length;
+};
+
+// numeric addresses, host names and unix paths. Inet results alternate
+// between address families, preferred family first
+std::vector<Endpoint> ResolveAddress(const char* addr, int port,
+                                     Logger& logger) noexcept;
+// races the endpoints in order, starting the next one after
+// ms_attempt_delay or as soon as an attempt fails. Returns the first
+// connected blocking socket and sets winner, or -1 with errno set
+int ConnectFastest(const std::vector<Endpoint>& endpoints,
+                   const SocketOptions& options, size_t& winner) noexcept;
+
 std::optional<int> WaitForData(int dp, int ms_timeout, Logger& logger,
                                logging_foo log_foo);
 ssize_t RawSend(int dp, std::string message, size_t length) noexcept;
 std::string RawRecv(int dp, size_t length) noexcept;
 
 bool SetKeepIdle(int dp) noexcept;
+bool SetSocketOptions(int dp, const SocketOptions& options) noexcept;
+void SetQuickAck(int dp) noexcept;
+
+// from the kernel CSPRNG, for values a peer must not be able to guess
+bool GetSecureRandom(uint64_t& value) noexcept;
 
 template <typename T>
 concept IFriendly = requires(T val) {
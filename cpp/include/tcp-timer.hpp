@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace TCP {
+
+using task_foo = std::function<void()>;
+
+// Hierarchical timing wheel with millisecond ticks on the steady clock.
+// Schedule and Cancel are O(1); timers further than kMaxDelay are clamped
+class TimerWheel {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using TimerId = uint64_t;
+
+  static constexpr int kLevelBits = 6;
+  static constexpr int kLevelSize = 1 << kLevelBits;
+  static constexpr int kLevelCount = 4;
+  static constexpr int64_t kMaxDelay = (1LL << (kLevelBits * kLevelCount)) - 1;
+
+  TimerWheel();
+
+  TimerId Schedule(int64_t ms_delay, task_foo callback);
+  bool Cancel(TimerId id) noexcept;
+
+  // advances the wheel up to now and takes one due callback
+  bool PopExpired(Clock::time_point now, task_foo& callback);
+  // time until the wheel has to be advanced again, none if it is empty
+  std::optional<int64_t> GetMsToNext(Clock::time_point now) const noexcept;
+
+  size_t GetSize() const noexcept;
+
+ private:
+  static constexpr int32_t kNone = -1;
+  static constexpr int kListCount = kLevelSize * kLevelCount + 1;
+  static constexpr int kExpiredList = kListCount - 1;
+
+  struct Node {
+    task_foo callback;
+    int64_t expires = 0;
+    uint32_t generation = 1;
+    int32_t prev = kNone;
+    int32_t next = kNone;
+    int list = kNone;
+  };
+
+  Clock::time_point start_;
+  int64_t current_ = 0;
+  size_t size_ = 0;
+
+  std::vector<Node> nodes_;
+  int32_t free_ = kNone;
+  int32_t heads_[kListCount];
+  uint64_t occupied_[kLevelCount] = {};
+
+  int64_t GetTick(Clock::time_point time) const noexcept;
+
+  void Place(int32_t index) noexcept;
+  void Link(int32_t index, int list) noexcept;
+  void Unlink(int32_t index) noexcept;
+  void Release(int32_t index) noexcept;
+
+  void Step() noexcept;
+  void Cascade(int level, int slot) noexcept;
+};
+
+}  // namespace TCP
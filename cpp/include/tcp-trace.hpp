@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace TCP {
+
+enum TraceStage {
+  TSerialize,
+  TFrame,
+  TKernelSend,
+  // one-way estimate from the sender stamp, needs synchronized clocks
+  // between hosts
+  TWire,
+  TWait,
+  TKernelRecv,
+  TDeserialize
+};
+
+// Sampled per-message stage timings. Every thread records into its own ring,
+// so tracing takes no lock on the message path. Stages are measured from the
+// previous mark of the same message
+class Tracer {
+ public:
+  static constexpr size_t kRingSize = 1 << 13;
+
+  // traces every sample_period-th message of each thread. With stamping,
+  // sampled frames carry the sender clock and are traced by the receiver
+  // too
+  static void Enable(uint32_t sample_period, bool is_stamping = false);
+  static void Disable() noexcept;
+  static bool IsEnabled() noexcept {
+    return is_enabled_.load(std::memory_order_relaxed);
+  }
+
+  // Chrome trace_event JSON. Rings keep overwriting while tracing is on, so
+  // export after Disable for a consistent snapshot
+  static std::string ExportChrome();
+  static void Clear() noexcept;
+
+  // monotonic nanoseconds
+  static int64_t Now() noexcept;
+  // starts the message of this thread at start when it is sampled. A
+  // message with a sender stamp is always sampled
+  static void Begin(int64_t start, int64_t stamp = 0) noexcept;
+  static void Mark(TraceStage stage) noexcept {
+    if (message_ != 0) {
+      Record(stage);
+    }
+  }
+  static void End() noexcept { message_ = 0; }
+
+  // sender clock for the frame of the current message, 0 when not stamping
+  static int64_t GetStamp() noexcept;
+
+ private:
+  static inline std::atomic<bool> is_enabled_ = false;
+
+  static inline thread_local uint64_t message_ = 0;
+  static inline thread_local int64_t mark_ = 0;
+
+  static void Record(TraceStage stage) noexcept;
+};
+
+}  // namespace TCP
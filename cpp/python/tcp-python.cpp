@@ -0,0 +1,355 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <exception>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "tcp-client.hpp"
+
+// Native counterpart of tcp_client.py. Blocking calls run without the GIL,
+// and heartbeats live on the library event loop, so Python threads never
+// compete with them
+
+namespace {
+
+const int kPyPingThreshold = 1000;
+const int kPyLoopPeriod = 100;
+
+struct PyTcpClient {
+  PyObject_HEAD TCP::TcpClient* client;
+};
+
+// owns a received message so memoryviews can share its storage
+struct PyMessage {
+  PyObject_HEAD std::string* data;
+};
+
+PyObject* SetError(const TCP::TcpException& exception) {
+  if (exception.GetErrno() != 0) {
+    PyObject* args =
+        Py_BuildValue("(is)", exception.GetErrno(), exception.what());
+    if (args != nullptr) {
+      PyErr_SetObject(PyExc_OSError, args);
+      Py_DECREF(args);
+    }
+    return nullptr;
+  }
+  PyObject* type = PyExc_RuntimeError;
+  switch (exception.GetType()) {
+    case TCP::TcpException::ConnectionBreak:
+      type = PyExc_ConnectionResetError;
+      break;
+    case TCP::TcpException::Connection:
+      type = PyExc_ConnectionError;
+      break;
+    case TCP::TcpException::Receiving:
+    case TCP::TcpException::Timeout:
+      type = PyExc_TimeoutError;
+      break;
+    default:
+      break;
+  }
+  PyErr_SetString(type, exception.what());
+  return nullptr;
+}
+
+template <typename Foo>
+bool CallWithoutGil(Foo foo) {
+  std::optional<TCP::TcpException> tcp_error;
+  std::optional<std::string> error;
+  Py_BEGIN_ALLOW_THREADS try {
+    foo();
+  } catch (TCP::TcpException& exception) {
+    tcp_error = exception;
+  } catch (std::exception& exception) {
+    error = exception.what();
+  }
+  Py_END_ALLOW_THREADS
+
+  if (tcp_error.has_value()) {
+    SetError(tcp_error.value());
+    return false;
+  }
+  if (error.has_value()) {
+    PyErr_SetString(PyExc_RuntimeError, error->c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CheckClient(PyTcpClient* self) {
+  if (self->client == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "Client is not constructed");
+    return false;
+  }
+  return true;
+}
+
+// str and bytes-like arguments are sent as is, anything else through str()
+bool AppendArg(std::string& output, PyObject* arg) {
+  if (!output.empty()) {
+    output.push_back(' ');
+  }
+  if (PyObject_CheckBuffer(arg)) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_SIMPLE) < 0) {
+      return false;
+    }
+    output.append(static_cast<const char*>(view.buf), view.len);
+    PyBuffer_Release(&view);
+    return true;
+  }
+
+  PyObject* str = PyUnicode_Check(arg) ? Py_NewRef(arg) : PyObject_Str(arg);
+  if (str == nullptr) {
+    return false;
+  }
+  Py_ssize_t size;
+  const char* data = PyUnicode_AsUTF8AndSize(str, &size);
+  if (data != nullptr) {
+    output.append(data, size);
+  }
+  Py_DECREF(str);
+  return data != nullptr;
+}
+
+/*-------------------------------- Message -----------------------------------*/
+
+void MessageDealloc(PyMessage* self) {
+  delete self->data;
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+int MessageGetBuffer(PyMessage* self, Py_buffer* view, int flags) {
+  return PyBuffer_FillInfo(view, reinterpret_cast<PyObject*>(self),
+                           self->data->data(), self->data->size(), 1, flags);
+}
+
+PyBufferProcs kMessageBuffer = {
+    reinterpret_cast<getbufferproc>(MessageGetBuffer), nullptr};
+
+PyTypeObject kMessageType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+/*-------------------------------- TcpClient ---------------------------------*/
+
+int ClientInit(PyTcpClient* self, PyObject* args, PyObject* kwargs) {
+  static const char* kKeywords[] = {"host", "port", "ms_ping_threshold",
+                                    "ms_loop_period", nullptr};
+  const char* host;
+  int port;
+  int ping_threshold = kPyPingThreshold;
+  int loop_period = kPyLoopPeriod;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|ii",
+                                   const_cast<char**>(kKeywords), &host,
+                                   &port, &ping_threshold, &loop_period)) {
+    return -1;
+  }
+  if (self->client != nullptr) {
+    PyErr_SetString(PyExc_RuntimeError, "Client is already constructed");
+    return -1;
+  }
+
+  std::string addr = host;
+  auto* client = new TCP::TcpClient();
+  if (!CallWithoutGil([&] {
+        client->Connect(addr.c_str(), port, ping_threshold, loop_period);
+      })) {
+    delete client;
+    return -1;
+  }
+  self->client = client;
+  return 0;
+}
+
+void ClientDealloc(PyTcpClient* self) {
+  TCP::TcpClient* client = std::exchange(self->client, nullptr);
+  if (client != nullptr) {
+    Py_BEGIN_ALLOW_THREADS delete client;
+    Py_END_ALLOW_THREADS
+  }
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+PyObject* ClientStopClient(PyTcpClient* self, PyObject*) {
+  if (self->client != nullptr) {
+    TCP::TcpClient* client = self->client;
+    Py_BEGIN_ALLOW_THREADS client->StopClient();
+    Py_END_ALLOW_THREADS
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject* ClientIsConnected(PyTcpClient* self, PyObject*) {
+  return PyBool_FromLong(self->client != nullptr &&
+                         self->client->IsConnected());
+}
+
+PyObject* ClientIsAvailable(PyTcpClient* self, PyObject*) {
+  if (!CheckClient(self)) {
+    return nullptr;
+  }
+  bool is_available = false;
+  if (!CallWithoutGil(
+          [&] { is_available = self->client->IsAvailable(); })) {
+    return nullptr;
+  }
+  return PyBool_FromLong(is_available);
+}
+
+PyObject* ClientGetPing(PyTcpClient* self, PyObject*) {
+  if (!CheckClient(self)) {
+    return nullptr;
+  }
+  try {
+    return PyLong_FromLong(self->client->GetPing());
+  } catch (TCP::TcpException& exception) {
+    return SetError(exception);
+  }
+}
+
+PyObject* ClientGetMsPingThreshold(PyTcpClient* self, PyObject*) {
+  if (!CheckClient(self)) {
+    return nullptr;
+  }
+  return PyLong_FromLong(self->client->GetMsPingThreshold());
+}
+
+PyObject* ClientSend(PyTcpClient* self, PyObject* args) {
+  if (!CheckClient(self)) {
+    return nullptr;
+  }
+  std::string message;
+  for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(args); ++i) {
+    if (!AppendArg(message, PyTuple_GET_ITEM(args, i))) {
+      return nullptr;
+    }
+  }
+  if (!CallWithoutGil(
+          [&] { self->client->Send(std::string_view(message)); })) {
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+std::optional<std::string> Receive(PyTcpClient* self, PyObject* args) {
+  int ms_timeout;
+  if (!CheckClient(self) || !PyArg_ParseTuple(args, "i", &ms_timeout)) {
+    return {};
+  }
+  std::string message;
+  if (!CallWithoutGil(
+          [&] { message = self->client->RecvStr(ms_timeout); })) {
+    return {};
+  }
+  return message;
+}
+
+PyObject* ClientReceive(PyTcpClient* self, PyObject* args) {
+  auto message = Receive(self, args);
+  if (!message.has_value()) {
+    return nullptr;
+  }
+  if (message->empty()) {
+    return PyList_New(0);
+  }
+  PyObject* str = PyUnicode_DecodeUTF8(message->data(), message->size(),
+                                       "surrogateescape");
+  if (str == nullptr) {
+    return nullptr;
+  }
+  PyObject* separator = PyUnicode_FromString(" ");
+  PyObject* result =
+      separator == nullptr ? nullptr : PyUnicode_Split(str, separator, -1);
+  Py_XDECREF(separator);
+  Py_DECREF(str);
+  return result;
+}
+
+PyObject* ClientReceiveView(PyTcpClient* self, PyObject* args) {
+  auto message = Receive(self, args);
+  if (!message.has_value()) {
+    return nullptr;
+  }
+  if (message->empty()) {
+    Py_RETURN_NONE;
+  }
+  PyMessage* holder = PyObject_New(PyMessage, &kMessageType);
+  if (holder == nullptr) {
+    return nullptr;
+  }
+  holder->data = new std::string(std::move(message.value()));
+  PyObject* view =
+      PyMemoryView_FromObject(reinterpret_cast<PyObject*>(holder));
+  Py_DECREF(holder);
+  return view;
+}
+
+PyMethodDef kClientMethods[] = {
+    {"StopClient", reinterpret_cast<PyCFunction>(ClientStopClient),
+     METH_NOARGS, nullptr},
+    {"IsConnected", reinterpret_cast<PyCFunction>(ClientIsConnected),
+     METH_NOARGS, nullptr},
+    {"IsAvailable", reinterpret_cast<PyCFunction>(ClientIsAvailable),
+     METH_NOARGS, nullptr},
+    {"GetPing", reinterpret_cast<PyCFunction>(ClientGetPing), METH_NOARGS,
+     nullptr},
+    {"GetMsPingThreshold",
+     reinterpret_cast<PyCFunction>(ClientGetMsPingThreshold), METH_NOARGS,
+     nullptr},
+    {"Send", reinterpret_cast<PyCFunction>(ClientSend), METH_VARARGS,
+     "Send(*args): joins args with spaces and sends them as one message"},
+    {"Receive", reinterpret_cast<PyCFunction>(ClientReceive), METH_VARARGS,
+     "Receive(ms_timeout) -> list of space separated words, [] on timeout"},
+    {"ReceiveView", reinterpret_cast<PyCFunction>(ClientReceiveView),
+     METH_VARARGS,
+     "ReceiveView(ms_timeout) -> memoryview of the message without copying, "
+     "None on timeout"},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyTypeObject kClientType = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyModuleDef kModule = {PyModuleDef_HEAD_INIT, "c_tcp_client",
+                       "Native client for c_tcp servers", -1};
+
+bool InitTypes() {
+  kMessageType.tp_name = "c_tcp_client.Message";
+  kMessageType.tp_basicsize = sizeof(PyMessage);
+  kMessageType.tp_dealloc = reinterpret_cast<destructor>(MessageDealloc);
+  kMessageType.tp_as_buffer = &kMessageBuffer;
+  kMessageType.tp_flags = Py_TPFLAGS_DEFAULT;
+  kMessageType.tp_doc = "Read-only buffer holding one received message";
+
+  kClientType.tp_name = "c_tcp_client.TcpClient";
+  kClientType.tp_basicsize = sizeof(PyTcpClient);
+  kClientType.tp_dealloc = reinterpret_cast<destructor>(ClientDealloc);
+  kClientType.tp_flags = Py_TPFLAGS_DEFAULT;
+  kClientType.tp_doc =
+      "TcpClient(host, port, ms_ping_threshold=1000, ms_loop_period=100)";
+  kClientType.tp_methods = kClientMethods;
+  kClientType.tp_init = reinterpret_cast<initproc>(ClientInit);
+  kClientType.tp_new = PyType_GenericNew;
+
+  return PyType_Ready(&kMessageType) == 0 && PyType_Ready(&kClientType) == 0;
+}
+
+}  // namespace
+
+PyMODINIT_FUNC PyInit_c_tcp_client() {
+  if (!InitTypes()) {
+    return nullptr;
+  }
+  PyObject* module = PyModule_Create(&kModule);
+  if (module == nullptr) {
+    return nullptr;
+  }
+  Py_INCREF(&kClientType);
+  if (PyModule_AddObject(module, "TcpClient",
+                         reinterpret_cast<PyObject*>(&kClientType)) < 0) {
+    Py_DECREF(&kClientType);
+    Py_DECREF(module);
+    return nullptr;
+  }
+  return module;
+}
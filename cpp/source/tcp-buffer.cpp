@@ -0,0 +1,183 @@
+#include "tcp-buffer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+
+namespace TCP {
+
+namespace {
+
+const size_t kClassCount = std::countr_zero(BufferPool::kMaxClassSize) -
+                           std::countr_zero(BufferPool::kMinClassSize) + 1;
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+struct ThreadCache {
+  FreeBlock* heads[kClassCount] = {};
+  size_t counts[kClassCount] = {};
+  bool is_alive = true;
+
+  ~ThreadCache() {
+    is_alive = false;
+    for (size_t i = 0; i < kClassCount; ++i) {
+      while (heads[i] != nullptr) {
+        FreeBlock* block = heads[i];
+        heads[i] = block->next;
+        ::operator delete(block);
+      }
+    }
+  }
+};
+
+thread_local ThreadCache cache;
+
+size_t GetClassIndex(size_t class_size) noexcept {
+  return std::countr_zero(class_size) -
+         std::countr_zero(BufferPool::kMinClassSize);
+}
+
+}  // namespace
+
+size_t BufferPool::GetClassSize(size_t size) noexcept {
+  if (size > kMaxClassSize) {
+    return size;
+  }
+  return std::bit_ceil(std::max(size, kMinClassSize));
+}
+
+void* BufferPool::Allocate(size_t size) {
+  size_t class_size = GetClassSize(size);
+  if (class_size > kMaxClassSize || !cache.is_alive) {
+    return ::operator new(class_size);
+  }
+
+  size_t index = GetClassIndex(class_size);
+  FreeBlock* block = cache.heads[index];
+  if (block == nullptr) {
+    return ::operator new(class_size);
+  }
+  cache.heads[index] = block->next;
+  --cache.counts[index];
+  return block;
+}
+
+void BufferPool::Free(void* pointer, size_t size) noexcept {
+  if (pointer == nullptr) {
+    return;
+  }
+  size_t class_size = GetClassSize(size);
+  if (class_size > kMaxClassSize || !cache.is_alive) {
+    ::operator delete(pointer);
+    return;
+  }
+
+  size_t index = GetClassIndex(class_size);
+  size_t max_cached = std::max<size_t>(kMaxCachedBytes / class_size, 2);
+  if (cache.counts[index] >= max_cached) {
+    ::operator delete(pointer);
+    return;
+  }
+  auto* block = static_cast<FreeBlock*>(pointer);
+  block->next = cache.heads[index];
+  cache.heads[index] = block;
+  ++cache.counts[index];
+}
+
+Buffer::Buffer(size_t size) {
+  size_t capacity = BufferPool::GetClassSize(sizeof(Header) + size) -
+                    sizeof(Header);
+  header_ = new (BufferPool::Allocate(sizeof(Header) + capacity))
+      Header{1, capacity, size};
+}
+Buffer::Buffer(const Buffer& other) noexcept : header_(other.header_) {
+  if (header_ != nullptr) {
+    header_->references.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+Buffer::Buffer(Buffer&& other) noexcept : header_(other.header_) {
+  other.header_ = nullptr;
+}
+Buffer::~Buffer() { Reset(); }
+
+Buffer& Buffer::operator=(const Buffer& other) noexcept {
+  if (header_ != other.header_) {
+    Buffer copy(other);
+    std::swap(header_, copy.header_);
+  }
+  return *this;
+}
+Buffer& Buffer::operator=(Buffer&& other) noexcept {
+  if (this != &other) {
+    Reset();
+    header_ = other.header_;
+    other.header_ = nullptr;
+  }
+  return *this;
+}
+
+char* Buffer::Data() const noexcept {
+  return header_ == nullptr ? nullptr
+                            : reinterpret_cast<char*>(header_ + 1);
+}
+size_t Buffer::Size() const noexcept {
+  return header_ == nullptr ? 0 : header_->size;
+}
+size_t Buffer::Capacity() const noexcept {
+  return header_ == nullptr ? 0 : header_->capacity;
+}
+bool Buffer::IsUnique() const noexcept {
+  return header_ != nullptr && header_->references.load() == 1;
+}
+bool Buffer::IsEmpty() const noexcept { return Size() == 0; }
+
+void Buffer::Resize(size_t size) {
+  if (header_ != nullptr && size <= header_->capacity && IsUnique()) {
+    header_->size = size;
+    return;
+  }
+  Buffer resized(size);
+  memcpy(resized.Data(), Data(), std::min(size, Size()));
+  *this = std::move(resized);
+}
+
+void Buffer::Reset() noexcept {
+  if (header_ == nullptr) {
+    return;
+  }
+  if (header_->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    size_t capacity = header_->capacity;
+    header_->~Header();
+    BufferPool::Free(header_, sizeof(Header) + capacity);
+  }
+  header_ = nullptr;
+}
+
+void* PoolResource::do_allocate(size_t bytes, size_t alignment) {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    return ::operator new(bytes, std::align_val_t(alignment));
+  }
+  return BufferPool::Allocate(bytes);
+}
+void PoolResource::do_deallocate(void* pointer, size_t bytes,
+                                 size_t alignment) {
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    ::operator delete(pointer, std::align_val_t(alignment));
+    return;
+  }
+  BufferPool::Free(pointer, bytes);
+}
+bool PoolResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  return dynamic_cast<const PoolResource*>(&other) != nullptr;
+}
+
+std::pmr::memory_resource* GetPoolResource() noexcept {
+  static PoolResource resource;
+  return &resource;
+}
+
+}  // namespace TCP
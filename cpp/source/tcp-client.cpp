@@ -3,12 +3,17 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <limits>
 #include <list>
 #include <string>
 #include <vector>
@@ -25,65 +30,81 @@ TcpClient::TcpClient(const char* addr, int port, int ms_ping_threshold,
     : TcpClient(addr, port, ms_ping_threshold, kDefLoopPeriod, f_logger) {}
 TcpClient::TcpClient(const char* addr, int port, TCP::logging_foo f_logger)
     : TcpClient(addr, port, kDefPingThreshold, kDefLoopPeriod, f_logger) {}
+TcpClient::TcpClient(const char* addr, int port, int ms_ping_threshold,
+                     int ms_loop_period, const SocketOptions& options,
+                     logging_foo f_logger) {
+  Connect(addr, port, ms_ping_threshold, ms_loop_period, options, f_logger);
+}
+TcpClient::TcpClient(const char* addr, int port, const SocketOptions& options,
+                     logging_foo f_logger)
+    : TcpClient(addr, port, kDefPingThreshold, kDefLoopPeriod, options,
+                f_logger) {}
 
 TcpClient::TcpClient(TCP::TcpClient&& other) noexcept
     : main_socket_(other.main_socket_),
       heartbeat_socket_(other.heartbeat_socket_),
       ping_threshold_(other.ping_threshold_),
       loop_period_(other.loop_period_),
-      heartbeat_thread_(std::move(other.heartbeat_thread_)),
-      this_pointer_(other.this_pointer_),
-      this_mutex_(other.this_mutex_),
-      is_active_(other.is_active_),
-      ms_ping_(other.ms_ping_),
+      send_room_(other.send_room_),
+      options_(other.options_),
+      shm_channel_(other.shm_channel_),
+      send_queue_(other.send_queue_),
+      heartbeat_(other.heartbeat_),
+      reactor_(other.reactor_),
+      live_counter_(std::move(other.live_counter_)),
+      flags_(other.flags_),
+      backlog_(other.backlog_.exchange(nullptr)),
+      is_active_(other.is_active_.load()),
       logger_(other.logger_) {
+  AdoptBacklog();
+  other.main_socket_ = -1;
+  other.heartbeat_socket_ = -1;
+  other.shm_channel_ = nullptr;
+  other.send_queue_ = nullptr;
+  other.heartbeat_ = nullptr;
   if (!is_active_) {
     return;
   }
   LClient logger(LClient::FMoveConstructor, this, logger_);
   logger.Log("Building TCP-Client via move constructor", Debug);
 
-  logger.Log("Locking mutex", Debug);
-  this_mutex_->lock();
-  logger.Log("Mutex locked", Debug);
-  *this_pointer_ = this;
-  this_mutex_->unlock();
-
   other.is_active_ = false;
   logger.Log("TCP-Client is built via move constructor", Info);
 }
 TcpClient::TcpClient(int heartbeat_socket, int main_socket, int ping_threshold,
-                     int loop_period, logging_foo f_logger)
+                     int loop_period, const SocketOptions& options,
+                     int64_t flags, ShmChannel* shm_channel,
+                     logging_foo f_logger, HeartBeat::Role role,
+                     const std::string& heartbeat_partial)
     : heartbeat_socket_(heartbeat_socket),
       main_socket_(main_socket),
       ping_threshold_(ping_threshold),
       loop_period_(loop_period),
+      options_(options),
+      shm_channel_(shm_channel),
+      flags_(flags),
       logger_(f_logger) {
   LClient logger(LClient::FFromServerConstructor, this, logger_);
   logger.Log("Building TCP-Client via move constructor", Debug);
 
-  is_active_ = true;
-
-  logger.Log("Creating heartbeat thread", Debug);
+  logger.Log("Starting heartbeat", Debug);
   try {
-    this_pointer_ = new TcpClient*(this);
-    this_mutex_ = new std::mutex();
-
-    heartbeat_thread_ =
-        std::thread(HeartBeatServer, this_pointer_, this_mutex_);
+    send_queue_ = new SendQueue();
+    StartHeartBeat(role, heartbeat_partial);
   } catch (std::exception& exception) {
-    logger.Log("Error while creating thread", Error);
+    logger.Log("Error while starting heartbeat", Error);
     close(heartbeat_socket_);
     close(main_socket_);
-    delete this_pointer_;
-    delete this_mutex_;
+    delete shm_channel_;
+    delete send_queue_;
 
-    throw exception;
+    throw;
   }
+  is_active_ = true;
   logger.Log("TCP-Client is built via server constructor", Info);
 }
 TcpClient::~TcpClient() {
-  StopClient();
+  Release();
 
   LClient(LClient::FDestructor, this, logger_)
       .Log("TCP-Client destructed", Info);
@@ -94,17 +115,31 @@ TcpClient& TcpClient::operator=(TCP::TcpClient&& other) {
   logger.Log("Method run from " + GetAddress(&other), Info);
   logger.Log("Stopping client", Debug);
 
-  StopClient();
+  if (this == &other) {
+    return *this;
+  }
+  Release();
   main_socket_ = other.main_socket_;
   heartbeat_socket_ = other.heartbeat_socket_;
   ping_threshold_ = other.ping_threshold_;
   loop_period_ = other.loop_period_;
-  heartbeat_thread_ = std::move(other.heartbeat_thread_);
-  this_pointer_ = other.this_pointer_;
-  this_mutex_ = other.this_mutex_;
-  is_active_ = other.is_active_;
-  ms_ping_ = other.ms_ping_;
+  send_room_ = other.send_room_;
+  options_ = other.options_;
+  shm_channel_ = other.shm_channel_;
+  send_queue_ = other.send_queue_;
+  heartbeat_ = other.heartbeat_;
+  reactor_ = other.reactor_;
+  live_counter_ = std::move(other.live_counter_);
+  flags_ = other.flags_;
+  backlog_ = other.backlog_.exchange(nullptr);
+  AdoptBacklog();
+  is_active_ = other.is_active_.load();
   logger_ = other.logger_;
+  other.main_socket_ = -1;
+  other.heartbeat_socket_ = -1;
+  other.shm_channel_ = nullptr;
+  other.send_queue_ = nullptr;
+  other.heartbeat_ = nullptr;
 
   logger = LClient(LClient::FMoveAssignmentOperator, this, logger_);
 
@@ -115,11 +150,6 @@ TcpClient& TcpClient::operator=(TCP::TcpClient&& other) {
     return *this;
   }
 
-  logger.Log("Changing this_pointer. Locking mutex", Debug);
-  this_mutex_->lock();
-  *this_pointer_ = this;
-  this_mutex_ -> unlock();
-
   other.is_active_ = false;
 
   logger.Log("Client assigned successfully", Info);
@@ -128,32 +158,52 @@ TcpClient& TcpClient::operator=(TCP::TcpClient&& other) {
 
 void TcpClient::Connect(const char* addr, int port, int ms_ping_threshold,
                         int ms_loop_period, logging_foo f_logger) {
+  Connect(addr, port, ms_ping_threshold, ms_loop_period, kDefSocketOptions,
+          f_logger);
+}
+void TcpClient::Connect(const char* addr, int port, int ms_ping_threshold,
+                        int ms_loop_period, const SocketOptions& options,
+                        logging_foo f_logger) {
   if (is_active_) {
     throw TcpException(TcpException::Connection, f_logger);
   }
+  Release();
 
   ping_threshold_ = ms_ping_threshold;
   loop_period_ = ms_loop_period;
+  options_ = options;
   logger_ = f_logger;
 
   LClient logger(LClient::FConstructor, this, logger_);
 
-  logger.Log("Creating sender socket", Debug);
-  heartbeat_socket_ = socket(AF_INET, SOCK_STREAM, 0);
-  if (heartbeat_socket_ < 0) {
-    throw TcpException(TcpException::SocketCreation, logger_, errno);
+  auto endpoints = ResolveAddress(addr, port, logger);
+  if (endpoints.empty()) {
+    logger.Log("Cannot resolve address " + std::string(addr), Error);
+    throw TcpException(TcpException::Connection, logger_);
   }
-  sockaddr_in addr_conf = {.sin_family = AF_INET,
-                           .sin_port = htons(port),
-                           .sin_addr = {inet_addr(addr)}};
+
   logger.Log("Connecting heartbeat to server", Debug);
-  if (connect(heartbeat_socket_, (sockaddr*)&addr_conf, sizeof(addr_conf)) <
-      0) {
-    close(heartbeat_socket_);
+  size_t winner = 0;
+  heartbeat_socket_ = ConnectFastest(endpoints, options_, winner);
+  if (heartbeat_socket_ < 0) {
     throw TcpException(TcpException::Connection, logger_, errno);
   }
+  // the main socket must reach the same server, so the address that won
+  // the first race starts the second one
+  std::rotate(endpoints.begin(), endpoints.begin() + winner,
+              endpoints.begin() + winner + 1);
+  int64_t flags = 0;
+#ifdef __linux
+  if (options_.shared_memory && endpoints[0].addr.ss_family == AF_UNIX) {
+    flags |= ShmTransport;
+  }
+#endif
+  if (options_.piggyback_liveness) {
+    flags |= PiggybackLiveness;
+  }
   logger.Log("Sending init mode to server", Debug);
-  if (RawSend(heartbeat_socket_, "0", kULLMaxDigits + 1) != kULLMaxDigits + 1) {
+  if (RawSend(heartbeat_socket_, "0 " + std::to_string(flags),
+              kULLMaxDigits + 1) != kULLMaxDigits + 1) {
     close(heartbeat_socket_);
     throw TcpException(TcpException::Sending, logger_, errno);
   }
@@ -176,23 +226,15 @@ void TcpClient::Connect(const char* addr, int port, int ms_ping_threshold,
     logger.Log("Got term signal", Warning);
     throw TcpException(TcpException::Acceptance, logger_);
   }
+  flags &= GetHandshakeFlags(password_str);
   logger.Log("Got password", Debug);
 
-  logger.Log("Creating receiver socket", Debug);
-  main_socket_ = socket(AF_INET, SOCK_STREAM, 0);
-
-  if (main_socket_ < 0 || !SetKeepIdle(main_socket_)) {
-    close(heartbeat_socket_);
-    if (main_socket_ >= 0) {
-      close(main_socket_);
-    }
-    throw TcpException(TcpException::SocketCreation, logger_, errno);
-  }
   logger.Log("Connecting main socket to server", Debug);
-  if (connect(main_socket_, (sockaddr*)&addr_conf, sizeof(addr_conf)) < 0) {
+  main_socket_ = ConnectFastest(endpoints, options_, winner);
+  if (main_socket_ < 0) {
+    int error = errno;
     close(heartbeat_socket_);
-    close(main_socket_);
-    throw TcpException(TcpException::Connection, logger_, errno);
+    throw TcpException(TcpException::Connection, logger_, error);
   }
   logger.Log("Sending password to server", Debug);
   if (RawSend(main_socket_, password_str, kULLMaxDigits + 1) !=
@@ -224,28 +266,55 @@ void TcpClient::Connect(const char* addr, int port, int ms_ping_threshold,
     throw TcpException(TcpException::Acceptance, logger_);
   }
 
-  logger.Log("Creating threads", Debug);
-  try {
-    this_pointer_ = new TcpClient*(this);
-    this_mutex_ = new std::mutex();
-    is_active_ = true;
-    heartbeat_thread_ =
-        std::thread(&TcpClient::HeartBeatClient, this_pointer_, this_mutex_);
-  } catch (std::exception& exception) {
-    is_active_ = false;
-    delete this_pointer_;
-    delete this_mutex_;
+  if ((flags & ShmTransport) != 0) {
+    logger.Log("Waiting for shared memory transport", Debug);
+    int fds[ShmChannel::kFdCount];
+    int fd_count = -1;
+    if (WaitForData(main_socket_, ping_threshold_, logger, logger_)
+            .has_value()) {
+      fd_count = RecvFds(main_socket_, fds, ShmChannel::kFdCount);
+    }
+    if (fd_count < 0) {
+      close(heartbeat_socket_);
+      close(main_socket_);
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
+    if (fd_count == ShmChannel::kFdCount) {
+      try {
+        shm_channel_ = new ShmChannel(fds, options_.us_shm_spin, logger_);
+        logger.Log("Shared memory transport attached", Debug);
+      } catch (TcpException& exception) {
+        close(heartbeat_socket_);
+        close(main_socket_);
+        throw;
+      }
+    } else {
+      for (int i = 0; i < fd_count; ++i) {
+        close(fds[i]);
+      }
+      logger.Log("Server declined shared memory. Using socket", Debug);
+    }
+  }
 
-    if (this_pointer_ == nullptr || this_mutex_ == nullptr) {
-      logger.Log("Cannot allocate memory: " + std::string(exception.what()),
-                 Error);
+  flags_ = flags;
 
-      throw exception;
-    }
-    logger.Log("Cannot create sender thread: " + std::string(exception.what()),
+  logger.Log("Starting heartbeat", Debug);
+  try {
+    send_queue_ = new SendQueue();
+    StartHeartBeat(HeartBeat::Responder);
+  } catch (std::exception& exception) {
+    logger.Log("Cannot start heartbeat: " + std::string(exception.what()),
                Error);
-    throw exception;
+    close(heartbeat_socket_);
+    close(main_socket_);
+    delete send_queue_;
+    send_queue_ = nullptr;
+    delete shm_channel_;
+    shm_channel_ = nullptr;
+
+    throw;
   }
+  is_active_ = true;
 
   logger.Log("TcpClient created", Info);
 }
@@ -256,6 +325,10 @@ void TcpClient::Connect(const char* addr, int port, int ms_ping_threshold,
 void TcpClient::Connect(const char* addr, int port, logging_foo f_logger) {
   Connect(addr, port, kDefPingThreshold, kDefLoopPeriod, f_logger);
 }
+void TcpClient::Connect(const char* addr, int port,
+                        const SocketOptions& options, logging_foo f_logger) {
+  Connect(addr, port, kDefPingThreshold, kDefLoopPeriod, options, f_logger);
+}
 
 std::string TcpClient::RecvStr(int ms_timeout) {
   LClient logger(LClient::FRecv, this, logger_);
@@ -266,303 +339,817 @@ std::string TcpClient::RecvStr(int ms_timeout) {
   }
 
   logger.Log("Receiving string", Debug);
-  auto recv_str = StrRecv(ms_timeout, logger);
-  logger.Log(
-      "Method returned string of size " + std::to_string(recv_str.size()),
-      Debug);
+  std::string recv_str;
+  StrRecv(ms_timeout, logger, recv_str);
+  if (logger.IsEnabled()) {
+    logger.Log(
+        "Method returned string of size " + std::to_string(recv_str.size()),
+        Debug);
+  }
 
   return recv_str;
 }
+std::pmr::string TcpClient::RecvStr(int ms_timeout,
+                                    std::pmr::memory_resource* resource) {
+  LClient logger(LClient::FRecv, this, logger_);
+  logger.Log("Starting receiving method", Debug);
 
-void TcpClient::StopClient() noexcept {
+  if (!is_active_) {
+    CheckReceiveError();
+  }
+
+  logger.Log("Receiving string", Debug);
+  std::pmr::string recv_str(resource);
+  StrRecv(ms_timeout, logger, recv_str);
+  if (logger.IsEnabled()) {
+    logger.Log(
+        "Method returned string of size " + std::to_string(recv_str.size()),
+        Debug);
+  }
+
+  return recv_str;
+}
+
+void TcpClient::StopClient() noexcept { Stop(true); }
+
+void TcpClient::Stop(bool is_shutting_down) noexcept {
   LClient logger(LClient::FStopClient, this, logger_);
 
-  if (!is_active_) {
+  if (!is_active_.exchange(false)) {
     logger.Log("Client has already been stopped", Info);
     return;
   }
-  logger.Log("Client is running. Setting term flag. Joining thread", Debug);
-  is_active_ = false;
-  heartbeat_thread_.join();
-  logger.Log("Thread joined. Freeing resources", Debug);
+  logger.Log("Client is running. Term flag set. Stopping heartbeat", Debug);
+  heartbeat_->Stop();
+  if (is_shutting_down) {
+    logger.Log("Heartbeat stopped. Waking blocked callers", Debug);
+    shutdown(main_socket_, SHUT_RDWR);
+    shutdown(heartbeat_socket_, SHUT_RDWR);
+    if (shm_channel_ != nullptr) {
+      shm_channel_->Shutdown();
+    }
+  } else {
+    // drops this process' reference to the connection while the
+    // descriptor numbers stay valid until Release
+    int placeholder = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (placeholder >= 0) {
+      dup2(placeholder, main_socket_);
+      dup2(placeholder, heartbeat_socket_);
+      close(placeholder);
+    }
+  }
+  if (live_counter_ != nullptr) {
+    live_counter_->fetch_sub(1);
+  }
+
+  logger.Log("Client stopped", Info);
+}
 
+void TcpClient::Release() noexcept {
+  StopClient();
+  if (auto backlog = backlog_.exchange(nullptr); backlog != nullptr) {
+    std::lock_guard<std::mutex> lock(backlog->mutex);
+    backlog->client = nullptr;
+    backlog->frames.clear();
+  }
+  if (heartbeat_ == nullptr) {
+    return;
+  }
+  LClient(LClient::FStopClient, this, logger_)
+      .Log("Freeing resources", Debug);
   close(main_socket_);
   close(heartbeat_socket_);
-  delete this_pointer_;
-  delete this_mutex_;
+  main_socket_ = -1;
+  heartbeat_socket_ = -1;
+  delete heartbeat_;
+  heartbeat_ = nullptr;
+  delete shm_channel_;
+  shm_channel_ = nullptr;
+  delete send_queue_;
+  send_queue_ = nullptr;
+  live_counter_.reset();
+}
 
-  logger.Log("Client stopped", Info);
+void TcpClient::AdoptBacklog() noexcept {
+  if (auto backlog = backlog_.load(); backlog != nullptr) {
+    std::lock_guard<std::mutex> lock(backlog->mutex);
+    backlog->client = this;
+  }
 }
 
-void TcpClient::HeartBeatClient(TCP::TcpClient** this_pointer,
-                                std::mutex* this_mutex) noexcept {
-  this_mutex->lock();
-  logging_foo foo_log = (**this_pointer).logger_;
-  LClient logger(LClient::FHeartBeatLoop, this_pointer, foo_log);
+void TcpClient::StartHeartBeat(HeartBeat::Role role,
+                               const std::string& heartbeat_partial) {
+  socklen_t option_length = sizeof(send_room_);
+  if (getsockopt(main_socket_, SOL_SOCKET, SO_SNDBUF, &send_room_,
+                 &option_length) == 0) {
+    // the kernel doubles SO_SNDBUF to account for its own overhead
+    send_room_ /= 2;
+  }
+  heartbeat_ = new HeartBeat(role, heartbeat_socket_, main_socket_,
+                             shm_channel_, ping_threshold_, loop_period_,
+                             (flags_ & PiggybackLiveness) != 0,
+                             options_.phi_threshold, logger_);
+  heartbeat_->SetPartial(heartbeat_partial);
+  EventLoop* loop = &EventLoop::GetDefault();
+  if (options_.reactors != nullptr) {
+    reactor_ = options_.reactors->Pick();
+    loop = &options_.reactors->Get(reactor_);
+  }
+  try {
+    heartbeat_->Start(*loop);
+  } catch (...) {
+    delete heartbeat_;
+    heartbeat_ = nullptr;
+    throw;
+  }
+}
 
-  int socket = (**this_pointer).heartbeat_socket_;
-  int ping_threshold = (**this_pointer).ping_threshold_;
-  int loop_period = (**this_pointer).loop_period_;
+void TcpClient::StrSend(const std::string& message, TCP::Logger& logger) {
+  SendRequest request;
+  request.data = message.data();
+  request.size = message.size();
+  EnqueueSend(request, logger);
+}
 
-  this_mutex->unlock();
+Buffer TcpClient::MakeFrame(const std::string& message) {
+  size_t header_size = sizeof(SendRequest::control_block);
+  Buffer frame(header_size + message.size() + 1);
+  memset(frame.Data(), 0, header_size);
+  FillControlBlock(frame.Data(), message.size());
+  memcpy(frame.Data() + header_size, message.data(), message.size());
+  frame.Data()[frame.Size() - 1] = '\0';
+  return frame;
+}
 
-  logger.Log("Starting loop", Debug);
+void TcpClient::SendFrame(const Buffer& frame) {
+  LClient logger(LClient::FSend, this, logger_);
+  if (!IsConnected()) {
+    throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
+  SendRequest request;
+  request.data = frame.Data();
+  request.size = frame.Size();
+  request.is_framed = true;
+  Tracer::End();
+  EnqueueSend(request, logger);
+}
 
-  try {
-    auto last_connection = std::chrono::system_clock::now().time_since_epoch();
-    while (true) {
-      logger.Log("Starting waiting for ping", Debug);
-      auto curr_time = std::chrono::system_clock::now().time_since_epoch();
-      auto waiting = WaitForData(socket, loop_period, logger, foo_log);
-      logger.Log("Checking term flag", Debug);
-
-      this_mutex->lock();
-      bool term_flag = (**this_pointer).is_active_;
-      this_mutex->unlock();
-      if (!term_flag) {
-        return;
-      }
+bool TcpClient::HasSendRoom(size_t length) noexcept {
+  int queued = 0;
+  if (shm_channel_ != nullptr || send_room_ <= 0 ||
+      ioctl(main_socket_, TIOCOUTQ, &queued) < 0) {
+    return true;
+  }
+  return queued == 0 || queued + length <= static_cast<size_t>(send_room_);
+}
 
-      if (!waiting.has_value()) {
-        logger.Log("Ping is not available", Debug);
-        if (std::chrono::duration_cast<std::chrono::milliseconds>(
-                std::chrono::system_clock::now().time_since_epoch() -
-                last_connection)
-                .count() > ping_threshold) {
-          logger.Log("Connection timeout. Disconnecting", Info);
-          this_mutex->lock();
-          (**this_pointer).ms_ping_ = -1;
-          this_mutex->unlock();
-          return;
-        }
-        logger.Log("Connection is not timeout", Debug);
-        continue;
-      }
+void TcpClient::SendFile(int fd, off_t offset, size_t length) {
+  LClient logger(LClient::FSend, this, logger_);
+  logger.Log("Starting file sending method. Checking is peer connected",
+             Debug);
+  if (!IsConnected()) {
+    logger.Log("Peer is not connected", Warning);
+    throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
 
-      logger.Log("Ping is available. Receiving", Debug);
-      auto ping_str = RawRecv(socket, kULLMaxDigits + 1);
-      if (ping_str.size() != kULLMaxDigits + 1) {
-        logger.Log("Error occurred while receiving", Warning);
-        this_mutex->lock();
-        (**this_pointer).ms_ping_ = -1;
-        this_mutex->unlock();
+  SendRequest request;
+  request.fd = fd;
+  request.offset = offset;
+  request.size = length;
+  logger.Log("Sending " + std::to_string(length) + " bytes of file", Debug);
+  Tracer::End();
+  EnqueueSend(request, logger);
+  logger.Log("File sent", Info);
+}
 
-        TcpException(TcpException::Receiving, foo_log, errno);
-        return;
+void TcpClient::EnqueueSend(SendRequest& request, Logger& logger) {
+  if (!request.is_framed) {
+    FillControlBlock(request.control_block, request.size, Tracer::GetStamp());
+    Tracer::Mark(TFrame);
+  }
+
+  logger.Log("Queueing data", Debug);
+  send_queue_->Push(&request);
+  while (request.state.load() == SendRequest::Pending) {
+    if (!send_queue_->TryLock()) {
+      logger.Log("Another thread is writing. Waiting", Debug);
+      request.state.wait(SendRequest::Pending);
+      continue;
+    }
+    logger.Log("Flushing queued data", Debug);
+    do {
+      FlushSendQueue();
+    } while (send_queue_->Unlock() && send_queue_->TryLock());
+  }
+
+  if (request.AwaitResult() == SendRequest::Failed) {
+    throw TcpException(TcpException::Sending, logger_, request.error,
+                       request.error == 0);
+  }
+  Tracer::Mark(TKernelSend);
+  logger.Log("Message sent successfully", Info);
+}
+
+void TcpClient::FlushSendQueue() noexcept {
+  char terminator = '\0';
+  iovec io[SendQueue::kMaxBatch * 3];
+  SendRequest* batch[SendQueue::kMaxBatch];
+
+  bool is_broken = false;
+  int error = 0;
+  SendRequest* request = send_queue_->TakeAll();
+  while (request != nullptr) {
+    if (is_broken) {
+      SendRequest* next = request->next;
+      request->Complete(false, error);
+      request = next;
+      continue;
+    }
+    if (request->fd >= 0) {
+      SendRequest* next = request->next;
+      is_broken = !FlushFileRequest(request);
+      error = errno;
+      request = next;
+      continue;
+    }
+
+    int count = 0;
+    int io_count = 0;
+    while (request != nullptr && request->fd < 0 &&
+           count < SendQueue::kMaxBatch) {
+      if (request->is_framed) {
+        io[io_count++] = {const_cast<char*>(request->data), request->size};
+      } else {
+        io[io_count++] = {request->control_block,
+                          sizeof(request->control_block)};
+        io[io_count++] = {const_cast<char*>(request->data), request->size};
+        io[io_count++] = {&terminator, 1};
+      }
+      batch[count++] = request;
+      request = request->next;
+    }
+
+    ssize_t answ = MainSendv(io, io_count);
+    error = errno;
+    size_t sent = answ < 0 ? 0 : answ;
+    for (int i = 0; i < count; ++i) {
+      size_t length = batch[i]->size;
+      if (!batch[i]->is_framed) {
+        length += sizeof(batch[i]->control_block) + 1;
       }
-      logger.Log("Ping received. Setting", Debug);
-      this_mutex->lock();
-      (**this_pointer).ms_ping_ = std::stoi(ping_str);
-      this_mutex->unlock();
-
-      logger.Log("Sending delay", Debug);
-      auto recv_time = curr_time + std::chrono::milliseconds(waiting.value());
-      auto send_recv_diff =
-          std::chrono::duration_cast<std::chrono::milliseconds>(
-              std::chrono::system_clock::now().time_since_epoch() - recv_time);
-      if (RawSend(socket, std::to_string(send_recv_diff.count()),
-                  kULLMaxDigits + 1) != kULLMaxDigits + 1) {
-        logger.Log("Error occurred while sending", Warning);
-        this_mutex->lock();
-        (**this_pointer).ms_ping_ = -1;
-        this_mutex->unlock();
-
-        TcpException(TcpException::Sending, foo_log, errno);
-        return;
+      if (sent >= length) {
+        sent -= length;
+        batch[i]->Complete(true, 0);
+      } else {
+        sent = 0;
+        is_broken = true;
+        batch[i]->Complete(false, error);
       }
-      last_connection = std::chrono::system_clock::now().time_since_epoch();
-      logger.Log("Sending is successful", Debug);
-    }
-  } catch (TcpException& exception) {
-    logger.Log("Exception caught: " + std::string(exception.what()), Warning);
-    this_mutex->lock();
-    (**this_pointer).ms_ping_ = -1;
-    this_mutex->unlock();
-    return;
+    }
   }
 }
 
-void TcpClient::HeartBeatServer(TCP::TcpClient** this_pointer,
-                                std::mutex* this_mutex) noexcept {
-  this_mutex->lock();
-  logging_foo foo_log = (**this_pointer).logger_;
-  LClient logger(LClient::FHeartBeatLoop, this_pointer, foo_log);
+bool TcpClient::FlushFileRequest(SendRequest* request) noexcept {
+  char terminator = '\0';
+  size_t header_size = sizeof(request->control_block);
+  if (MainSendAll(request->control_block, header_size) !=
+          static_cast<ssize_t>(header_size) ||
+      SendFileData(request->fd, request->offset, request->size) !=
+          request->size ||
+      MainSendAll(&terminator, 1) != 1) {
+    request->Complete(false, errno);
+    return false;
+  }
+  request->Complete(true, 0);
+  return true;
+}
 
-  int socket = (**this_pointer).heartbeat_socket_;
-  int ping_threshold = (**this_pointer).ping_threshold_;
-  int loop_period = (**this_pointer).loop_period_;
+std::optional<size_t> TcpClient::RecvChunks(int ms_timeout,
+                                            const chunk_foo& sink) {
+  LClient logger(LClient::FRecv, this, logger_);
+  logger.Log("Starting chunked receiving method", Debug);
 
-  this_mutex->unlock();
+  if (!is_active_) {
+    CheckReceiveError();
+  }
 
-  logger.Log("Starting loop", Debug);
+  auto length = RecvHeader(ms_timeout, logger);
+  if (!length.has_value()) {
+    return {};
+  }
 
-  try {
-    while (true) {
-      logger.Log("Getting flag and cached ping", Debug);
-      this_mutex->lock();
-      bool term_flag = (**this_pointer).is_active_;
-      int cached_ping = (**this_pointer).ms_ping_;
-      this_mutex->unlock();
-      if (!term_flag) {
-        return;
-      }
-      logger.Log("Variables got. Sending ping", Debug);
-
-      auto send_time = std::chrono::system_clock::now().time_since_epoch();
-      if (RawSend(socket, std::to_string(cached_ping), kULLMaxDigits + 1) !=
-          kULLMaxDigits + 1) {
-        logger.Log("Error occurred while sending ping", Warning);
-        this_mutex->lock();
-        (**this_pointer).ms_ping_ = -1;
-        this_mutex->unlock();
-        return;
+  Buffer buffer(std::min(length.value(), kStreamChunkSize));
+  size_t received = 0;
+  while (received < length.value()) {
+    size_t chunk = std::min(buffer.Size(), length.value() - received);
+    if (MainRecvAll(buffer.Data(), chunk) != chunk) {
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
+    sink(buffer.Data(), chunk);
+    received += chunk;
+  }
+  RecvTerminator(logger);
+
+  logger.Log("Streamed " + std::to_string(received) + " bytes", Info);
+  return received;
+}
+
+std::optional<size_t> TcpClient::RecvToFile(int fd, int ms_timeout) {
+  if (shm_channel_ != nullptr) {
+    return RecvChunks(ms_timeout, [this, fd](const char* data, size_t size) {
+      if (!WriteAll(fd, data, size)) {
+        throw TcpException(TcpException::Receiving, logger_, errno);
       }
+    });
+  }
 
-      logger.Log("Waiting for delay", Debug);
+  LClient logger(LClient::FRecv, this, logger_);
+  logger.Log("Starting receiving to file", Debug);
+
+  if (!is_active_) {
+    CheckReceiveError();
+  }
+
+  auto length = RecvHeader(ms_timeout, logger);
+  if (!length.has_value()) {
+    return {};
+  }
+
+  logger.Log("Splicing " + std::to_string(length.value()) + " bytes", Debug);
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+    throw TcpException(TcpException::Receiving, logger_, errno);
+  }
+  size_t received = 0;
+  bool direct = true;
+  while (received < length.value()) {
+    ssize_t in_pipe =
+        splice(main_socket_, nullptr, pipe_fds[1], nullptr,
+               length.value() - received, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in_pipe < 0 && errno == EINTR) {
+      continue;
+    }
+    if (in_pipe <= 0) {
+      int error = errno;
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      throw TcpException(TcpException::Receiving, logger_, error);
+    }
+    if (!DrainPipe(pipe_fds[0], fd, in_pipe, direct)) {
+      int error = errno;
+      close(pipe_fds[0]);
+      close(pipe_fds[1]);
+      throw TcpException(TcpException::Receiving, logger_, error);
+    }
+    received += in_pipe;
+    heartbeat_->AddReceived(in_pipe);
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+  RecvTerminator(logger);
+
+  logger.Log("Received " + std::to_string(received) + " bytes to file", Info);
+  return received;
+}
+
+MessageBatch TcpClient::ReceiveMany(size_t max_count, int ms_timeout) {
+  LClient logger(LClient::FRecv, this, logger_);
+  logger.Log("Starting batch receiving method", Debug);
 
-      auto waiting =
-          WaitForData(socket, loop_period + ping_threshold, logger, foo_log);
-      auto recv_time = std::chrono::system_clock::now().time_since_epoch();
+  MessageBatch batch;
+  RecvBatch(max_count, ms_timeout, batch, logger);
+  return batch;
+}
+size_t TcpClient::ReceiveMany(
+    size_t max_count, int ms_timeout,
+    const std::function<void(std::string_view)>& handler) {
+  LClient logger(LClient::FRecv, this, logger_);
+  logger.Log("Starting batch receiving method", Debug);
 
-      if (!waiting.has_value()) {
-        logger.Log("Waiting timeout. Terminating", Warning);
-        this_mutex->lock();
-        (**this_pointer).ms_ping_ = -1;
-        this_mutex->unlock();
-        return;
+  MessageBatch batch;
+  RecvBatch(max_count, ms_timeout, batch, logger);
+  for (std::string_view message : batch.messages) {
+    handler(message);
+  }
+  return batch.messages.size();
+}
+
+void TcpClient::RecvBatch(size_t max_count, int ms_timeout,
+                          MessageBatch& batch, Logger& logger) {
+  if (!is_active_) {
+    CheckReceiveError();
+  }
+  if (max_count == 0) {
+    return;
+  }
+
+  logger.Log("Starting waiting for data", Debug);
+  if (!MainWait(ms_timeout, logger).has_value()) {
+    logger.Log("Timeout. Checking is peer is connected", Info);
+    CheckReceiveError();
+    logger.Log("Peer is connected", Info);
+    return;
+  }
+
+  batch.buffer = Buffer(kBatchSize);
+  size_t used = 0;
+  while (batch.messages.size() < max_count && used < batch.buffer.Size()) {
+    if (shm_channel_ != nullptr) {
+      if ((!batch.messages.empty() && !MainWait(0, logger).has_value()) ||
+          !RecvFrame(batch, used, ms_timeout, logger)) {
+        break;
       }
+      continue;
+    }
 
-      logger.Log("Data is available. Receiving", Debug);
-      auto delay_str = RawRecv(socket, kULLMaxDigits + 1);
-      if (delay_str.size() != kULLMaxDigits + 1) {
-        logger.Log("Error occurred while receiving", Warning);
-        this_mutex->lock();
-        (**this_pointer).ms_ping_ = -1;
-        this_mutex->unlock();
+    size_t room = batch.buffer.Size() - used;
+    ssize_t peeked = recv(main_socket_, batch.buffer.Data() + used, room,
+                          MSG_PEEK | MSG_DONTWAIT);
+    if (peeked < 0 && errno == EINTR) {
+      continue;
+    }
+    if (peeked == 0 || (peeked < 0 && errno != EAGAIN)) {
+      if (!batch.messages.empty()) {
+        // the next call reports the break
+        break;
+      }
+      CheckReceiveError();
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
 
-        TcpException(TcpException::Receiving, foo_log, errno);
-        return;
+    size_t complete =
+        peeked < 0 ? 0 : ParseFrames(batch, used, peeked, max_count);
+    if (complete == 0) {
+      if (!batch.messages.empty()) {
+        break;
       }
+      logger.Log("First message is not complete yet. Receiving it alone",
+                 Debug);
+      if (!RecvFrame(batch, used, ms_timeout, logger)) {
+        break;
+      }
+      continue;
+    }
+    // the frames were only peeked, so they are read again into the same
+    // place to take them off the socket
+    if (MainRecvAll(batch.buffer.Data() + used, complete) != complete) {
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
+    used += complete;
+    if (static_cast<size_t>(peeked) < room) {
+      break;
+    }
+  }
+  batch.buffer.Resize(used);
+  Tracer::End();
+  if (options_.quick_ack && shm_channel_ == nullptr) {
+    SetQuickAck(main_socket_);
+  }
 
-      logger.Log("Computing ping", Debug);
-      auto curr_ping = std::chrono::duration_cast<std::chrono::milliseconds>(
-          recv_time - send_time -
-          std::chrono::milliseconds(std::stoll(delay_str)));
-      curr_ping /= 2;
-
-      logger.Log("Setting ping: " + std::to_string(curr_ping.count()), Debug);
-      this_mutex->lock();
-      (**this_pointer).ms_ping_ = curr_ping.count();
-      this_mutex->unlock();
-
-      logger.Log("Continuing", Debug);
-      std::this_thread::sleep_for(std::chrono::milliseconds(loop_period));
-    }
-  } catch (TcpException& exception) {
-    logger.Log("Exception caught: " + std::string(exception.what()), Warning);
-    this_mutex->lock();
-    (**this_pointer).ms_ping_ = -1;
-    this_mutex->unlock();
-    return;
+  if (logger.IsEnabled()) {
+    logger.Log("Received " + std::to_string(batch.messages.size()) +
+                   " messages in " + std::to_string(used) + " bytes",
+               Info);
   }
 }
 
-std::string TcpClient::StrRecv(int ms_timeout, TCP::Logger& logger) {
+size_t TcpClient::ParseFrames(MessageBatch& batch, size_t offset,
+                              size_t length, size_t max_count) noexcept {
+  const size_t control_size = (kULLMaxDigits + 1) * 2;
+  const char* data = batch.buffer.Data() + offset;
+  size_t parsed = 0;
+  while (batch.messages.size() < max_count &&
+         length - parsed >= control_size) {
+    char control_block[control_size + 1] = {};
+    memcpy(control_block, data + parsed, control_size);
+    char* delimiter;
+    size_t full_block_num = strtoull(control_block, &delimiter, 10);
+    size_t last_block_size = strtoull(delimiter, nullptr, 10);
+    size_t size = full_block_num * BLOCK_SIZE + last_block_size;
+    if (length - parsed - control_size < size + 1) {
+      break;
+    }
+
+    const char* message = data + parsed + control_size;
+    parsed += control_size + size + 1;
+    while (size > 0 && message[size - 1] == '\0') {
+      --size;
+    }
+    batch.messages.emplace_back(message, size);
+  }
+  return parsed;
+}
+
+bool TcpClient::RecvFrame(MessageBatch& batch, size_t& offset,
+                          int ms_timeout, Logger& logger) {
+  auto length = RecvHeader(ms_timeout, logger);
+  if (!length.has_value()) {
+    return false;
+  }
+  if (offset + length.value() > batch.buffer.Size()) {
+    GrowBatch(batch, std::max(offset + length.value(), kBatchSize));
+  }
+
+  char* message = batch.buffer.Data() + offset;
+  if (MainRecvAll(message, length.value()) != length.value()) {
+    throw TcpException(TcpException::Receiving, logger_, errno);
+  }
+  RecvTerminator(logger);
+  offset += length.value();
+  size_t size = length.value();
+  while (size > 0 && message[size - 1] == '\0') {
+    --size;
+  }
+  batch.messages.emplace_back(message, size);
+  return true;
+}
+
+void TcpClient::GrowBatch(MessageBatch& batch, size_t size) {
+  std::vector<size_t> offsets;
+  offsets.reserve(batch.messages.size());
+  for (std::string_view message : batch.messages) {
+    offsets.push_back(message.data() - batch.buffer.Data());
+  }
+  batch.buffer.Resize(size);
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    batch.messages[i] = std::string_view(batch.buffer.Data() + offsets[i],
+                                         batch.messages[i].size());
+  }
+}
+
+std::optional<size_t> TcpClient::RecvHeader(int ms_timeout, Logger& logger) {
   logger.Log("Starting waiting for data", Debug);
-  if (!WaitForData(main_socket_, ms_timeout, logger, logger_).has_value()) {
+  int64_t wait_start = Tracer::IsEnabled() ? Tracer::Now() : 0;
+  if (!MainWait(ms_timeout, logger).has_value()) {
     logger.Log("Timeout. Checking is peer is connected", Info);
     CheckReceiveError();
     logger.Log("Peer is connected", Info);
-    return "";
+    return {};
   }
   logger.Log("Data is available. Receiving", Debug);
-  auto control_block = RawRecv(main_socket_, (kULLMaxDigits + 1) * 2);
-  if (control_block.empty()) {
+  char control_block[(kULLMaxDigits + 1) * 2 + 1] = {};
+  auto received = MainRecvAll(control_block, (kULLMaxDigits + 1) * 2);
+  if (options_.quick_ack) {
+    SetQuickAck(main_socket_);
+  }
+  if (received == 0) {
     CheckReceiveError();
     throw TcpException(TcpException::Receiving, logger_, errno);
   }
-  if (control_block.size() != (kULLMaxDigits + 1) * 2) {
+  if (received != (kULLMaxDigits + 1) * 2) {
     throw TcpException(TcpException::Receiving, logger_, 0, true);
   }
 
-  auto delimiter = control_block.begin() + control_block.find(' ') + 1;
-  size_t full_block_num =
-      std::stoll(std::string(control_block.begin(), delimiter));
-  size_t last_block_size =
-      std::stoll(std::string(delimiter, control_block.end()));
-
-  logger.Log("Number of full blocks: " + std::to_string(full_block_num) +
-                 ". Last block size: " + std::to_string(last_block_size),
-             Debug);
-
-  std::string result;
+  char* delimiter;
+  size_t full_block_num = strtoull(control_block, &delimiter, 10);
+  size_t last_block_size = strtoull(delimiter, &delimiter, 10);
+  if (wait_start != 0) {
+    Tracer::Begin(wait_start, strtoll(delimiter, nullptr, 10));
+    Tracer::Mark(TWait);
+  } else {
+    Tracer::End();
+  }
 
-  logger.Log("Receiving main data", Debug);
-  for (size_t i = 0; i < full_block_num; ++i) {
-    auto block = RawRecv(main_socket_, BLOCK_SIZE);
-    while (!block.empty() && block.back() == '\0') {
-      block.pop_back();
+  if (logger.IsEnabled()) {
+    logger.Log("Number of full blocks: " + std::to_string(full_block_num) +
+                   ". Last block size: " + std::to_string(last_block_size),
+               Debug);
+  }
+  return full_block_num * BLOCK_SIZE + last_block_size;
+}
+bool TcpClient::IsMessageReady() noexcept {
+  const size_t header_size = (kULLMaxDigits + 1) * 2;
+  char control_block[header_size + 1] = {};
+  size_t buffered = 0;
+  if (shm_channel_ != nullptr) {
+    buffered = shm_channel_->Peek(control_block, header_size);
+    if (buffered < header_size) {
+      return shm_channel_->IsClosed();
     }
-    if (block.empty()) {
-      throw TcpException(TcpException::Receiving, logger_, errno);
+  } else {
+    ssize_t answ = recv(main_socket_, control_block, header_size,
+                        MSG_PEEK | MSG_DONTWAIT);
+    if (answ < 0) {
+      return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
     }
-    result += block;
-  }
-  auto part_block = RawRecv(main_socket_, last_block_size + 1);
-  while (!part_block.empty() && part_block.back() == '\0') {
-    part_block.pop_back();
+    if (answ == 0) {
+      return true;
+    }
+    int pending = 0;
+    if (size_t(answ) < header_size ||
+        ioctl(main_socket_, FIONREAD, &pending) < 0) {
+      return false;
+    }
+    buffered = pending;
   }
-  if (part_block.empty()) {
+
+  char* delimiter;
+  size_t full_block_num = strtoull(control_block, &delimiter, 10);
+  size_t last_block_size = strtoull(delimiter, &delimiter, 10);
+  return buffered >=
+         header_size + full_block_num * BLOCK_SIZE + last_block_size + 1;
+}
+
+void TcpClient::RecvTerminator(Logger& logger) {
+  char terminator;
+  if (MainRecvAll(&terminator, 1) != 1) {
     throw TcpException(TcpException::Receiving, logger_, errno);
   }
+}
+void TcpClient::FillControlBlock(char* control_block, size_t length,
+                                 int64_t stamp) noexcept {
+  size_t full_block_num = length / BLOCK_SIZE;
+  size_t last_block_size = length - (full_block_num * BLOCK_SIZE);
+
+  auto result = std::to_chars(control_block,
+                              control_block + kULLMaxDigits, full_block_num);
+  *result.ptr = ' ';
+  result = std::to_chars(result.ptr + 1, result.ptr + 1 + kULLMaxDigits,
+                         last_block_size);
+  if (stamp == 0) {
+    return;
+  }
+  // receivers parse two numbers and ignore the rest of the block
+  char digits[kULLMaxDigits];
+  auto stamp_end = std::to_chars(digits, digits + kULLMaxDigits, stamp).ptr;
+  size_t stamp_size = stamp_end - digits;
+  if (result.ptr + 1 + stamp_size <=
+      control_block + (kULLMaxDigits + 1) * 2) {
+    *result.ptr = ' ';
+    memcpy(result.ptr + 1, digits, stamp_size);
+  }
+}
 
-  result += part_block;
-  logger.Log("Message received", Info);
-  return result;
+size_t TcpClient::SendFileData(int fd, off_t offset, size_t length) noexcept {
+  enum { FSendfile, FSplice, FCopy } mode =
+      shm_channel_ == nullptr ? FSendfile : FCopy;
+  Buffer buffer;
+
+  size_t sent = 0;
+  while (sent < length) {
+    ssize_t answ;
+    if (mode == FSendfile) {
+      answ = sendfile(main_socket_, fd, &offset, length - sent);
+    } else if (mode == FSplice) {
+      answ = splice(fd, nullptr, main_socket_, nullptr, length - sent,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else {
+      if (buffer.IsEmpty()) {
+        buffer = Buffer(std::min(length - sent, kStreamChunkSize));
+      }
+      size_t chunk = std::min(buffer.Size(), length - sent);
+      answ = pread(fd, buffer.Data(), chunk, offset);
+      if (answ < 0 && errno == ESPIPE) {
+        answ = read(fd, buffer.Data(), chunk);
+      }
+      if (answ > 0 && MainSendAll(buffer.Data(), answ) != answ) {
+        return sent;
+      }
+      offset += answ > 0 ? answ : 0;
+    }
+
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ < 0 && mode != FCopy && (errno == EINVAL || errno == ENOSYS)) {
+      mode = mode == FSendfile ? FSplice : FCopy;
+      continue;
+    }
+    if (answ <= 0) {
+      if (answ == 0) {
+        errno = 0;
+      }
+      return sent;
+    }
+    if (mode != FCopy) {
+      heartbeat_->AddSent(answ);
+    }
+    sent += answ;
+  }
+  return sent;
 }
-void TcpClient::StrSend(const std::string& message, TCP::Logger& logger) {
-  logger.Log("Creating to_send string", Debug);
-  size_t full_block_num = message.size() / BLOCK_SIZE;
-  size_t last_block_size = message.size() - (full_block_num * BLOCK_SIZE);
-
-  logger.Log("Trying to send data", Debug);
-  auto ctrl_answ = RawSend(
-      main_socket_,
-      std::to_string(full_block_num) + " " + std::to_string(last_block_size),
-      (kULLMaxDigits + 1) * 2);
-  if (ctrl_answ < 0) {
-    throw TcpException(TcpException::Sending, logger_, errno);
+
+ssize_t TcpClient::MainSend(std::string message, size_t length) noexcept {
+  message.resize(length, '\0');
+  return MainSendAll(message.c_str(), length);
+}
+ssize_t TcpClient::MainSendAll(const char* data, size_t length) noexcept {
+  size_t sent = 0;
+  errno = 0;
+  while (sent < length) {
+    if (shm_channel_ == nullptr) {
+      ssize_t answ =
+          send(main_socket_, data + sent, length - sent, MSG_NOSIGNAL);
+      if (answ < 0 && errno == EINTR) {
+        continue;
+      }
+      if (answ <= 0) {
+        return sent == 0 ? -1 : sent;
+      }
+      sent += answ;
+      heartbeat_->AddSent(answ);
+      continue;
+    }
+    auto answ = shm_channel_->Send(data + sent, length - sent, loop_period_);
+    sent += answ;
+    heartbeat_->AddSent(answ);
+    if (sent < length && (errno == EPIPE || !IsConnected())) {
+      return sent == 0 ? -1 : sent;
+    }
   }
-  if (ctrl_answ != (kULLMaxDigits + 1) * 2) {
-    throw TcpException(TcpException::Sending, logger_, 0, true);
+  return sent;
+}
+ssize_t TcpClient::MainSendv(iovec* io, int count) noexcept {
+  if (shm_channel_ != nullptr) {
+    ssize_t sent = 0;
+    for (int i = 0; i < count; ++i) {
+      auto answ = MainSendAll(static_cast<char*>(io[i].iov_base),
+                              io[i].iov_len);
+      if (answ < 0) {
+        return sent == 0 ? -1 : sent;
+      }
+      sent += answ;
+      if (static_cast<size_t>(answ) != io[i].iov_len) {
+        return sent;
+      }
+    }
+    return sent;
   }
 
-  logger.Log("Sending main block", Debug);
-  for (size_t i = 0; i < full_block_num; ++i) {
-    auto answ =
-        RawSend(main_socket_,
-                std::string(message.c_str() + (i * BLOCK_SIZE), BLOCK_SIZE),
-                BLOCK_SIZE);
-    if (answ < 0) {
-      throw TcpException(TcpException::Sending, logger_, errno);
+  ssize_t sent = 0;
+  errno = 0;
+  while (count > 0) {
+    msghdr message = {.msg_iov = io, .msg_iovlen = (size_t)count};
+    ssize_t answ = sendmsg(main_socket_, &message, MSG_NOSIGNAL);
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ <= 0) {
+      return sent == 0 ? -1 : sent;
     }
-    if (answ != BLOCK_SIZE) {
-      throw TcpException(TcpException::Sending, logger_, 0, true);
+    sent += answ;
+    heartbeat_->AddSent(answ);
+    while (count > 0 && (size_t)answ >= io->iov_len) {
+      answ -= io->iov_len;
+      ++io;
+      --count;
+    }
+    if (count > 0) {
+      io->iov_base = static_cast<char*>(io->iov_base) + answ;
+      io->iov_len -= answ;
     }
   }
-  auto answ =
-      RawSend(main_socket_,
-              std::string(message.c_str() + (full_block_num * BLOCK_SIZE),
-                          last_block_size),
-              last_block_size + 1);
-  if (answ < 0) {
-    throw TcpException(TcpException::Sending, logger_, errno);
+  return sent;
+}
+std::string TcpClient::MainRecv(size_t length) noexcept {
+  std::string result(length, '\0');
+  result.resize(MainRecvAll(result.data(), length));
+  return result;
+}
+size_t TcpClient::MainRecvAll(char* data, size_t length) noexcept {
+  size_t received = 0;
+  errno = 0;
+  while (received < length) {
+    if (shm_channel_ == nullptr) {
+      ssize_t answ = recv(main_socket_, data + received, length - received, 0);
+      if (answ < 0 && errno == EINTR) {
+        continue;
+      }
+      if (answ <= 0) {
+        break;
+      }
+      received += answ;
+      heartbeat_->AddReceived(answ);
+      continue;
+    }
+    size_t answ = shm_channel_->Recv(data + received, length - received,
+                                      loop_period_);
+    received += answ;
+    heartbeat_->AddReceived(answ);
+    if (answ == 0 && (errno == EPIPE || !IsConnected())) {
+      break;
+    }
   }
-  if (answ != last_block_size + 1) {
-    throw TcpException(TcpException::Sending, logger_, 0, true);
+  return received;
+}
+std::optional<int> TcpClient::MainWait(int ms_timeout, Logger& logger) {
+  if (shm_channel_ == nullptr) {
+    return WaitForData(main_socket_, ms_timeout, logger, logger_);
   }
+  return shm_channel_->WaitForData(ms_timeout, logger);
+}
 
-  logger.Log("Message sent successfully", Info);
+std::string& TcpClient::GetSendBuffer() {
+  thread_local std::string buffer;
+  buffer.clear();
+  return buffer;
+}
+std::stringstream& TcpClient::GetRecvStream(const char* data, size_t size) {
+  thread_local std::stringstream stream;
+  stream.str("");
+  stream.clear();
+  stream.write(data, size);
+  return stream;
 }
 
 bool TcpClient::IsAvailable() {
@@ -573,7 +1160,7 @@ bool TcpClient::IsAvailable() {
     CheckReceiveError();
   }
 
-  bool availability = WaitForData(main_socket_, 0, logger, logger_).has_value();
+  bool availability = MainWait(0, logger).has_value();
   if (availability) {
     return true;
   }
@@ -591,14 +1178,22 @@ bool TcpClient::IsConnected() noexcept {
   if (!is_active_) {
     return false;
   }
-  return ms_ping_ >= 0;
+  return heartbeat_->GetPing() >= 0;
 }
 
 int TcpClient::GetPing() {
-  if (ms_ping_ == -1) {
+  int ping = is_active_ ? heartbeat_->GetPing() : -1;
+  if (ping == -1) {
     throw TcpException(TcpException::ConnectionBreak, logger_);
   }
-  return ms_ping_;
+  return ping;
+}
+
+double TcpClient::GetSuspicion() noexcept {
+  if (!is_active_) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return heartbeat_->GetSuspicion();
 }
 
 void TcpClient::ToArgs(std::stringstream& stream) {}
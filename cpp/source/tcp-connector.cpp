@@ -0,0 +1,386 @@
+#include "tcp-connector.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+namespace TCP {
+
+Connector::Connector(int ms_ping_threshold, int ms_loop_period,
+                     const SocketOptions& options, logging_foo f_logger)
+    : ping_threshold_(ms_ping_threshold),
+      loop_period_(ms_loop_period),
+      options_(options),
+      logger_(f_logger),
+      loop_(&EventLoop::GetDefault()) {}
+Connector::Connector(logging_foo f_logger)
+    : Connector(kDefPingThreshold, kDefLoopPeriod, kDefSocketOptions,
+                f_logger) {}
+
+std::vector<ConnectResult> Connector::ConnectMany(
+    const std::vector<ConnectTarget>& targets) {
+  LClient logger(LClient::FConnectMany, this, logger_);
+
+  if (loop_->IsLoopThread()) {
+    logger.Log("Cannot wait for handshakes on the event loop thread", Error);
+    throw TcpException(TcpException::Multithreading, logger_);
+  }
+
+  attempts_ = std::vector<Attempt>(targets.size());
+  remaining_ = targets.size();
+  std::vector<size_t> named;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (options_.piggyback_liveness) {
+      attempts_[i].flags = PiggybackLiveness;
+    }
+    sockaddr_storage storage;
+    if (MakeAddress(targets[i].addr.c_str(), targets[i].port, storage)
+            .has_value() ||
+        IsUnixAddress(targets[i].addr.c_str())) {
+      attempts_[i].endpoints =
+          ResolveAddress(targets[i].addr.c_str(), targets[i].port, logger);
+    } else {
+      named.push_back(i);
+    }
+  }
+
+  logger.Log("Starting handshakes", Debug);
+  loop_->RunSync([this, &named] {
+    for (size_t i = 0, next = 0; i < attempts_.size(); ++i) {
+      if (next < named.size() && named[next] == i) {
+        ++next;
+      } else {
+        Start(i, EHOSTUNREACH);
+      }
+    }
+  });
+
+  // a handshake starts as soon as its own name resolves, so a slow lookup
+  // holds up only its target
+  logger.Log("Resolving " + std::to_string(named.size()) + " host names",
+             Debug);
+  std::atomic<size_t> next_named = 0;
+  std::vector<std::thread> resolvers;
+  try {
+    while (resolvers.size() < std::min(named.size(), kResolverCount)) {
+      resolvers.emplace_back([this, &targets, &named, &next_named] {
+        LClient logger(LClient::FConnectMany, this, logger_);
+        for (size_t next = next_named++; next < named.size();
+             next = next_named++) {
+          Resolve(named[next], targets[named[next]], logger);
+        }
+      });
+    }
+  } catch (std::exception& exception) {
+    logger.Log("Cannot start resolver thread", Warning);
+    if (resolvers.empty()) {
+      for (size_t next = next_named++; next < named.size();
+           next = next_named++) {
+        Resolve(named[next], targets[named[next]], logger);
+      }
+    }
+  }
+  for (auto& resolver : resolvers) {
+    resolver.join();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return remaining_ == 0; });
+  }
+  // the last callback may still be unwinding
+  loop_->RunSync([] {});
+
+  std::vector<ConnectResult> results(attempts_.size());
+  size_t connected = 0;
+  for (size_t i = 0; i < attempts_.size(); ++i) {
+    results[i].client = std::move(attempts_[i].client);
+    results[i].error = std::move(attempts_[i].error);
+    connected += results[i].error.has_value() ? 0 : 1;
+  }
+  attempts_.clear();
+
+  logger.Log("Connected " + std::to_string(connected) + " of " +
+                 std::to_string(results.size()) + " targets",
+             Info);
+  return results;
+}
+
+void Connector::Resolve(size_t index, const ConnectTarget& target,
+                        Logger& logger) noexcept {
+  Attempt& attempt = attempts_[index];
+  // not yet started, so the loop thread does not touch the attempt
+  attempt.endpoints =
+      ResolveAddress(target.addr.c_str(), target.port, logger);
+  try {
+    loop_->Post([this, index] { Start(index, EHOSTUNREACH); });
+  } catch (std::exception& exception) {
+    attempt.stage = Done;
+    attempt.error.emplace(TcpException::Multithreading, logger_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--remaining_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+}
+
+void Connector::Start(size_t index, int error) noexcept {
+  Attempt& attempt = attempts_[index];
+  while (attempt.endpoint < attempt.endpoints.size()) {
+    int socket = OpenSocket(attempt.endpoints[attempt.endpoint]);
+    if (socket < 0) {
+      error = errno;
+      ++attempt.endpoint;
+      continue;
+    }
+    attempt.heartbeat_socket = socket;
+    attempt.stage = HeartBeatConnect;
+    Await(index, socket, EPOLLOUT);
+    return;
+  }
+  Fail(index, TcpException::Connection, error);
+}
+
+void Connector::OnEvent(size_t index) noexcept {
+  Attempt& attempt = attempts_[index];
+  switch (attempt.stage) {
+    case HeartBeatConnect: {
+      int error = GetSocketError(attempt.heartbeat_socket);
+      if (error != 0) {
+        loop_->Unwatch(attempt.heartbeat_socket);
+        close(attempt.heartbeat_socket);
+        attempt.heartbeat_socket = -1;
+        ++attempt.endpoint;
+        Start(index, error);
+        return;
+      }
+      if (RawSend(attempt.heartbeat_socket,
+                  "0 " + std::to_string(attempt.flags),
+                  kMessageSize) != kMessageSize) {
+        Fail(index, TcpException::Sending, errno);
+        return;
+      }
+      attempt.stage = Password;
+      Await(index, attempt.heartbeat_socket, EPOLLIN);
+      return;
+    }
+
+    case Password: {
+      auto answ = Receive(attempt, attempt.heartbeat_socket, kMessageSize);
+      if (!answ.has_value()) {
+        Fail(index, TcpException::Receiving, errno);
+        return;
+      }
+      if (!answ.value()) {
+        return;
+      }
+      if (strtoll(attempt.message, nullptr, 10) == 0) {
+        Fail(index, TcpException::Acceptance);
+        return;
+      }
+      attempt.flags &= GetHandshakeFlags(attempt.message);
+      loop_->Unwatch(attempt.heartbeat_socket);
+
+      attempt.main_socket = OpenSocket(attempt.endpoints[attempt.endpoint]);
+      if (attempt.main_socket < 0) {
+        Fail(index, TcpException::Connection, errno);
+        return;
+      }
+      attempt.stage = MainConnect;
+      Await(index, attempt.main_socket, EPOLLOUT);
+      return;
+    }
+
+    case MainConnect: {
+      int error = GetSocketError(attempt.main_socket);
+      if (error != 0) {
+        Fail(index, TcpException::Connection, error);
+        return;
+      }
+      if (RawSend(attempt.main_socket, attempt.message, kMessageSize) !=
+          kMessageSize) {
+        Fail(index, TcpException::Sending, errno);
+        return;
+      }
+      attempt.stage = Signal;
+      attempt.size = 0;
+      Await(index, attempt.main_socket, EPOLLIN);
+      return;
+    }
+
+    case Signal: {
+      auto answ = Receive(attempt, attempt.main_socket, 1);
+      if (!answ.has_value()) {
+        Fail(index, TcpException::Receiving, errno);
+        return;
+      }
+      if (!answ.value()) {
+        return;
+      }
+      if (attempt.message[0] != '1') {
+        Fail(index, TcpException::Acceptance);
+        return;
+      }
+      Complete(index);
+      return;
+    }
+
+    case Done:
+      return;
+  }
+}
+
+int Connector::OpenSocket(const Endpoint& endpoint) noexcept {
+  int socket =
+      ::socket(endpoint.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (socket < 0) {
+    return -1;
+  }
+  if (!SetSocketOptions(socket, options_) ||
+      (connect(socket, (sockaddr*)&endpoint.addr, endpoint.length) < 0 &&
+       errno != EINPROGRESS)) {
+    int error = errno;
+    close(socket);
+    errno = error;
+    return -1;
+  }
+  return socket;
+}
+
+int Connector::GetSocketError(int socket) noexcept {
+  int error = 0;
+  socklen_t length = sizeof(error);
+  if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+    return errno;
+  }
+  return error;
+}
+
+std::optional<bool> Connector::Receive(Attempt& attempt, int socket,
+                                       size_t length) noexcept {
+  while (attempt.size < length) {
+    ssize_t answ = recv(socket, attempt.message + attempt.size,
+                        length - attempt.size, MSG_DONTWAIT);
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    }
+    if (answ <= 0) {
+      return {};
+    }
+    attempt.size += answ;
+  }
+  attempt.message[attempt.size] = '\0';
+  return true;
+}
+
+void Connector::Await(size_t index, int socket, uint32_t events) noexcept {
+  Attempt& attempt = attempts_[index];
+  if (attempt.deadline != 0) {
+    loop_->Cancel(attempt.deadline);
+    attempt.deadline = 0;
+  }
+  // a candidate that is slow to connect gives way to the next one
+  int ms_timeout = ping_threshold_;
+  if (attempt.stage == HeartBeatConnect && options_.ms_attempt_delay > 0 &&
+      attempt.endpoint + 1 < attempt.endpoints.size()) {
+    ms_timeout = std::min(ms_timeout, options_.ms_attempt_delay);
+  }
+  try {
+    if (events == EPOLLOUT) {
+      loop_->Watch(socket, events, [this, index](uint32_t) { OnEvent(index); });
+    } else {
+      loop_->Modify(socket, events);
+    }
+    attempt.deadline =
+        loop_->RunAfter(ms_timeout, [this, index] { OnTimeout(index); });
+  } catch (std::exception& exception) {
+    Fail(index, TcpException::Multithreading);
+  }
+}
+
+void Connector::OnTimeout(size_t index) noexcept {
+  Attempt& attempt = attempts_[index];
+  attempt.deadline = 0;
+  LClient logger(LClient::FConnectMany, this, logger_);
+  if (attempt.stage == HeartBeatConnect) {
+    logger.Log("Timeout while connecting. Trying next address", Warning);
+    loop_->Unwatch(attempt.heartbeat_socket);
+    close(attempt.heartbeat_socket);
+    attempt.heartbeat_socket = -1;
+    ++attempt.endpoint;
+    Start(index, ETIMEDOUT);
+    return;
+  }
+  logger.Log("Timeout while waiting for server", Warning);
+  if (attempt.stage == MainConnect) {
+    Fail(index, TcpException::Connection, ETIMEDOUT);
+  } else {
+    Fail(index, TcpException::Receiving);
+  }
+}
+
+void Connector::Complete(size_t index) noexcept {
+  Attempt& attempt = attempts_[index];
+  // the peer pings from now on, so the heartbeat has to start right away
+  for (int socket : {attempt.heartbeat_socket, attempt.main_socket}) {
+    loop_->Unwatch(socket);
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) & ~O_NONBLOCK);
+  }
+  try {
+    attempt.client =
+        TcpClient(attempt.heartbeat_socket, attempt.main_socket,
+                  ping_threshold_, loop_period_, options_, attempt.flags,
+                  nullptr, logger_, HeartBeat::Responder);
+  } catch (TcpException& exception) {
+    attempt.error = exception;
+  } catch (std::exception& exception) {
+    attempt.error.emplace(TcpException::Connection, logger_);
+  }
+  attempt.heartbeat_socket = -1;
+  attempt.main_socket = -1;
+  Finish(index, false);
+}
+
+void Connector::Fail(size_t index, TcpException::ExceptionType type,
+                     int error) noexcept {
+  attempts_[index].error.emplace(type, logger_, error);
+  Finish(index, true);
+}
+
+void Connector::Finish(size_t index, bool is_closing) noexcept {
+  Attempt& attempt = attempts_[index];
+  if (attempt.stage == Done) {
+    return;
+  }
+  attempt.stage = Done;
+  if (attempt.deadline != 0) {
+    loop_->Cancel(attempt.deadline);
+    attempt.deadline = 0;
+  }
+  for (int* socket : {&attempt.heartbeat_socket, &attempt.main_socket}) {
+    if (*socket < 0) {
+      continue;
+    }
+    loop_->Unwatch(*socket);
+    if (is_closing) {
+      close(*socket);
+      *socket = -1;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (--remaining_ == 0) {
+    done_cv_.notify_one();
+  }
+}
+
+}  // namespace TCP
@@ -0,0 +1,81 @@
+#include "tcp-detector.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace TCP {
+
+FailureDetector::FailureDetector(int ms_expected_interval,
+                                 int ms_acceptable_pause) noexcept
+    : ms_expected_interval_(std::max(ms_expected_interval, 1)),
+      ms_acceptable_pause_(ms_acceptable_pause) {
+  Reset(Clock::now());
+}
+
+void FailureDetector::Reset(Clock::time_point now) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  count_ = next_ = 0;
+  sum_ = square_sum_ = 0;
+  // bootstrap so the first verdicts are neither instant nor never
+  double deviation = ms_expected_interval_ / 4.0;
+  AddInterval(ms_expected_interval_ - deviation);
+  AddInterval(ms_expected_interval_ + deviation);
+  last_arrival_ = now;
+}
+
+void FailureDetector::AddArrival(Clock::time_point now) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  AddInterval(
+      std::chrono::duration<double, std::milli>(now - last_arrival_).count());
+  last_arrival_ = now;
+}
+
+double FailureDetector::GetSuspicion(Clock::time_point now) const noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  double elapsed =
+      std::chrono::duration<double, std::milli>(now - last_arrival_).count();
+  double mean = sum_ / count_;
+  double variance = std::max(square_sum_ / count_ - mean * mean, 0.0);
+  double deviation = std::max(std::sqrt(variance), mean / 4);
+  deviation = std::max(deviation, 1.0);
+
+  // logistic approximation of the normal tail
+  double y = (elapsed - mean - ms_acceptable_pause_) / deviation;
+  double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+  if (y > 0) {
+    return -std::log10(e / (1 + e));
+  }
+  return -std::log10(1 - 1 / (1 + e));
+}
+
+int64_t FailureDetector::GetMsSinceArrival(
+    Clock::time_point now) const noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::chrono::duration_cast<std::chrono::milliseconds>(now -
+                                                               last_arrival_)
+      .count();
+}
+
+void FailureDetector::AddInterval(double interval) noexcept {
+  if (count_ == kWindowSize) {
+    sum_ -= intervals_[next_];
+    square_sum_ -= intervals_[next_] * intervals_[next_];
+  } else {
+    ++count_;
+  }
+  intervals_[next_] = interval;
+  sum_ += interval;
+  square_sum_ += interval * interval;
+  next_ = (next_ + 1) % kWindowSize;
+
+  // keeps rounding of the running sums from accumulating
+  if (next_ == 0) {
+    sum_ = square_sum_ = 0;
+    for (double value : intervals_) {
+      sum_ += value;
+      square_sum_ += value * value;
+    }
+  }
+}
+
+}  // namespace TCP
@@ -0,0 +1,307 @@
+#include "tcp-event-loop.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <future>
+
+namespace TCP {
+
+namespace {
+
+const uint64_t kWakeData = ~0ULL;
+
+uint64_t MakeData(int fd, uint32_t generation) noexcept {
+  return (uint64_t(generation) << 32) | uint32_t(fd);
+}
+
+}  // namespace
+
+EventLoop::EventLoop(logging_foo f_logger) : EventLoop(-1, f_logger) {}
+EventLoop::EventLoop(int cpu, logging_foo f_logger) : logger_(f_logger) {
+  LEventLoop logger(LEventLoop::FConstructor, this, logger_);
+
+  logger.Log("Creating epoll instance", Debug);
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  epoll_event event = {.events = EPOLLIN, .data = {.u64 = kWakeData}};
+  if (epoll_fd_ < 0 || wake_fd_ < 0 ||
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) < 0) {
+    int error = errno;
+    if (epoll_fd_ >= 0) {
+      close(epoll_fd_);
+    }
+    if (wake_fd_ >= 0) {
+      close(wake_fd_);
+    }
+    throw TcpException(TcpException::SocketCreation, logger_, error);
+  }
+
+  logger.Log("Creating loop thread", Debug);
+  thread_ = std::thread(&EventLoop::Loop, this);
+  thread_id_ = thread_.get_id();
+#ifdef __linux
+  if (cpu >= 0) {
+    logger.Log("Pinning loop thread to core " + std::to_string(cpu), Debug);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error =
+        pthread_setaffinity_np(thread_.native_handle(), sizeof(set), &set);
+    if (error != 0) {
+      logger.Log("Cannot pin loop thread. Running unpinned", Warning);
+      TcpException(TcpException::Multithreading, logger_, error);
+    }
+  }
+#endif
+  logger.Log("Event loop started", Info);
+}
+EventLoop::~EventLoop() {
+  LEventLoop logger(LEventLoop::FDestructor, this, logger_);
+
+  is_active_ = false;
+  Wake();
+  if (IsLoopThread()) {
+    thread_.detach();
+  } else {
+    thread_.join();
+  }
+  close(epoll_fd_);
+  close(wake_fd_);
+  logger.Log("Event loop stopped", Info);
+}
+
+EventLoop& EventLoop::GetDefault() {
+  // never destroyed, so clients living in static storage can still stop
+  static EventLoop* loop = new EventLoop();
+  return *loop;
+}
+
+void EventLoop::Watch(int fd, uint32_t events, event_foo callback) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint32_t generation = ++generation_;
+  epoll_event event = {.events = events,
+                       .data = {.u64 = MakeData(fd, generation)}};
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+    throw TcpException(TcpException::IncomeChecking, logger_, errno);
+  }
+  auto [iter, is_new] = watchers_.insert_or_assign(
+      fd,
+      Watcher{generation, std::make_shared<event_foo>(std::move(callback))});
+  if (is_new) {
+    ++watch_count_;
+  }
+}
+void EventLoop::Modify(int fd, uint32_t events) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto iter = watchers_.find(fd);
+  if (iter == watchers_.end()) {
+    throw TcpException(TcpException::IncomeChecking, logger_, ENOENT);
+  }
+  epoll_event event = {.events = events,
+                       .data = {.u64 = MakeData(fd, iter->second.generation)}};
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) < 0) {
+    throw TcpException(TcpException::IncomeChecking, logger_, errno);
+  }
+}
+void EventLoop::Unwatch(int fd) noexcept {
+  std::shared_ptr<event_foo> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = watchers_.find(fd);
+    if (iter == watchers_.end()) {
+      return;
+    }
+    callback = std::move(iter->second.callback);
+    watchers_.erase(iter);
+    --watch_count_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+TimerWheel::TimerId EventLoop::RunAfter(int64_t ms_delay, task_foo callback) {
+  TimerWheel::TimerId id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    id = wheel_.Schedule(ms_delay, std::move(callback));
+  }
+  if (!IsLoopThread()) {
+    Wake();
+  }
+  return id;
+}
+bool EventLoop::Cancel(TimerWheel::TimerId id) noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return wheel_.Cancel(id);
+}
+
+void EventLoop::Post(task_foo task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  Wake();
+}
+void EventLoop::RunSync(const task_foo& task) {
+  if (IsLoopThread()) {
+    task();
+    return;
+  }
+  std::promise<void> done;
+  Post([&task, &done] {
+    try {
+      task();
+      done.set_value();
+    } catch (...) {
+      done.set_exception(std::current_exception());
+    }
+  });
+  done.get_future().get();
+}
+
+bool EventLoop::IsLoopThread() const noexcept {
+  return std::this_thread::get_id() == thread_id_;
+}
+size_t EventLoop::GetWatchCount() const noexcept { return watch_count_; }
+
+void EventLoop::Loop() noexcept {
+  LEventLoop logger(LEventLoop::FLoop, this, logger_);
+  logger.Log("Starting loop", Debug);
+
+  epoll_event events[kMaxEvents];
+  while (is_active_) {
+    int ms_timeout = -1;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto next = wheel_.GetMsToNext(TimerWheel::Clock::now());
+      if (next.has_value()) {
+        ms_timeout = std::min<int64_t>(next.value(), INT_MAX);
+      }
+    }
+
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents, ms_timeout);
+    if (count < 0 && errno != EINTR) {
+      logger.Log("Error occurred while waiting for events", Warning);
+      TcpException(TcpException::IncomeChecking, logger_, errno);
+    }
+    for (int i = 0; i < count; ++i) {
+      Dispatch(events[i].data.u64, events[i].events, logger);
+    }
+
+    RunTimers(logger);
+    RunTasks(logger);
+  }
+  RunTasks(logger);
+}
+
+void EventLoop::Dispatch(uint64_t data, uint32_t events,
+                         Logger& logger) noexcept {
+  if (data == kWakeData) {
+    uint64_t value;
+    read(wake_fd_, &value, sizeof(value));
+    return;
+  }
+
+  int fd = int(data & 0xFFFFFFFF);
+  std::shared_ptr<event_foo> callback;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = watchers_.find(fd);
+    if (iter == watchers_.end() || iter->second.generation != data >> 32) {
+      return;
+    }
+    callback = iter->second.callback;
+  }
+  try {
+    (*callback)(events);
+  } catch (std::exception& exception) {
+    logger.Log("Exception in event callback: " + std::string(exception.what()),
+               Warning);
+  }
+}
+
+void EventLoop::RunTimers(Logger& logger) noexcept {
+  auto now = TimerWheel::Clock::now();
+  while (true) {
+    task_foo callback;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!wheel_.PopExpired(now, callback)) {
+        return;
+      }
+    }
+    try {
+      callback();
+    } catch (std::exception& exception) {
+      logger.Log(
+          "Exception in timer callback: " + std::string(exception.what()),
+          Warning);
+    }
+  }
+}
+
+void EventLoop::RunTasks(Logger& logger) noexcept {
+  std::vector<task_foo> tasks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks.swap(tasks_);
+  }
+  for (auto& task : tasks) {
+    try {
+      task();
+    } catch (std::exception& exception) {
+      logger.Log("Exception in posted task: " + std::string(exception.what()),
+                 Warning);
+    }
+  }
+}
+
+void EventLoop::Wake() noexcept {
+  uint64_t value = 1;
+  write(wake_fd_, &value, sizeof(value));
+}
+
+ReactorPool::ReactorPool(size_t count, const std::vector<int>& cores,
+                         ReactorPolicy policy, logging_foo f_logger)
+    : policy_(policy) {
+  try {
+    for (size_t i = 0; i < std::max<size_t>(count, 1); ++i) {
+      loops_.push_back(new EventLoop(i < cores.size() ? cores[i] : -1,
+                                     f_logger));
+    }
+  } catch (...) {
+    for (EventLoop* loop : loops_) {
+      delete loop;
+    }
+    throw;
+  }
+}
+ReactorPool::~ReactorPool() {
+  for (EventLoop* loop : loops_) {
+    delete loop;
+  }
+}
+
+size_t ReactorPool::GetSize() const noexcept { return loops_.size(); }
+EventLoop& ReactorPool::Get(size_t index) { return *loops_.at(index); }
+
+size_t ReactorPool::Pick() noexcept {
+  if (policy_ == RoundRobin) {
+    return next_.fetch_add(1, std::memory_order_relaxed) % loops_.size();
+  }
+  size_t best = 0;
+  for (size_t i = 1; i < loops_.size(); ++i) {
+    if (loops_[i]->GetWatchCount() < loops_[best]->GetWatchCount()) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+}  // namespace TCP
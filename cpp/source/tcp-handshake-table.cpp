@@ -0,0 +1,132 @@
+#include "tcp-handshake-table.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace TCP {
+
+HandshakeTable::HandshakeTable(size_t capacity)
+    : capacity_(std::max<size_t>(capacity, 1)) {
+  // at most half full keeps probe sequences short
+  slots_.resize(std::bit_ceil(capacity_ * 2));
+  mask_ = slots_.size() - 1;
+}
+
+std::optional<int> HandshakeTable::Insert(uint64_t password, int socket,
+                                          Clock::time_point deadline) {
+  std::optional<int> evicted;
+  if (auto index = Find(password); index.has_value()) {
+    evicted = slots_[index.value()].socket;
+    Erase(index.value());
+    ++evicted_;
+  } else if (size_ == capacity_) {
+    size_t oldest = slots_.size();
+    for (size_t index = 0; index < slots_.size(); ++index) {
+      if (slots_[index].password != 0 &&
+          (oldest == slots_.size() ||
+           slots_[index].deadline < slots_[oldest].deadline)) {
+        oldest = index;
+      }
+    }
+    evicted = slots_[oldest].socket;
+    Erase(oldest);
+    ++evicted_;
+  }
+
+  size_t index = GetHome(password);
+  while (slots_[index].password != 0) {
+    index = (index + 1) & mask_;
+  }
+  slots_[index] = {password, socket, deadline};
+  ++size_;
+  ++inserted_;
+  return evicted;
+}
+
+std::optional<int> HandshakeTable::Take(uint64_t password) noexcept {
+  auto index = Find(password);
+  if (!index.has_value()) {
+    return {};
+  }
+  int socket = slots_[index.value()].socket;
+  Erase(index.value());
+  ++completed_;
+  return socket;
+}
+
+bool HandshakeTable::Contains(uint64_t password) const noexcept {
+  return Find(password).has_value();
+}
+
+std::vector<int> HandshakeTable::Expire(Clock::time_point now) {
+  std::vector<int> sockets;
+  for (size_t index = 0; index < slots_.size();) {
+    if (slots_[index].password != 0 && slots_[index].deadline <= now) {
+      sockets.push_back(slots_[index].socket);
+      // the shift may pull an unvisited entry into this slot
+      Erase(index);
+      ++expired_;
+    } else {
+      ++index;
+    }
+  }
+  return sockets;
+}
+
+std::vector<int> HandshakeTable::Clear() {
+  std::vector<int> sockets;
+  for (auto& slot : slots_) {
+    if (slot.password != 0) {
+      sockets.push_back(slot.socket);
+      slot = {};
+    }
+  }
+  size_ = 0;
+  return sockets;
+}
+
+std::vector<std::pair<uint64_t, int>> HandshakeTable::GetEntries() const {
+  std::vector<std::pair<uint64_t, int>> entries;
+  for (const auto& slot : slots_) {
+    if (slot.password != 0) {
+      entries.emplace_back(slot.password, slot.socket);
+    }
+  }
+  return entries;
+}
+
+HandshakeTable::Stats HandshakeTable::GetStats() const noexcept {
+  return {size_, capacity_, inserted_, completed_, expired_, evicted_};
+}
+
+size_t HandshakeTable::GetHome(uint64_t password) const noexcept {
+  return (password * 0x9E3779B97F4A7C15ULL >> 32) & mask_;
+}
+
+std::optional<size_t> HandshakeTable::Find(
+    uint64_t password) const noexcept {
+  for (size_t index = GetHome(password); slots_[index].password != 0;
+       index = (index + 1) & mask_) {
+    if (slots_[index].password == password) {
+      return index;
+    }
+  }
+  return {};
+}
+
+void HandshakeTable::Erase(size_t index) noexcept {
+  size_t hole = index;
+  for (size_t next = (hole + 1) & mask_; slots_[next].password != 0;
+       next = (next + 1) & mask_) {
+    // an entry may move into the hole only if that keeps it reachable
+    size_t home = GetHome(slots_[next].password);
+    if (((next - home) & mask_) >= ((next - hole) & mask_)) {
+      slots_[hole] = slots_[next];
+      hole = next;
+    }
+  }
+  slots_[hole] = {};
+  --size_;
+}
+
+}  // namespace TCP
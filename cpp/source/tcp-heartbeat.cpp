@@ -0,0 +1,307 @@
+#include "tcp-heartbeat.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#ifdef __linux
+#include <linux/tcp.h>
+#endif
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace TCP {
+
+HeartBeat::HeartBeat(Role role, int socket, int main_socket,
+                     ShmChannel* shm_channel, int ping_threshold,
+                     int loop_period, bool is_piggyback, double phi_threshold,
+                     logging_foo f_logger)
+    : role_(role),
+      socket_(socket),
+      main_socket_(main_socket),
+      shm_channel_(shm_channel),
+      ping_threshold_(ping_threshold),
+      loop_period_(loop_period),
+      is_piggyback_(is_piggyback),
+      phi_threshold_(phi_threshold),
+      logger_(f_logger),
+      // a Responder asks for a ping only after two silent periods
+      detector_(loop_period, loop_period * 2) {}
+HeartBeat::~HeartBeat() { Stop(); }
+
+void HeartBeat::Start(EventLoop& loop) {
+  LClient logger(LClient::FHeartBeatLoop, this, logger_);
+  logger.Log("Registering heartbeat in event loop", Debug);
+
+  loop.RunSync([this, &loop] {
+    loop_ = &loop;
+    detector_.Reset(Clock::now());
+    traffic_mark_ = GetTrafficMark(delivered_mark_);
+    loop.Watch(socket_, EPOLLIN,
+               [this](uint32_t events) { OnReadable(events); });
+    is_running_ = true;
+    Schedule(role_ == Pinger ? 0 : loop_period_);
+  });
+  logger.Log("Heartbeat started", Debug);
+}
+
+void HeartBeat::Stop() noexcept {
+  if (loop_ == nullptr) {
+    return;
+  }
+  try {
+    loop_->RunSync([this] { Detach(); });
+  } catch (...) {
+    LClient(LClient::FHeartBeatLoop, this, logger_)
+        .Log("Cannot reach event loop while stopping", Error);
+  }
+  loop_ = nullptr;
+}
+
+int HeartBeat::GetPing() const noexcept { return ms_ping_; }
+double HeartBeat::GetSuspicion() const noexcept {
+  if (ms_ping_ < 0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return detector_.GetSuspicion(Clock::now());
+}
+
+void HeartBeat::AddReceived(size_t bytes) noexcept {
+  bytes_received_.fetch_add(bytes, std::memory_order_relaxed);
+}
+void HeartBeat::AddSent(size_t bytes) noexcept {
+  bytes_sent_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+std::string HeartBeat::GetPartial() const {
+  return std::string(message_, message_size_);
+}
+void HeartBeat::SetPartial(const std::string& partial) noexcept {
+  message_size_ = std::min(partial.size(), kMessageSize - 1);
+  memcpy(message_, partial.data(), message_size_);
+}
+
+void HeartBeat::OnReadable(uint32_t events) noexcept {
+  LClient logger(LClient::FHeartBeatLoop, this, logger_);
+  auto wake_time = Clock::now();
+
+  while (is_running_) {
+    ssize_t answ = recv(socket_, message_ + message_size_,
+                        kMessageSize - message_size_, MSG_DONTWAIT);
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (answ <= 0) {
+      TcpException(TcpException::Receiving, logger_, errno);
+      Fail("Error occurred while receiving", logger);
+      return;
+    }
+
+    message_size_ += answ;
+    if (message_size_ == kMessageSize) {
+      message_size_ = 0;
+      int64_t value = strtoll(message_, nullptr, 10);
+      if (role_ == Pinger && value == kPingRequest) {
+        logger.Log("Peer hears nothing. Pinging", Debug);
+        if (!is_waiting_reply_ && !SendPing(Clock::now(), logger)) {
+          return;
+        }
+      } else if (role_ == Pinger) {
+        OnDelay(value, logger);
+      } else {
+        OnPing(value, MsSince(wake_time), logger);
+      }
+    }
+  }
+}
+
+void HeartBeat::OnDelay(int64_t delay, Logger& logger) noexcept {
+  if (!is_waiting_reply_) {
+    logger.Log("Got delay without ping", Warning);
+    return;
+  }
+  is_waiting_reply_ = false;
+  detector_.AddArrival(Clock::now());
+  int64_t ping = std::max<int64_t>((MsSince(ping_time_) - delay) / 2, 0);
+  if (logger.IsEnabled()) {
+    logger.Log("Setting ping: " + std::to_string(ping), Debug);
+  }
+  ms_ping_ = ping;
+}
+
+void HeartBeat::OnPing(int64_t ping, int64_t delay, Logger& logger) noexcept {
+  logger.Log("Ping received. Sending delay", Debug);
+  ms_ping_ = ping;
+
+  if (!SendValue(delay, "Error occurred while sending", logger)) {
+    return;
+  }
+  detector_.AddArrival(Clock::now());
+}
+
+bool HeartBeat::SendPing(Clock::time_point now, Logger& logger) noexcept {
+  logger.Log("Sending ping", Debug);
+  if (!SendValue(ms_ping_.load(), "Error occurred while sending ping",
+                 logger)) {
+    return false;
+  }
+  ping_time_ = now;
+  is_waiting_reply_ = true;
+  return true;
+}
+
+bool HeartBeat::SendValue(int64_t value, const char* reason,
+                          Logger& logger) noexcept {
+  char message[kMessageSize] = {};
+  std::to_chars(message, message + kULLMaxDigits, value);
+  if (send(socket_, message, kMessageSize, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+      kMessageSize) {
+    TcpException(TcpException::Sending, logger_, errno);
+    Fail(reason, logger);
+    return false;
+  }
+  return true;
+}
+
+void HeartBeat::OnTimer() noexcept {
+  LClient logger(LClient::FHeartBeatLoop, this, logger_);
+  timer_ = 0;
+
+  auto now = Clock::now();
+  bool is_delivering = false;
+  if (IsTrafficObserved(is_delivering)) {
+    detector_.AddArrival(now);
+  }
+  if (IsSuspected(now)) {
+    Fail("Heartbeat timeout. Disconnecting", logger);
+    return;
+  }
+
+  // the peer only learns that this side is alive from what reaches it, so
+  // traffic skips a ping just when it flows toward the peer
+  if (role_ == Pinger && is_delivering) {
+    logger.Log("Main traffic reaches peer. Skipping ping", Debug);
+  } else if (role_ == Pinger && !is_waiting_reply_) {
+    if (!SendPing(now, logger)) {
+      return;
+    }
+  } else if (role_ == Responder && is_piggyback_ &&
+             detector_.GetMsSinceArrival(now) > loop_period_ * 2) {
+    logger.Log("Nothing heard from peer. Requesting ping", Debug);
+    if (!SendValue(kPingRequest, "Error occurred while requesting ping",
+                   logger)) {
+      return;
+    }
+  }
+  Schedule(loop_period_);
+}
+
+void HeartBeat::Schedule(int64_t ms_delay) noexcept {
+  if (timer_ != 0) {
+    loop_->Cancel(timer_);
+  }
+  try {
+    timer_ = loop_->RunAfter(ms_delay, [this] { OnTimer(); });
+  } catch (std::exception& exception) {
+    LClient logger(LClient::FHeartBeatLoop, this, logger_);
+    Fail("Cannot schedule heartbeat", logger);
+  }
+}
+
+void HeartBeat::Fail(const char* reason, Logger& logger) noexcept {
+  logger.Log(reason, Warning);
+  ms_ping_ = -1;
+  Detach();
+}
+
+void HeartBeat::Detach() noexcept {
+  if (!is_running_) {
+    return;
+  }
+  is_running_ = false;
+  loop_->Unwatch(socket_);
+  if (timer_ != 0) {
+    loop_->Cancel(timer_);
+    timer_ = 0;
+  }
+}
+
+bool HeartBeat::IsSuspected(Clock::time_point now) const noexcept {
+  // phi judges steady links early, the ping threshold caps every link
+  if (detector_.GetMsSinceArrival(now) > ping_threshold_) {
+    return true;
+  }
+  return phi_threshold_ > 0 && detector_.GetSuspicion(now) > phi_threshold_;
+}
+
+bool HeartBeat::IsTrafficObserved(bool& is_delivering) noexcept {
+  is_delivering = false;
+  if (!is_piggyback_) {
+    return false;
+  }
+  uint64_t delivered = 0;
+  uint64_t mark = GetTrafficMark(delivered);
+  is_delivering = delivered != delivered_mark_;
+  delivered_mark_ = delivered;
+  if (mark == traffic_mark_) {
+    return false;
+  }
+  traffic_mark_ = mark;
+  auto transport_ping = GetTransportPing();
+  if (transport_ping.has_value()) {
+    ms_ping_ = transport_ping.value();
+  }
+  return true;
+}
+
+uint64_t HeartBeat::GetTrafficMark(uint64_t& delivered) noexcept {
+  delivered = 0;
+  if (shm_channel_ != nullptr) {
+    delivered = shm_channel_->GetDeliveredMark();
+    return shm_channel_->GetTrafficMark();
+  }
+#ifdef __linux
+  tcp_info info = {};
+  socklen_t length = sizeof(info);
+  if (getsockopt(main_socket_, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 &&
+      length >= offsetof(tcp_info, tcpi_bytes_received) +
+                    sizeof(info.tcpi_bytes_received)) {
+    delivered = info.tcpi_bytes_acked;
+    return info.tcpi_bytes_acked + info.tcpi_bytes_received;
+  }
+#endif
+  int pending = 0;
+  ioctl(main_socket_, FIONREAD, &pending);
+  return bytes_received_.load() + pending + bytes_sent_.load();
+}
+
+std::optional<int> HeartBeat::GetTransportPing() noexcept {
+#ifdef __linux
+  tcp_info info = {};
+  socklen_t length = sizeof(info);
+  if (shm_channel_ == nullptr &&
+      getsockopt(main_socket_, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 &&
+      info.tcpi_rtt != 0) {
+    return info.tcpi_rtt / 2'000;
+  }
+#endif
+  return {};
+}
+
+int64_t HeartBeat::MsSince(Clock::time_point time) noexcept {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                               time)
+      .count();
+}
+
+}  // namespace TCP
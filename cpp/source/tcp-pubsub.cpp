@@ -0,0 +1,392 @@
+#include "tcp-pubsub.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace TCP {
+
+PubSubServer::Subscriber::Subscriber(TcpClient&& client) noexcept
+    : client(std::move(client)) {}
+
+PubSubServer::PubSubServer(TcpServer& server, const PubSubOptions& options,
+                           logging_foo f_logger)
+    : server_(server),
+      options_(options),
+      logger_(f_logger),
+      index_(std::make_shared<const TopicIndex>()) {
+  LPubSub logger(LPubSub::FConstructor, this, logger_);
+
+  logger.Log("Creating wake descriptor", Debug);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd_ < 0) {
+    throw TcpException(TcpException::SocketCreation, logger_, errno);
+  }
+
+  logger.Log("Creating accepter, controller and sender threads", Debug);
+  accept_thread_ = std::thread(&PubSubServer::AcceptLoop, this);
+  control_thread_ = std::thread(&PubSubServer::ControlLoop, this);
+  for (int i = 0; i < std::max(options_.sender_threads, 1); ++i) {
+    sender_threads_.emplace_back(&PubSubServer::SendLoop, this);
+  }
+  logger.Log("Pub/sub server started", Info);
+}
+PubSubServer::~PubSubServer() {
+  Stop();
+  LPubSub(LPubSub::FDestructor, this, logger_)
+      .Log("Pub/sub server destructed", Info);
+}
+
+size_t PubSubServer::PublishStr(const std::string& topic,
+                                const std::string& message) {
+  LPubSub logger(LPubSub::FPublish, this, logger_);
+  published_.fetch_add(1, std::memory_order_relaxed);
+
+  auto index = index_.load();
+  auto iter = index->find(topic);
+  if (iter == index->end()) {
+    logger.Log("Topic has no subscribers", Debug);
+    return 0;
+  }
+  const SubscriberList& subscribers = *iter->second;
+
+  auto shared = std::make_shared<const Message>(
+      Message{topic, TcpClient::MakeFrame(message)});
+  SubscriberList ready;
+  for (const auto& subscriber : subscribers) {
+    if (Enqueue(*subscriber, shared)) {
+      ready.push_back(subscriber);
+    }
+  }
+
+  if (!ready.empty()) {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    for (auto& subscriber : ready) {
+      ready_.push_back(std::move(subscriber));
+    }
+  }
+  if (ready.size() == 1) {
+    ready_cv_.notify_one();
+  } else if (ready.size() > 1) {
+    ready_cv_.notify_all();
+  }
+  if (logger.IsEnabled()) {
+    logger.Log("Published to " + std::to_string(subscribers.size()) +
+                   " subscribers of " + topic,
+               Debug);
+  }
+  return subscribers.size();
+}
+
+size_t PubSubServer::GetSubscriberCount() noexcept {
+  std::lock_guard<std::mutex> lock(subscribers_mutex_);
+  return subscribers_.size();
+}
+
+PubSubStats PubSubServer::GetStats() const noexcept {
+  return {published_.load(), delivered_.load(), conflated_.load(),
+          dropped_.load()};
+}
+
+void PubSubServer::Stop() noexcept {
+  if (!is_active_.exchange(false)) {
+    return;
+  }
+  LPubSub logger(LPubSub::FDestructor, this, logger_);
+
+  logger.Log("Closing listener. Joining accepter", Debug);
+  server_.CloseListener();
+  accept_thread_.join();
+
+  logger.Log("Joining controller", Debug);
+  Wake();
+  control_thread_.join();
+
+  logger.Log("Joining senders", Debug);
+  {
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    ready_cv_.notify_all();
+  }
+  for (auto& thread : sender_threads_) {
+    thread.join();
+  }
+
+  ready_.clear();
+  delayed_.clear();
+  index_.store(std::make_shared<const TopicIndex>());
+  {
+    std::lock_guard<std::mutex> lock(subscribers_mutex_);
+    subscribers_.clear();
+  }
+  close(wake_fd_);
+  logger.Log("Pub/sub server stopped", Info);
+}
+
+void PubSubServer::AcceptLoop() noexcept {
+  LPubSub logger(LPubSub::FAccepter, this, logger_);
+  logger.Log("Starting accepter loop", Debug);
+
+  while (is_active_) {
+    std::shared_ptr<Subscriber> subscriber;
+    try {
+      subscriber = std::make_shared<Subscriber>(server_.AcceptConnection());
+    } catch (TcpException& exception) {
+      if (exception.GetType() == TcpException::NoData) {
+        continue;
+      }
+      logger.Log("Listener is closed. Stopping accepter loop", Info);
+      break;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(subscribers_mutex_);
+      subscribers_.push_back(std::move(subscriber));
+    }
+    Wake();
+    logger.Log("Subscriber accepted", Info);
+  }
+}
+
+void PubSubServer::ControlLoop() noexcept {
+  LPubSub logger(LPubSub::FController, this, logger_);
+  logger.Log("Starting controller loop", Debug);
+
+  SubscriberList subscribers;
+  std::vector<pollfd> fds;
+  while (is_active_) {
+    {
+      std::lock_guard<std::mutex> lock(subscribers_mutex_);
+      subscribers = subscribers_;
+    }
+    // shared memory subscribers have no socket to wait on and are checked
+    // every control period
+    fds.assign(1, {wake_fd_, POLLIN, 0});
+    for (const auto& subscriber : subscribers) {
+      const TcpClient& client = subscriber->client;
+      fds.push_back({client.shm_channel_ == nullptr ? client.main_socket_ : -1,
+                     POLLIN, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), kControlPeriod) < 0 && errno != EINTR) {
+      logger.Log("Error occurred while polling subscribers", Error);
+      TcpException(TcpException::Receiving, logger_, errno);
+      break;
+    }
+    if (fds[0].revents != 0) {
+      uint64_t value;
+      read(wake_fd_, &value, sizeof(value));
+    }
+
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+      const auto& subscriber = subscribers[i];
+      short events = fds[i + 1].revents;
+      try {
+        if (events != 0 || fds[i + 1].fd < 0) {
+          Serve(subscriber, logger);
+        }
+        if ((events & (POLLERR | POLLHUP)) != 0 ||
+            !subscriber->client.IsConnected()) {
+          throw TcpException(TcpException::ConnectionBreak, logger_);
+        }
+      } catch (TcpException& exception) {
+        logger.Log("Subscriber is disconnected. Removing", Info);
+        Remove(subscriber);
+      }
+    }
+  }
+}
+
+void PubSubServer::SendLoop() noexcept {
+  LPubSub logger(LPubSub::FSender, this, logger_);
+  logger.Log("Starting sender loop", Debug);
+
+  while (true) {
+    std::shared_ptr<Subscriber> subscriber;
+    {
+      std::unique_lock<std::mutex> lock(ready_mutex_);
+      while (true) {
+        if (!is_active_) {
+          return;
+        }
+        auto now = Clock::now();
+        while (!delayed_.empty() && delayed_.front().first <= now) {
+          ready_.push_back(std::move(delayed_.front().second));
+          delayed_.pop_front();
+        }
+        if (!ready_.empty()) {
+          break;
+        }
+        if (delayed_.empty()) {
+          ready_cv_.wait(lock);
+        } else {
+          ready_cv_.wait_until(lock, delayed_.front().first);
+        }
+      }
+      subscriber = std::move(ready_.front());
+      ready_.pop_front();
+    }
+    Flush(std::move(subscriber));
+  }
+}
+
+void PubSubServer::Serve(const std::shared_ptr<Subscriber>& subscriber,
+                         Logger& logger) {
+  while (subscriber->client.IsAvailable()) {
+    auto message = subscriber->client.RecvStr(0);
+    size_t delimiter = message.find(' ');
+    std::string kind = message.substr(0, delimiter);
+    if (delimiter == std::string::npos || delimiter + 1 == message.size() ||
+        (kind != kPubSubSubscribe && kind != kPubSubUnsubscribe)) {
+      logger.Log("Unknown control message: " + message, Warning);
+      continue;
+    }
+    std::string topic = message.substr(delimiter + 1);
+    if (logger.IsEnabled()) {
+      logger.Log((kind == kPubSubSubscribe ? "Subscribing to "
+                                           : "Unsubscribing from ") +
+                     topic,
+                 Debug);
+    }
+    Subscribe(subscriber, topic, kind == kPubSubSubscribe);
+  }
+}
+
+void PubSubServer::Subscribe(const std::shared_ptr<Subscriber>& subscriber,
+                             const std::string& topic, bool is_subscribe) {
+  if (is_subscribe ? !subscriber->topics.insert(topic).second
+                   : subscriber->topics.erase(topic) == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  auto index = std::make_shared<TopicIndex>(*index_.load());
+  UpdateTopic(*index, topic, subscriber, is_subscribe);
+  index_.store(std::move(index));
+}
+
+void PubSubServer::Remove(
+    const std::shared_ptr<Subscriber>& subscriber) noexcept {
+  {
+    std::lock_guard<std::mutex> lock(subscriber->mutex);
+    subscriber->is_closed = true;
+    subscriber->queue.clear();
+  }
+  if (!subscriber->topics.empty()) {
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    auto index = std::make_shared<TopicIndex>(*index_.load());
+    for (const auto& topic : subscriber->topics) {
+      UpdateTopic(*index, topic, subscriber, false);
+    }
+    index_.store(std::move(index));
+    subscriber->topics.clear();
+  }
+
+  std::lock_guard<std::mutex> lock(subscribers_mutex_);
+  subscribers_.erase(
+      std::remove(subscribers_.begin(), subscribers_.end(), subscriber),
+      subscribers_.end());
+}
+
+void PubSubServer::UpdateTopic(TopicIndex& index, const std::string& topic,
+                               const std::shared_ptr<Subscriber>& subscriber,
+                               bool is_subscribe) {
+  auto iter = index.find(topic);
+  auto subscribers = iter == index.end()
+                         ? std::make_shared<SubscriberList>()
+                         : std::make_shared<SubscriberList>(*iter->second);
+  if (is_subscribe) {
+    subscribers->push_back(subscriber);
+  } else {
+    subscribers->erase(
+        std::remove(subscribers->begin(), subscribers->end(), subscriber),
+        subscribers->end());
+  }
+
+  if (subscribers->empty()) {
+    index.erase(topic);
+  } else {
+    index[topic] = std::move(subscribers);
+  }
+}
+
+bool PubSubServer::Enqueue(
+    Subscriber& subscriber,
+    const std::shared_ptr<const Message>& message) noexcept {
+  std::lock_guard<std::mutex> lock(subscriber.mutex);
+  if (subscriber.is_closed) {
+    return false;
+  }
+
+  auto& queue = subscriber.queue;
+  if (queue.size() < options_.max_queue) {
+    queue.push_back(message);
+  } else {
+    auto iter = std::find_if(queue.rbegin(), queue.rend(), [&](auto& queued) {
+      return queued->topic == message->topic;
+    });
+    if (iter != queue.rend()) {
+      *iter = message;
+      conflated_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      queue.pop_front();
+      queue.push_back(message);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  if (subscriber.is_scheduled) {
+    return false;
+  }
+  subscriber.is_scheduled = true;
+  return true;
+}
+
+void PubSubServer::Flush(std::shared_ptr<Subscriber> subscriber) noexcept {
+  bool is_full = false;
+  for (size_t i = 0; i < kMaxFlushBurst && !is_full; ++i) {
+    std::shared_ptr<const Message> message;
+    {
+      std::lock_guard<std::mutex> lock(subscriber->mutex);
+      if (subscriber->queue.empty() || subscriber->is_closed) {
+        subscriber->is_scheduled = false;
+        return;
+      }
+      message = subscriber->queue.front();
+      is_full = !subscriber->client.HasSendRoom(message->frame.Size());
+      if (is_full) {
+        break;
+      }
+      subscriber->queue.pop_front();
+    }
+
+    try {
+      subscriber->client.SendFrame(message->frame);
+      delivered_.fetch_add(1, std::memory_order_relaxed);
+    } catch (TcpException& exception) {
+      std::lock_guard<std::mutex> lock(subscriber->mutex);
+      subscriber->is_closed = true;
+      subscriber->queue.clear();
+      subscriber->is_scheduled = false;
+      return;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(ready_mutex_);
+  if (is_full) {
+    delayed_.emplace_back(
+        Clock::now() + std::chrono::milliseconds(options_.ms_retry),
+        std::move(subscriber));
+  } else {
+    ready_.push_back(std::move(subscriber));
+  }
+  ready_cv_.notify_one();
+}
+
+void PubSubServer::Wake() noexcept {
+  uint64_t value = 1;
+  write(wake_fd_, &value, sizeof(value));
+}
+
+}  // namespace TCP
@@ -0,0 +1,27 @@
+#include "tcp-rate-limit.hpp"
+
+#include <algorithm>
+
+namespace TCP {
+
+TokenBucket::TokenBucket(double rate, double burst) noexcept
+    : rate_(rate),
+      burst_(std::max(burst, 1.0)),
+      tokens_(burst_),
+      last_refill_(Clock::now()) {}
+
+bool TokenBucket::TryTake(Clock::time_point now) noexcept {
+  if (rate_ <= 0) {
+    return true;
+  }
+  double seconds = std::chrono::duration<double>(now - last_refill_).count();
+  tokens_ = std::min(burst_, tokens_ + seconds * rate_);
+  last_refill_ = now;
+  if (tokens_ < 1) {
+    return false;
+  }
+  tokens_ -= 1;
+  return true;
+}
+
+}  // namespace TCP
@@ -0,0 +1,652 @@
+#include "tcp-resilient.hpp"
+
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <algorithm>
+#include <charconv>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace TCP {
+
+namespace {
+
+std::string_view GetKind(const std::string& message) noexcept {
+  return std::string_view(message).substr(0, message.find(' '));
+}
+
+uint64_t NextNumber(const std::string& message, size_t& position) noexcept {
+  while (position < message.size() && message[position] == ' ') {
+    ++position;
+  }
+  uint64_t value = 0;
+  auto result = std::from_chars(message.data() + position,
+                                message.data() + message.size(), value);
+  position = result.ptr - message.data();
+  return value;
+}
+
+std::string Rest(const std::string& message, size_t position) {
+  if (position + 1 >= message.size()) {
+    return "";
+  }
+  return message.substr(position + 1);
+}
+
+}  // namespace
+
+ResilientSession::ResilientSession(const ResilienceOptions& options,
+                                   logging_foo f_logger)
+    : options_(options), logger_(f_logger), detach_time_(Clock::now()) {}
+ResilientSession::~ResilientSession() { Close(); }
+
+void ResilientSession::SendStr(const std::string& message) {
+  LResilient logger(LResilient::FSend, this, logger_);
+
+  std::lock_guard<std::mutex> send_lock(send_mutex_);
+  std::shared_ptr<TcpClient> client;
+  uint64_t seq;
+  uint64_t ack;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_active_) {
+      logger.Log("Session is lost", Warning);
+      throw TcpException(TcpException::ConnectionBreak, logger_);
+    }
+    if (unacked_.size() >= options_.max_unacked) {
+      logger.Log("Too many unacknowledged messages", Warning);
+      throw TcpException(TcpException::Sending, logger_, ENOBUFS);
+    }
+    seq = next_seq_++;
+    ack = acked_received_ = received_seq_;
+    unacked_.push_back({seq, message});
+    client = client_;
+  }
+
+  if (client == nullptr) {
+    logger.Log("Not connected. Message kept for replay", Debug);
+    return;
+  }
+  try {
+    client->Send(kResilientData, seq, ack, message);
+  } catch (TcpException& exception) {
+    logger.Log("Connection lost. Message kept for replay", Warning);
+    Detach(client);
+  }
+}
+
+std::string ResilientSession::RecvStr(int ms_timeout) {
+  LResilient logger(LResilient::FRecv, this, logger_);
+  auto deadline = Clock::now() + std::chrono::milliseconds(ms_timeout);
+
+  while (true) {
+    std::shared_ptr<TcpClient> client;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      state_cv_.wait_until(lock, deadline, [this] {
+        return !is_active_ || client_ != nullptr;
+      });
+      if (!is_active_) {
+        logger.Log("Session is lost", Warning);
+        throw TcpException(TcpException::ConnectionBreak, logger_);
+      }
+      client = client_;
+    }
+    if (client == nullptr) {
+      logger.Log("Timeout while waiting for resumption", Debug);
+      return "";
+    }
+
+    auto ms_left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - Clock::now())
+                       .count();
+    std::string message;
+    try {
+      message = client->RecvStr(std::max<int64_t>(ms_left, 0));
+    } catch (TcpException& exception) {
+      logger.Log("Connection lost. Waiting for resumption", Warning);
+      Detach(client);
+      continue;
+    }
+    if (message.empty()) {
+      if (Clock::now() >= deadline) {
+        return "";
+      }
+      continue;
+    }
+
+    auto kind = GetKind(message);
+    size_t position = kind.size();
+    uint64_t ack_to_send = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (kind == kResilientAck) {
+        Acknowledge(NextNumber(message, position));
+        continue;
+      }
+      if (kind != kResilientData) {
+        logger.Log("Got unexpected message", Warning);
+        continue;
+      }
+      uint64_t seq = NextNumber(message, position);
+      Acknowledge(NextNumber(message, position));
+      if (seq <= received_seq_) {
+        logger.Log("Dropping replayed duplicate", Debug);
+        continue;
+      }
+      received_seq_ = seq;
+      if (received_seq_ - acked_received_ >= kAckPeriod) {
+        ack_to_send = acked_received_ = received_seq_;
+      }
+    }
+
+    if (ack_to_send != 0) {
+      try {
+        client->Send(kResilientAck, ack_to_send);
+      } catch (TcpException& exception) {
+        Detach(client);
+      }
+    }
+    return Rest(message, position);
+  }
+}
+
+void ResilientSession::Close() noexcept {
+  std::shared_ptr<TcpClient> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    is_active_ = false;
+    dropped = std::move(client_);
+    client_ = nullptr;
+  }
+  state_cv_.notify_all();
+}
+bool ResilientSession::IsActive() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return is_active_;
+}
+bool ResilientSession::IsConnected() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return client_ != nullptr && client_->IsConnected();
+}
+
+uint64_t ResilientSession::GetSessionId() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return session_id_;
+}
+size_t ResilientSession::GetUnacked() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return unacked_.size();
+}
+
+void ResilientSession::Attach(std::shared_ptr<TcpClient> client,
+                              uint64_t peer_received) {
+  LResilient logger(LResilient::FSend, this, logger_);
+
+  std::lock_guard<std::mutex> send_lock(send_mutex_);
+  std::deque<Message> replay;
+  uint64_t ack;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Acknowledge(peer_received);
+    replay = unacked_;
+    ack = acked_received_ = received_seq_;
+  }
+  if (logger.IsEnabled()) {
+    logger.Log("Replaying " + std::to_string(replay.size()) + " messages",
+               Debug);
+  }
+  for (auto& message : replay) {
+    client->Send(kResilientData, message.seq, ack, message.body);
+  }
+
+  std::shared_ptr<TcpClient> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_active_) {
+      return;
+    }
+    dropped = std::move(client_);
+    client_ = std::move(client);
+  }
+  state_cv_.notify_all();
+  logger.Log("Connection attached", Info);
+}
+
+void ResilientSession::Detach(
+    const std::shared_ptr<TcpClient>& client) noexcept {
+  std::shared_ptr<TcpClient> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (client_ != client) {
+      return;
+    }
+    dropped = std::move(client_);
+    client_ = nullptr;
+    detach_time_ = Clock::now();
+  }
+  state_cv_.notify_all();
+}
+
+uint64_t ResilientSession::GetReceived() noexcept {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return received_seq_;
+}
+
+bool ResilientSession::IsExpired() noexcept {
+  std::shared_ptr<TcpClient> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!is_active_) {
+      return true;
+    }
+    if (client_ != nullptr) {
+      if (client_->IsConnected()) {
+        return false;
+      }
+      dropped = std::move(client_);
+      client_ = nullptr;
+      detach_time_ = Clock::now();
+    }
+    if (Clock::now() - detach_time_ <=
+        std::chrono::milliseconds(options_.ms_session_timeout)) {
+      return false;
+    }
+    is_active_ = false;
+  }
+  state_cv_.notify_all();
+  return true;
+}
+
+void ResilientSession::Acknowledge(uint64_t ack) noexcept {
+  while (!unacked_.empty() && unacked_.front().seq <= ack) {
+    unacked_.pop_front();
+  }
+}
+
+ResilientClient::ResilientClient(const char* addr, int port,
+                                 int ms_ping_threshold, int ms_loop_period,
+                                 const SocketOptions& socket_options,
+                                 const ResilienceOptions& options,
+                                 logging_foo f_logger)
+    : ResilientSession(options, f_logger),
+      addr_(addr),
+      port_(port),
+      ping_threshold_(ms_ping_threshold),
+      loop_period_(ms_loop_period),
+      socket_options_(socket_options),
+      random_(std::random_device()()) {
+  LResilient logger(LResilient::FConstructor, this, logger_);
+
+  logger.Log("Opening session", Debug);
+  Resume();
+  if (!IsActive()) {
+    throw TcpException(TcpException::Acceptance, logger_);
+  }
+
+  logger.Log("Creating reconnect thread", Debug);
+  reconnect_thread_ = std::thread(&ResilientClient::ReconnectLoop, this);
+  logger.Log("Session " + std::to_string(session_id_) + " opened", Info);
+}
+ResilientClient::ResilientClient(const char* addr, int port,
+                                 logging_foo f_logger)
+    : ResilientClient(addr, port, kDefPingThreshold, kDefLoopPeriod,
+                      kDefSocketOptions, kDefResilienceOptions, f_logger) {}
+ResilientClient::~ResilientClient() {
+  Close();
+  if (reconnect_thread_.joinable()) {
+    reconnect_thread_.join();
+  }
+  LResilient(LResilient::FDestructor, this, logger_)
+      .Log("Session closed", Info);
+}
+
+void ResilientClient::Resume() {
+  auto client = std::make_shared<TcpClient>(addr_.c_str(), port_,
+                                            ping_threshold_, loop_period_,
+                                            socket_options_, logger_);
+  uint64_t session_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_id = session_id_;
+  }
+  client->Send(kResilientHello, session_id, GetReceived());
+
+  auto reply = client->RecvStr(ping_threshold_);
+  if (GetKind(reply) != kResilientHello) {
+    throw TcpException(TcpException::Receiving, logger_);
+  }
+  size_t position = GetKind(reply).size();
+  uint64_t granted = NextNumber(reply, position);
+  uint64_t peer_received = NextNumber(reply, position);
+
+  if (granted == 0) {
+    LResilient(LResilient::FReconnectLoop, this, logger_)
+        .Log("Server does not know the session", Error);
+    Close();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_id_ = granted;
+  }
+  Attach(std::move(client), peer_received);
+}
+
+void ResilientClient::ReconnectLoop() noexcept {
+  LResilient logger(LResilient::FReconnectLoop, this, logger_);
+  logger.Log("Starting reconnect loop", Debug);
+
+  int ms_backoff = options_.ms_min_backoff;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      state_cv_.wait_for(lock, std::chrono::milliseconds(loop_period_),
+                         [this] { return !is_active_ || client_ == nullptr; });
+    }
+    if (IsExpired()) {
+      logger.Log("Session is closed or lost. Stopping reconnect loop", Info);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (client_ != nullptr) {
+        ms_backoff = options_.ms_min_backoff;
+        continue;
+      }
+    }
+
+    logger.Log("Connection lost. Reconnecting", Warning);
+    try {
+      Resume();
+      logger.Log("Session resumed", Info);
+      ms_backoff = options_.ms_min_backoff;
+      continue;
+    } catch (std::exception& exception) {
+      logger.Log("Cannot reconnect: " + std::string(exception.what()),
+                 Warning);
+    }
+
+    std::uniform_int_distribution<int> jitter(ms_backoff / 2, ms_backoff);
+    std::unique_lock<std::mutex> lock(mutex_);
+    state_cv_.wait_for(lock, std::chrono::milliseconds(jitter(random_)),
+                       [this] { return !is_active_; });
+    ms_backoff = std::min(ms_backoff * 2, options_.ms_max_backoff);
+  }
+}
+
+ResilientServer::Session::Session(uint64_t session_id,
+                                  const ResilienceOptions& options,
+                                  logging_foo f_logger)
+    : ResilientSession(options, f_logger) {
+  session_id_ = session_id;
+}
+
+ResilientServer::ResilientServer(TcpServer& server,
+                                 const ResilienceOptions& options,
+                                 logging_foo f_logger)
+    : server_(server),
+      options_(options),
+      logger_(f_logger),
+      loop_(&EventLoop::GetDefault()) {
+  LResilient logger(LResilient::FConstructor, this, logger_);
+
+  logger.Log("Scheduling session sweeper", Debug);
+  loop_->RunSync([this] {
+    sweep_timer_ = loop_->RunAfter(std::max(options_.ms_session_timeout / 4, 1),
+                                   [this] { Sweep(); });
+  });
+
+  logger.Log("Creating accepter and handshake threads", Debug);
+  accept_thread_ = std::thread(&ResilientServer::AcceptLoop, this);
+  handshake_thread_ = std::thread(&ResilientServer::HandshakeLoop, this);
+  logger.Log("Resilient server started", Info);
+}
+ResilientServer::~ResilientServer() {
+  Stop();
+  LResilient(LResilient::FDestructor, this, logger_)
+      .Log("Resilient server destructed", Info);
+}
+
+std::shared_ptr<ResilientSession> ResilientServer::AcceptSession() {
+  LResilient logger(LResilient::FAccepter, this, logger_);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  accept_cv_.wait(lock,
+                  [this] { return !accepted_.empty() || !is_accepting_; });
+  if (accepted_.empty()) {
+    logger.Log("Server is not active", Info);
+    throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
+  auto session = std::move(accepted_.front());
+  accepted_.pop();
+  return session;
+}
+
+void ResilientServer::Stop() noexcept {
+  if (!is_active_.exchange(false)) {
+    return;
+  }
+  LResilient logger(LResilient::FDestructor, this, logger_);
+
+  logger.Log("Closing listener. Joining accepter", Debug);
+  server_.CloseListener();
+  accept_thread_.join();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready_cv_.notify_all();
+  }
+  handshake_thread_.join();
+  loop_->RunSync([this] {
+    loop_->Cancel(sweep_timer_);
+    while (!hellos_.empty()) {
+      DropHello(hellos_.begin()->first);
+    }
+  });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ready_ = {};
+  sessions_.clear();
+  logger.Log("Resilient server stopped", Info);
+}
+
+void ResilientServer::AcceptLoop() noexcept {
+  LResilient logger(LResilient::FAccepter, this, logger_);
+  logger.Log("Starting accepter loop", Debug);
+
+  while (is_active_) {
+    std::shared_ptr<TcpClient> client;
+    try {
+      client = std::make_shared<TcpClient>(server_.AcceptConnection());
+    } catch (TcpException& exception) {
+      if (exception.GetType() == TcpException::NoData) {
+        continue;
+      }
+      logger.Log("Listener is closed. Stopping accepter loop", Info);
+      break;
+    }
+
+    try {
+      loop_->Post([this, client] { AwaitHello(client); });
+    } catch (std::exception& exception) {
+      logger.Log("Cannot wait for hello. Dropping connection", Warning);
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  is_accepting_ = false;
+  accept_cv_.notify_all();
+}
+
+void ResilientServer::HandshakeLoop() noexcept {
+  LResilient logger(LResilient::FAccepter, this, logger_);
+  logger.Log("Starting handshake loop", Debug);
+
+  while (true) {
+    std::shared_ptr<TcpClient> client;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_cv_.wait(lock, [this] { return !ready_.empty() || !is_active_; });
+      if (!is_active_) {
+        return;
+      }
+      client = std::move(ready_.front());
+      ready_.pop();
+    }
+    try {
+      Handshake(std::move(client), logger);
+    } catch (std::exception& exception) {
+      logger.Log("Handshake failed: " + std::string(exception.what()),
+                 Warning);
+    }
+  }
+}
+
+void ResilientServer::AwaitHello(std::shared_ptr<TcpClient> client) noexcept {
+  uint64_t id = ++next_hello_;
+  PendingHello& hello = hellos_[id];
+  hello.client = std::move(client);
+  try {
+    hello.deadline =
+        loop_->RunAfter(hello.client->GetMsPingThreshold(), [this, id] {
+          hellos_[id].deadline = 0;
+          LResilient(LResilient::FAccepter, this, logger_)
+              .Log("Peer did not send hello in time", Warning);
+          DropHello(id);
+        });
+    // shared memory has no descriptor to watch
+    if (hello.client->shm_channel_ == nullptr) {
+      loop_->Watch(hello.client->main_socket_, EPOLLIN | EPOLLET,
+                   [this, id](uint32_t events) { CheckHello(id); });
+    }
+  } catch (std::exception& exception) {
+    LResilient(LResilient::FAccepter, this, logger_)
+        .Log("Cannot wait for hello. Dropping connection", Warning);
+    DropHello(id);
+    return;
+  }
+  CheckHello(id);
+}
+
+void ResilientServer::CheckHello(uint64_t id) noexcept {
+  auto iter = hellos_.find(id);
+  if (iter == hellos_.end()) {
+    return;
+  }
+  PendingHello& hello = iter->second;
+  hello.poll_timer = 0;
+  if (!hello.client->IsMessageReady()) {
+    if (hello.client->shm_channel_ != nullptr) {
+      try {
+        hello.poll_timer = loop_->RunAfter(kHelloPollPeriod,
+                                           [this, id] { CheckHello(id); });
+      } catch (std::exception& exception) {
+        DropHello(id);
+      }
+    }
+    return;
+  }
+
+  auto client = std::move(hello.client);
+  DropHello(id);
+  std::lock_guard<std::mutex> lock(mutex_);
+  ready_.push(std::move(client));
+  ready_cv_.notify_one();
+}
+
+void ResilientServer::DropHello(uint64_t id) noexcept {
+  auto iter = hellos_.find(id);
+  if (iter == hellos_.end()) {
+    return;
+  }
+  PendingHello& hello = iter->second;
+  loop_->Cancel(hello.deadline);
+  loop_->Cancel(hello.poll_timer);
+  if (hello.client != nullptr && hello.client->shm_channel_ == nullptr) {
+    loop_->Unwatch(hello.client->main_socket_);
+  }
+  hellos_.erase(iter);
+}
+
+void ResilientServer::Handshake(std::shared_ptr<TcpClient> client,
+                                Logger& logger) {
+  // whole by now, so this does not wait
+  auto hello = client->RecvStr(0);
+  if (GetKind(hello) != kResilientHello) {
+    logger.Log("Peer did not open a session", Warning);
+    throw TcpException(TcpException::Receiving, logger_);
+  }
+  size_t position = GetKind(hello).size();
+  uint64_t session_id = NextNumber(hello, position);
+  uint64_t peer_received = NextNumber(hello, position);
+
+  std::shared_ptr<Session> session;
+  bool is_new = session_id == 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // random, so a peer cannot resume another client's session
+    while (is_new && (session_id == 0 || sessions_.contains(session_id))) {
+      if (!GetSecureRandom(session_id)) {
+        logger.Log("Cannot generate session id", Warning);
+        session_id = 0;
+        break;
+      }
+    }
+    if (is_new && session_id != 0) {
+      session = std::make_shared<Session>(session_id, options_, logger_);
+      sessions_[session_id] = session;
+    } else if (auto iter = sessions_.find(session_id);
+               iter != sessions_.end()) {
+      session = iter->second;
+    }
+  }
+
+  if (session == nullptr) {
+    logger.Log("Unknown session " + std::to_string(session_id), Warning);
+    client->Send(kResilientHello, 0, 0);
+    return;
+  }
+  client->Send(kResilientHello, session_id, session->GetReceived());
+  session->Attach(std::move(client), peer_received);
+
+  if (is_new) {
+    logger.Log("Session " + std::to_string(session_id) + " opened", Info);
+    std::lock_guard<std::mutex> lock(mutex_);
+    accepted_.push(std::move(session));
+    accept_cv_.notify_one();
+  } else {
+    logger.Log("Session " + std::to_string(session_id) + " resumed", Info);
+  }
+}
+
+void ResilientServer::Sweep() noexcept {
+  LResilient logger(LResilient::FSweeper, this, logger_);
+
+  std::vector<std::shared_ptr<Session>> expired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto iter = sessions_.begin(); iter != sessions_.end();) {
+      if (iter->second->IsExpired()) {
+        expired.push_back(std::move(iter->second));
+        iter = sessions_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+  if (!expired.empty() && logger.IsEnabled()) {
+    logger.Log("Dropped " + std::to_string(expired.size()) + " sessions",
+               Info);
+  }
+
+  try {
+    sweep_timer_ = loop_->RunAfter(
+        std::max(options_.ms_session_timeout / 4, 1), [this] { Sweep(); });
+  } catch (std::exception& exception) {
+    logger.Log("Cannot schedule session sweeper", Error);
+  }
+}
+
+}  // namespace TCP
@@ -0,0 +1,285 @@
+#include "tcp-rpc.hpp"
+
+#include <utility>
+
+namespace TCP {
+
+namespace {
+
+std::string NextToken(const std::string& message, size_t& position) {
+  if (position >= message.size()) {
+    return "";
+  }
+  auto delimiter = message.find(' ', position);
+  if (delimiter == std::string::npos) {
+    delimiter = message.size();
+  }
+  std::string token = message.substr(position, delimiter - position);
+  position = delimiter + 1;
+  return token;
+}
+
+std::string Rest(const std::string& message, size_t position) {
+  if (position >= message.size()) {
+    return "";
+  }
+  return message.substr(position);
+}
+
+}  // namespace
+
+RpcResponse::RpcResponse(Status status, std::string body, logging_foo f_logger)
+    : status_(status), body_(std::move(body)), logger_(f_logger) {}
+
+RpcResponse::Status RpcResponse::GetStatus() const noexcept { return status_; }
+bool RpcResponse::IsOk() const noexcept { return status_ == Ok; }
+const std::string& RpcResponse::GetBody() const noexcept { return body_; }
+
+void RpcResponse::CheckStatus() const {
+  switch (status_) {
+    case Ok:
+      return;
+    case Failure:
+      throw TcpException(TcpException::Remote, logger_);
+    case Expired:
+      throw TcpException(TcpException::Timeout, logger_);
+    case Disconnected:
+      throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
+}
+
+RpcClient::RpcClient(TcpClient& client, logging_foo f_logger)
+    : client_(client), loop_(&EventLoop::GetDefault()), logger_(f_logger) {
+  LRpc logger(LRpc::FConstructor, this, logger_);
+
+  logger.Log("Creating receiver thread", Debug);
+  receive_thread_ = std::thread(&RpcClient::ReceiveLoop, this);
+  logger.Log("RPC client created", Info);
+}
+RpcClient::~RpcClient() {
+  Stop();
+
+  LRpc(LRpc::FDestructor, this, logger_).Log("RPC client destructed", Info);
+}
+
+size_t RpcClient::GetInFlight() {
+  std::lock_guard<std::mutex> lock(pending_mutex_);
+  return pending_.size();
+}
+
+void RpcClient::Stop() noexcept {
+  if (!is_active_.exchange(false)) {
+    return;
+  }
+  if (receive_thread_.joinable() &&
+      receive_thread_.get_id() != std::this_thread::get_id()) {
+    receive_thread_.join();
+  } else if (receive_thread_.joinable()) {
+    receive_thread_.detach();
+  }
+  FailAll(RpcResponse::Disconnected);
+  // waits out an expiry callback that may already be running
+  loop_->RunSync([] {});
+}
+
+void RpcClient::Request(int ms_timeout, RpcCallback callback,
+                        const std::string& method, const std::string& body) {
+  LRpc logger(LRpc::FCall, this, logger_);
+
+  if (!is_active_) {
+    logger.Log("RPC client is stopped", Warning);
+    throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
+
+  uint64_t id;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    id = next_id_++;
+    auto deadline = loop_->RunAfter(ms_timeout, [this, id] { Expire(id); });
+    pending_.insert({id, {std::move(callback), deadline}});
+  }
+
+  std::string message = std::string(kRpcRequest) + " " + std::to_string(id) +
+                        " " + method;
+  if (!body.empty()) {
+    message += " " + body;
+  }
+
+  logger.Log("Sending request " + std::to_string(id), Debug);
+  try {
+    client_.Send(message);
+  } catch (...) {
+    logger.Log("Error occurred while sending request", Warning);
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    auto iter = pending_.find(id);
+    if (iter != pending_.end()) {
+      loop_->Cancel(iter->second.deadline);
+      pending_.erase(iter);
+    }
+    throw;
+  }
+}
+
+void RpcClient::ReceiveLoop() noexcept {
+  LRpc logger(LRpc::FReceiveLoop, this, logger_);
+  logger.Log("Starting receiver loop", Debug);
+
+  while (is_active_) {
+    std::string message;
+    try {
+      message = client_.RecvStr(client_.loop_period_);
+    } catch (TcpException& exception) {
+      logger.Log("Exception caught: " + std::string(exception.what()),
+                 Warning);
+      FailAll(RpcResponse::Disconnected);
+      return;
+    }
+
+    if (!message.empty()) {
+      size_t position = 0;
+      auto kind = NextToken(message, position);
+      auto id_str = NextToken(message, position);
+      uint64_t id = strtoull(id_str.c_str(), nullptr, 10);
+
+      RpcCallback callback;
+      {
+        std::lock_guard<std::mutex> lock(pending_mutex_);
+        auto iter = pending_.find(id);
+        if (iter != pending_.end()) {
+          loop_->Cancel(iter->second.deadline);
+          callback = std::move(iter->second.callback);
+          pending_.erase(iter);
+        }
+      }
+
+      if (!callback) {
+        logger.Log("Got message without pending request: " + id_str,
+                   Warning);
+      } else if (kind == kRpcResponse) {
+        logger.Log("Got response " + id_str, Debug);
+        callback(RpcResponse(RpcResponse::Ok, Rest(message, position),
+                             logger_));
+      } else {
+        logger.Log("Got failure " + id_str, Debug);
+        callback(RpcResponse(RpcResponse::Failure, Rest(message, position),
+                             logger_));
+      }
+    }
+  }
+}
+
+void RpcClient::Expire(uint64_t id) noexcept {
+  RpcCallback callback;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    auto iter = pending_.find(id);
+    if (iter == pending_.end()) {
+      return;
+    }
+    callback = std::move(iter->second.callback);
+    pending_.erase(iter);
+  }
+  LRpc(LRpc::FReceiveLoop, this, logger_)
+      .Log("Request " + std::to_string(id) + " expired", Debug);
+  callback(RpcResponse(RpcResponse::Expired, "", logger_));
+}
+
+void RpcClient::FailAll(RpcResponse::Status status) noexcept {
+  std::map<uint64_t, Pending> failed;
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    failed.swap(pending_);
+  }
+  for (auto& [id, pending] : failed) {
+    loop_->Cancel(pending.deadline);
+  }
+  for (auto& [id, pending] : failed) {
+    pending.callback(RpcResponse(status, "", logger_));
+  }
+}
+
+RpcRequest::RpcRequest(RpcServer* server, TcpClient* client, uint64_t id,
+                       std::string method, std::string body)
+    : server_(server),
+      client_(client),
+      id_(id),
+      method_(std::move(method)),
+      body_(std::move(body)) {}
+
+const std::string& RpcRequest::GetMethod() const noexcept { return method_; }
+const std::string& RpcRequest::GetBody() const noexcept { return body_; }
+
+void RpcRequest::Fail(const std::string& reason) {
+  Respond(kRpcFailure, reason);
+}
+
+void RpcRequest::Respond(const char* kind, const std::string& body) {
+  server_->Respond(*client_, kind, id_, body);
+}
+
+RpcServer::RpcServer(logging_foo f_logger) : logger_(f_logger) {}
+
+void RpcServer::Register(const std::string& method, RpcHandler handler) {
+  std::lock_guard<std::mutex> lock(handlers_mutex_);
+  handlers_[method] = std::move(handler);
+}
+
+bool RpcServer::Serve(TcpClient& client, int ms_timeout) {
+  LRpc logger(LRpc::FDispatch, this, logger_);
+
+  auto message = client.RecvStr(ms_timeout);
+  if (message.empty()) {
+    return false;
+  }
+
+  size_t position = 0;
+  auto kind = NextToken(message, position);
+  auto id_str = NextToken(message, position);
+  auto method = NextToken(message, position);
+  if (kind != kRpcRequest || id_str.empty()) {
+    logger.Log("Got message which is not a request", Warning);
+    return true;
+  }
+
+  RpcRequest request(this, &client, strtoull(id_str.c_str(), nullptr, 10),
+                     method, Rest(message, position));
+
+  RpcHandler handler;
+  {
+    std::lock_guard<std::mutex> lock(handlers_mutex_);
+    auto iter = handlers_.find(method);
+    if (iter != handlers_.end()) {
+      handler = iter->second;
+    }
+  }
+  if (!handler) {
+    logger.Log("Unknown method " + method, Warning);
+    request.Fail("unknown method " + method);
+    return true;
+  }
+
+  logger.Log("Dispatching request " + id_str + " to " + method, Debug);
+  try {
+    handler(request);
+  } catch (TcpException& exception) {
+    throw;
+  } catch (std::exception& exception) {
+    logger.Log("Handler failed: " + std::string(exception.what()), Warning);
+    request.Fail(exception.what());
+  }
+  return true;
+}
+
+void RpcServer::Respond(TcpClient& client, const char* kind, uint64_t id,
+                        const std::string& body) {
+  LRpc logger(LRpc::FReply, this, logger_);
+
+  std::string message = std::string(kind) + " " + std::to_string(id);
+  if (!body.empty()) {
+    message += " " + body;
+  }
+  logger.Log("Sending response " + std::to_string(id), Debug);
+  client.Send(message);
+}
+
+}  // namespace TCP
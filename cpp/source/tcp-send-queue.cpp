@@ -0,0 +1,53 @@
+#include "tcp-send-queue.hpp"
+
+#include <thread>
+
+namespace TCP {
+
+void SendRequest::Complete(bool is_sent, int send_error) noexcept {
+  error = send_error;
+  // the owner may return once kWaking is cleared, so clearing it is the
+  // last access to the request
+  state.store((is_sent ? Done : Failed) | kWaking);
+  state.notify_one();
+  state.fetch_and(~kWaking);
+}
+
+SendRequest::State SendRequest::AwaitResult() const noexcept {
+  int value = state.load();
+  while ((value & kWaking) != 0) {
+    std::this_thread::yield();
+    value = state.load();
+  }
+  return static_cast<State>(value);
+}
+
+void SendQueue::Push(SendRequest* request) noexcept {
+  SendRequest* head = head_.load();
+  do {
+    request->next = head;
+  } while (!head_.compare_exchange_weak(head, request));
+}
+
+SendRequest* SendQueue::TakeAll() noexcept {
+  SendRequest* head = head_.exchange(nullptr);
+  SendRequest* reversed = nullptr;
+  while (head != nullptr) {
+    SendRequest* next = head->next;
+    head->next = reversed;
+    reversed = head;
+    head = next;
+  }
+  return reversed;
+}
+
+bool SendQueue::TryLock() noexcept {
+  return !is_locked_.load() && !is_locked_.exchange(true);
+}
+
+bool SendQueue::Unlock() noexcept {
+  is_locked_.store(false);
+  return head_.load() != nullptr;
+}
+
+}  // namespace TCP
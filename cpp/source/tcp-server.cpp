@@ -2,11 +2,17 @@
 
 #include <errno.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <list>
+#include <sstream>
 #include <string>
 
 #include "tcp-supply.hpp"
@@ -15,17 +21,27 @@ namespace TCP {
 
 TcpServer::TcpServer(int port, int ms_ping_threshold, int ms_loop_period,
                      logging_foo f_logger)
+    : TcpServer(port, ms_ping_threshold, ms_loop_period, kDefSocketOptions,
+                f_logger) {}
+TcpServer::TcpServer(int port, int ms_ping_threshold, int ms_loop_period,
+                     const SocketOptions& options, logging_foo f_logger)
     : port_(port),
       ping_threshold_(ms_ping_threshold),
       loop_period_(ms_loop_period),
+      options_(options),
+      accept_queues_(options.reactors != nullptr ? options.reactors->GetSize()
+                                                 : 1),
+      loop_(&EventLoop::GetDefault()),
+      uncomplete_client_(options.max_half_open),
+      accept_bucket_(options.accept_rate, options.accept_burst),
       logger_(f_logger) {
   LServer logger(LServer::FConstructor, this, logger_);
 
   logger.Log("Trying to connect listener", Debug);
   ConnectListener();
 
-  logger.Log("Creating accepter thread", Debug);
-  accept_thread_ = std::thread(&TcpServer::AcceptLoop, this);
+  logger.Log("Registering listener in event loop", Debug);
+  StartAccepting();
   logger.Log(
       "Server on port " + std::to_string(port) + " successfully launcher",
       Info);
@@ -35,11 +51,93 @@ TcpServer::TcpServer(int port, int ms_ping_threshold, TCP::logging_foo f_logger)
     : TcpServer(port, ms_ping_threshold, kDefLoopPeriod, f_logger) {}
 TcpServer::TcpServer(int port, TCP::logging_foo f_logger)
     : TcpServer(port, kDefPingThreshold, kDefLoopPeriod, f_logger) {}
+TcpServer::TcpServer(int port, const SocketOptions& options,
+                     logging_foo f_logger)
+    : TcpServer(port, kDefPingThreshold, kDefLoopPeriod, options, f_logger) {}
+
+TcpServer::TcpServer(const std::string& unix_path, int ms_ping_threshold,
+                     int ms_loop_period, const SocketOptions& options,
+                     logging_foo f_logger)
+    : port_(-1),
+      unix_path_(unix_path),
+      ping_threshold_(ms_ping_threshold),
+      loop_period_(ms_loop_period),
+      options_(options),
+      accept_queues_(options.reactors != nullptr ? options.reactors->GetSize()
+                                                 : 1),
+      loop_(&EventLoop::GetDefault()),
+      uncomplete_client_(options.max_half_open),
+      accept_bucket_(options.accept_rate, options.accept_burst),
+      logger_(f_logger) {
+  LServer logger(LServer::FConstructor, this, logger_);
+
+  logger.Log("Trying to connect listener", Debug);
+  ConnectListener();
+
+  logger.Log("Registering listener in event loop", Debug);
+  StartAccepting();
+  logger.Log("Server on " + unix_path_ + " successfully launcher", Info);
+}
+TcpServer::TcpServer(const std::string& unix_path, int ms_ping_threshold,
+                     int ms_loop_period, logging_foo f_logger)
+    : TcpServer(unix_path, ms_ping_threshold, ms_loop_period,
+                kDefSocketOptions, f_logger) {}
+TcpServer::TcpServer(const std::string& unix_path, logging_foo f_logger)
+    : TcpServer(unix_path, kDefPingThreshold, kDefLoopPeriod, f_logger) {}
+
+TcpServer::TcpServer(const Handoff& handoff, const SocketOptions& options,
+                     logging_foo f_logger)
+    : port_(-1),
+      ping_threshold_(kDefPingThreshold),
+      loop_period_(kDefLoopPeriod),
+      options_(options),
+      accept_queues_(options.reactors != nullptr ? options.reactors->GetSize()
+                                                 : 1),
+      loop_(&EventLoop::GetDefault()),
+      uncomplete_client_(options.max_half_open),
+      accept_bucket_(options.accept_rate, options.accept_burst),
+      logger_(f_logger) {
+  LServer logger(LServer::FHandOff, this, logger_);
+
+  logger.Log("Waiting for handoff on " + handoff.path, Debug);
+  int channel = AwaitHandoff(handoff, logger);
+  listener_ = -1;
+  std::vector<InheritedConnection> connections;
+  std::vector<InheritedHandshake> handshakes;
+  try {
+    ReceiveHandoff(channel, handoff.ms_timeout, connections, handshakes,
+                   logger);
+    if (RawSend(channel, "1", 1) != 1) {
+      logger.Log("Cannot confirm handoff", Error);
+      throw TcpException(TcpException::Sending, logger_, errno);
+    }
+  } catch (...) {
+    close(channel);
+    if (listener_ >= 0) {
+      close(listener_);
+    }
+    for (auto& connection : connections) {
+      close(connection.heartbeat_socket);
+      close(connection.main_socket);
+    }
+    for (auto& handshake : handshakes) {
+      close(handshake.socket);
+    }
+    throw;
+  }
+  close(channel);
+
+  AdoptHandoff(connections, handshakes, logger);
+  logger.Log("Server taken over with " + std::to_string(pending_.load()) +
+                 " connections",
+             Info);
+}
 
 TcpServer::~TcpServer() {
   LServer logger(LServer::FDestructor, this, logger_);
 
   CloseListener();
+  StopWorkers();
 
   logger.Log("Server destructed", Info);
 }
@@ -47,167 +145,1057 @@ TcpServer::~TcpServer() {
 TcpClient TcpServer::AcceptConnection() {
   LServer logger(LServer::FAccepter, this, logger_);
 
-  logger.Log("Waiting for data is available", Debug);
-  accepter_semaphore_.acquire();
-  logger.Log("Get data availability flag. Checking if active", Debug);
+  while (true) {
+    logger.Log("Waiting for data is available", Debug);
+    {
+      std::unique_lock<std::mutex> lock(any_mutex_);
+      any_cv_.wait(lock, [this] { return pending_ > 0 || !is_active_; });
+    }
+    logger.Log("Get data availability flag. Extracting client", Debug);
 
-  if (!is_active_) {
-    logger.Log("Server is not active", Info);
-    accepter_semaphore_.release();
-    throw TcpException(TcpException::ConnectionBreak, logger_);
+    // clients accepted before the listener closed are still handed out
+    size_t start = next_queue_.fetch_add(1, std::memory_order_relaxed);
+    for (size_t i = 0; i < accept_queues_.size(); ++i) {
+      auto client =
+          TakeAccepted(accept_queues_[(start + i) % accept_queues_.size()]);
+      if (client.has_value()) {
+        logger.Log("Returning client", Debug);
+        return std::move(client.value());
+      }
+    }
+    if (!is_active_) {
+      logger.Log("Server is not active", Info);
+      throw TcpException(TcpException::ConnectionBreak, logger_);
+    }
+    // another accepter took the client first
+    logger.Log("Data is not available. Waiting again", Debug);
   }
+}
+TcpClient TcpServer::AcceptConnection(size_t reactor) {
+  LServer logger(LServer::FAccepter, this, logger_);
 
-  logger.Log("Active. Locking mutex", Debug);
-  accept_mutex_.lock();
-  logger.Log("Mutex locked", Debug);
+  AcceptQueue& queue = accept_queues_.at(reactor);
+  logger.Log("Waiting for data is available on reactor " +
+                 std::to_string(reactor),
+             Debug);
+  std::unique_lock<std::mutex> lock(queue.mutex);
+  queue.accept_cv.wait(
+      lock, [this, &queue] { return !queue.accepted.empty() || !is_active_; });
 
-  if (accepted_.empty()) {
-    logger.Log("Data is not available", Warning);
-    accept_mutex_.unlock();
-    throw TcpException(TcpException::NoData, logger_);
+  if (queue.accepted.empty()) {
+    logger.Log("Server is not active", Info);
+    throw TcpException(TcpException::ConnectionBreak, logger_);
   }
 
   logger.Log("Extracting client", Debug);
-  TcpClient client = std::move(accepted_.front());
-  accepted_.pop();
-
-  logger.Log("Unlocking mutex", Debug);
-  accept_mutex_.unlock();
+  TcpClient client = std::move(queue.accepted.front());
+  queue.accepted.pop();
+  --pending_;
+  return client;
+}
 
-  logger.Log("Returning client", Debug);
+std::optional<TcpClient> TcpServer::TakeAccepted(AcceptQueue& queue) {
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.accepted.empty()) {
+    return {};
+  }
+  std::optional<TcpClient> client = std::move(queue.accepted.front());
+  queue.accepted.pop();
+  --pending_;
   return client;
 }
 
-void TcpServer::CloseListener() noexcept {
+void TcpServer::PushAccepted(TcpClient tcp_client) {
+  live_counter_->fetch_add(1);
+  tcp_client.live_counter_ = live_counter_;
+  QueueAccepted(std::move(tcp_client));
+}
+void TcpServer::QueueAccepted(TcpClient tcp_client) {
+  AcceptQueue& queue = accept_queues_[tcp_client.reactor_];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.accepted.emplace(std::move(tcp_client));
+    ++pending_;
+  }
+  queue.accept_cv.notify_one();
+  std::lock_guard<std::mutex> lock(any_mutex_);
+  any_cv_.notify_one();
+}
+
+void TcpServer::ReleaseAccepters() noexcept {
+  for (auto& queue : accept_queues_) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.accept_cv.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(any_mutex_);
+  any_cv_.notify_all();
+}
+
+void TcpServer::CloseListener() noexcept { StopListening(true); }
+void TcpServer::StopListening(bool is_unlinking) noexcept {
   LServer logger(LServer::FCloseListener, this, logger_);
 
   if (is_active_) {
     is_active_ = false;
+    logger.Log("Removing listener and pending handshakes from event loop",
+               Debug);
+    loop_->RunSync([this] {
+      loop_->Unwatch(listener_);
+      loop_->Cancel(resume_timer_);
+      loop_->Cancel(expiry_timer_);
+      while (!handshakes_.empty()) {
+        DropHandshake(handshakes_.begin()->first, true);
+      }
+      for (int socket : uncomplete_client_.Clear()) {
+        close(socket);
+      }
+    });
     close(listener_);
-    logger.Log("Listener closed", Debug);
+    if (!unix_path_.empty() && is_unlinking) {
+      unlink(unix_path_.c_str());
+    }
     listener_ = 0;
-    logger.Log("Waiting for accepter joining", Debug);
-    accept_thread_.join();
-    logger.Log("Listener closed. Accepter joined", Info);
+    logger.Log("Listener closed. Pending handshakes dropped", Info);
 
     logger.Log("Releasing accepter waiters", Debug);
-    accepter_semaphore_.release();
+    ReleaseAccepters();
   } else {
     logger.Log("Listener is already closed", Info);
   }
 }
 bool TcpServer::IsListenerOpen() const noexcept { return is_active_; }
 
-void TcpServer::AcceptLoop() noexcept {
-  LServer logger(LServer::FLoopAccepter, this, logger_);
-  logger.Log("Starting accepter loop", Debug);
+size_t TcpServer::HandOff(const Handoff& handoff,
+                          const std::vector<TcpClient*>& clients) {
+  LServer logger(LServer::FHandOff, this, logger_);
+  if (!is_active_) {
+    logger.Log("Listener is closed", Warning);
+    throw TcpException(TcpException::ConnectionBreak, logger_);
+  }
 
-  int64_t password = 1;
-  while (is_active_) {
+  logger.Log("Connecting to " + handoff.path, Debug);
+  sockaddr_storage addr;
+  auto length = MakeAddress((kUnixPrefix + handoff.path).c_str(), 0, addr);
+  if (!length.has_value()) {
+    logger.Log("Cannot use " + handoff.path + " as socket path", Error);
+    throw TcpException(TcpException::Connection, logger_);
+  }
+  int channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (channel < 0 || connect(channel, (sockaddr*)&addr, length.value()) < 0) {
+    int error = errno;
+    if (channel >= 0) {
+      close(channel);
+    }
+    logger.Log("Cannot reach new process", Error);
+    throw TcpException(TcpException::Connection, logger_, error);
+  }
+  if (!IsSameUser(channel)) {
+    close(channel);
+    logger.Log("New process runs as another user", Error);
+    throw TcpException(TcpException::Connection, logger_, EACCES);
+  }
+
+  logger.Log("Pausing listener and handshakes", Debug);
+  std::vector<InheritedHandshake> handshakes;
+  loop_->RunSync([this, &handshakes] {
+    PauseAccepting();
+    for (auto& [client, handshake] : handshakes_) {
+      handshakes.push_back(
+          {client, 0, std::string(handshake.message, handshake.size)});
+    }
+    for (auto [password, client] : uncomplete_client_.GetEntries()) {
+      handshakes.push_back({client, password, ""});
+    }
+  });
+
+  std::vector<TcpClient> queued;
+  for (auto& queue : accept_queues_) {
+    for (auto client = TakeAccepted(queue); client.has_value();
+         client = TakeAccepted(queue)) {
+      queued.push_back(std::move(client.value()));
+    }
+  }
+  std::vector<TcpClient*> moving;
+  for (TcpClient* client : clients) {
+    moving.push_back(client);
+  }
+  for (auto& client : queued) {
+    moving.push_back(&client);
+  }
+  std::erase_if(moving, [](TcpClient* client) {
+    return !client->is_active_ || client->shm_channel_ != nullptr;
+  });
+  for (TcpClient* client : moving) {
+    client->heartbeat_->Stop();
+  }
+
+  bool is_done = SendHandoff(channel, handshakes, moving, logger);
+  char answ = 0;
+  if (is_done) {
+    pollfd poll_fd = {.fd = channel, .events = POLLIN};
+    is_done = poll(&poll_fd, 1, handoff.ms_timeout) > 0 &&
+              recv(channel, &answ, 1, 0) == 1 && answ == '1';
+  }
+  close(channel);
+
+  if (!is_done) {
+    logger.Log("New process did not confirm handoff. Resuming", Error);
+    for (TcpClient* client : moving) {
+      EventLoop& loop = client->options_.reactors != nullptr
+                            ? client->options_.reactors->Get(client->reactor_)
+                            : EventLoop::GetDefault();
+      try {
+        client->heartbeat_->Start(loop);
+      } catch (std::exception& exception) {
+        logger.Log("Cannot restart heartbeat. Stopping client", Warning);
+        client->StopClient();
+      }
+    }
+    for (auto& client : queued) {
+      QueueAccepted(std::move(client));
+    }
     try {
-      logger.Log("Starting waiting for acceptance", Debug);
-      if (!WaitForData(listener_, loop_period_, logger, logger_).has_value()) {
-        logger.Log("Acceptance timeout", Debug);
-        continue;
+      loop_->RunSync([this] { ResumeAccepting(); });
+    } catch (std::exception& exception) {
+      logger.Log("Cannot resume listener. Closing it", Error);
+      CloseListener();
+    }
+    throw TcpException(TcpException::Timeout, logger_);
+  }
+
+  for (TcpClient* client : moving) {
+    client->Stop(false);
+  }
+
+  size_t staying = 0;
+  for (auto& client : queued) {
+    if (client.is_active_ && client.shm_channel_ != nullptr) {
+      QueueAccepted(std::move(client));
+      ++staying;
+    }
+  }
+  if (staying != 0) {
+    logger.Log(std::to_string(staying) +
+                   " shared memory connections stay in AcceptConnection",
+               Warning);
+  }
+  StopListening(false);
+  logger.Log("Handed off " + std::to_string(moving.size()) + " connections",
+             Info);
+  return moving.size();
+}
+
+bool TcpServer::SendHandoff(int channel,
+                            const std::vector<InheritedHandshake>& handshakes,
+                            const std::vector<TcpClient*>& moving,
+                            Logger& logger) {
+  logger.Log("Sending listener", Debug);
+  std::string record = "l " + std::to_string(port_) + " " +
+                       std::to_string(ping_threshold_) + " " +
+                       std::to_string(loop_period_) + " " + unix_path_;
+  if (!SendRecord(channel, record.data(), record.size(), &listener_, 1)) {
+    logger.Log("Cannot send listener", Error);
+    TcpException(TcpException::Sending, logger_, errno);
+    return false;
+  }
+
+  logger.Log("Sending handshakes", Debug);
+  for (const auto& handshake : handshakes) {
+    record = "h " + std::to_string(handshake.password) + " " +
+             std::to_string(handshake.partial.size()) + " " +
+             handshake.partial;
+    if (!SendRecord(channel, record.data(), record.size(), &handshake.socket,
+                    1)) {
+      logger.Log("Cannot send handshake", Error);
+      TcpException(TcpException::Sending, logger_, errno);
+      return false;
+    }
+  }
+
+  logger.Log("Sending connections", Debug);
+  for (TcpClient* client : moving) {
+    std::string partial = client->heartbeat_->GetPartial();
+    record = "c " + std::to_string(client->ping_threshold_) + " " +
+             std::to_string(client->loop_period_) + " " +
+             std::to_string(client->flags_) + " " +
+             std::to_string(partial.size()) + " " + partial;
+    int fds[2] = {client->heartbeat_socket_, client->main_socket_};
+    if (!SendRecord(channel, record.data(), record.size(), fds, 2)) {
+      logger.Log("Cannot send connection", Error);
+      TcpException(TcpException::Sending, logger_, errno);
+      return false;
+    }
+  }
+
+  record = "e";
+  return SendRecord(channel, record.data(), record.size(), nullptr, 0);
+}
+
+int TcpServer::GetConnectionCount() const noexcept {
+  return live_counter_->load();
+}
+uint64_t TcpServer::GetRejectedCount() const noexcept {
+  return rejected_.load();
+}
+
+HandshakeTable::Stats TcpServer::GetHandshakeStats() {
+  HandshakeTable::Stats stats;
+  loop_->RunSync([this, &stats] { stats = uncomplete_client_.GetStats(); });
+  return stats;
+}
+
+BroadcastResult TcpServer::BroadcastFrame(
+    const std::vector<TcpClient*>& clients, const Buffer& frame,
+    BroadcastPolicy policy) {
+  LServer logger(LServer::FBroadcast, this, logger_);
+  if (logger.IsEnabled()) {
+    logger.Log("Broadcasting " + std::to_string(frame.Size()) + " bytes to " +
+                   std::to_string(clients.size()) + " clients",
+               Debug);
+  }
+  StartWorkers();
+
+  std::atomic<size_t> sent = 0;
+  std::atomic<size_t> skipped = 0;
+  std::atomic<size_t> failed = 0;
+  std::atomic<size_t> queued = 0;
+
+  RunParallel(clients.size(), [&](size_t index) {
+    TcpClient* client = clients[index];
+    if (!client->IsConnected()) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    bool is_lagging = false;
+    if (auto backlog = client->backlog_.load(); backlog != nullptr) {
+      std::lock_guard<std::mutex> lock(backlog->mutex);
+      is_lagging = !backlog->frames.empty();
+    }
+    if (!is_lagging && client->HasSendRoom(frame.Size())) {
+      try {
+        client->SendFrame(frame);
+        sent.fetch_add(1, std::memory_order_relaxed);
+      } catch (TcpException& exception) {
+        failed.fetch_add(1, std::memory_order_relaxed);
       }
-      logger.Log("Client is waiting for accept. Accepting", Debug);
-      int client = accept(listener_, NULL, NULL);
+    } else if (policy == QueueSlow && QueueFrame(client, frame)) {
+      queued.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      skipped.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
 
-      if (!is_active_) {
-        logger.Log("Got terminating flag. Closing connection. Terminating",
-                   Debug);
-        close(client);
-        return;
+  BroadcastResult result = {sent.load(), skipped.load(), failed.load(),
+                            queued.load()};
+  if (logger.IsEnabled()) {
+    logger.Log("Sent " + std::to_string(result.sent) + ", queued " +
+                   std::to_string(result.queued) + ", skipped " +
+                   std::to_string(result.skipped) + ", failed " +
+                   std::to_string(result.failed),
+               Info);
+  }
+  return result;
+}
+
+bool TcpServer::QueueFrame(TcpClient* client, const Buffer& frame) noexcept {
+  try {
+    auto backlog = client->backlog_.load();
+    if (backlog == nullptr) {
+      auto created = std::make_shared<TcpClient::Backlog>();
+      created->client = client;
+      if (client->backlog_.compare_exchange_strong(backlog, created)) {
+        backlog = std::move(created);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(backlog->mutex);
+      if (backlog->client == nullptr ||
+          backlog->frames.size() >= kMaxBacklog) {
+        return false;
       }
-      if (client < 0) {
-        logger.Log("Error occurred while accepting connection", Warning);
-        TcpException(TcpException::Acceptance, logger_, errno);
-        continue;
+      backlog->frames.push_back(frame);
+      if (backlog->is_scheduled) {
+        return true;
       }
-      logger.Log("Connection accepted", Debug);
+      backlog->is_scheduled = true;
+    }
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    ready_.push_back(std::move(backlog));
+    workers_cv_.notify_one();
+    return true;
+  } catch (std::exception& exception) {
+    return false;
+  }
+}
 
-      logger.Log("Waiting for client to send password", Debug);
+void TcpServer::Drain(BacklogPtr backlog) noexcept {
+  bool is_full = false;
+  {
+    std::lock_guard<std::mutex> lock(backlog->mutex);
+    for (size_t i = 0; i < kBroadcastBatch && !is_full; ++i) {
+      TcpClient* client = backlog->client;
+      if (client == nullptr || backlog->frames.empty()) {
+        backlog->is_scheduled = false;
+        return;
+      }
+      is_full = !client->HasSendRoom(backlog->frames.front().Size());
+      if (is_full) {
+        break;
+      }
       try {
-        if (!WaitForData(client, ping_threshold_, logger, logger_)
-                 .has_value()) {
-          logger.Log("Waiting timeout. Sending term signal", Warning);
-          RawSend(client, "0", kULLMaxDigits + 1);
-          continue;
-        }
-      } catch (...) {
-        close(client);
-        continue;
-      }
-      logger.Log("Client config is available. Trying to receive", Debug);
-      auto mode_str = RawRecv(client, kULLMaxDigits + 1);
-      if (mode_str.empty()) {
-        logger.Log("Error occurred while receiving config. Sending term signal",
-                   Warning);
-        TcpException(TcpException::Receiving, logger_, errno);
-        RawSend(client, "0", kULLMaxDigits + 1);
-        close(client);
-        continue;
+        client->SendFrame(backlog->frames.front());
+      } catch (TcpException& exception) {
+        backlog->frames.clear();
+        backlog->is_scheduled = false;
+        return;
       }
+      backlog->frames.pop_front();
+    }
+  }
 
-      int64_t client_password = std::stoll(mode_str);
-      logger.Log("Got client config", Debug);
+  std::lock_guard<std::mutex> lock(workers_mutex_);
+  if (is_full) {
+    delayed_.emplace_back(
+        Clock::now() + std::chrono::milliseconds(kBacklogRetry),
+        std::move(backlog));
+  } else {
+    ready_.push_back(std::move(backlog));
+  }
+  workers_cv_.notify_one();
+}
 
-      if (client_password == 0) {
-        logger.Log("Client is in init mode. Sending password", Debug);
-        if (RawSend(client, std::to_string(password), kULLMaxDigits + 1) ==
-            kULLMaxDigits + 1) {
-          logger.Log("Password sent successfully", Debug);
-          uncomplete_client_.erase(password);
-          uncomplete_client_.insert({password, client});
-        } else {
-          logger.Log(
-              "Error occurred while sending password. Closing connection",
-              Warning);
-          close(client);
+void TcpServer::RunParallel(size_t count,
+                            const std::function<void(size_t)>& task) {
+  // helpers that start after the caller claimed the last batch leave task
+  // untouched, so the caller only waits for those that got work
+  struct Job {
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    std::atomic<size_t> next = 0;
+    size_t count = 0;
+    size_t active = 0;
+  };
+  auto job = std::make_shared<Job>();
+  job->count = count;
+  auto work = [job, &task] {
+    size_t begin;
+    while ((begin = job->next.fetch_add(kBroadcastBatch)) < job->count) {
+      size_t end = std::min(begin + kBroadcastBatch, job->count);
+      for (size_t i = begin; i < end; ++i) {
+        task(i);
+      }
+    }
+  };
+
+  size_t thread_count =
+      (count + kMinBroadcastPerThread - 1) / kMinBroadcastPerThread;
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    thread_count = std::min(thread_count, workers_.size() + 1);
+    for (size_t i = 1; i < thread_count; ++i) {
+      jobs_.push_back([job, work] {
+        {
+          std::lock_guard<std::mutex> lock(job->mutex);
+          if (job->next.load() >= job->count) {
+            return;
+          }
+          ++job->active;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(job->mutex);
+        --job->active;
+        job->done_cv.notify_all();
+      });
+    }
+  }
+  workers_cv_.notify_all();
+  work();
+
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->done_cv.wait(lock, [&job] { return job->active == 0; });
+}
+
+void TcpServer::StartWorkers() {
+  std::lock_guard<std::mutex> lock(workers_mutex_);
+  if (!workers_.empty()) {
+    return;
+  }
+  // the broadcasting thread works too
+  size_t count = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+  for (size_t i = 0; i < count; ++i) {
+    workers_.emplace_back(&TcpServer::WorkLoop, this);
+  }
+}
+
+void TcpServer::StopWorkers() noexcept {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    is_working_ = false;
+  }
+  workers_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+
+  // clients outlive the server; what they still owe it is dropped
+  for (auto& [time, backlog] : delayed_) {
+    ready_.push_back(std::move(backlog));
+  }
+  for (auto& backlog : ready_) {
+    std::lock_guard<std::mutex> lock(backlog->mutex);
+    backlog->frames.clear();
+    backlog->is_scheduled = false;
+  }
+  ready_.clear();
+  delayed_.clear();
+}
+
+void TcpServer::WorkLoop() noexcept {
+  while (true) {
+    std::function<void()> job;
+    BacklogPtr backlog;
+    {
+      std::unique_lock<std::mutex> lock(workers_mutex_);
+      while (true) {
+        if (!is_working_) {
+          return;
+        }
+        auto now = Clock::now();
+        while (!delayed_.empty() && delayed_.front().first <= now) {
+          ready_.push_back(std::move(delayed_.front().second));
+          delayed_.pop_front();
         }
-      } else if (uncomplete_client_.contains(client_password)) {
-        logger.Log("Client sent password. Tmp table contains connected peer",
-                   Debug);
-        int client_recv = uncomplete_client_[client_password];
-        uncomplete_client_.erase(client_password);
-        if (RawSend(client, "1", 1) == 1) {
-          logger.Log("Sent run signal. Locking mutex", Debug);
-          accept_mutex_.lock();
-          logger.Log("Mutex locked. Creating TcpClient", Debug);
-          accepted_.emplace(TcpClient(client_recv, client, ping_threshold_,
-                                      loop_period_, logger_));
-          accept_mutex_.unlock();
-          accepter_semaphore_.release();
-          logger.Log("Mutex unlocked", Debug);
+        if (!jobs_.empty() || !ready_.empty()) {
+          break;
+        }
+        if (delayed_.empty()) {
+          workers_cv_.wait(lock);
         } else {
-          logger.Log(
-              "Error occurred while sending run signal. Closing connections",
-              Warning);
-          close(client);
-          close(client_recv);
+          workers_cv_.wait_until(lock, delayed_.front().first);
         }
+      }
+      if (!jobs_.empty()) {
+        job = std::move(jobs_.front());
+        jobs_.pop_front();
       } else {
-        logger.Log(
-            "Client sent password. Tmp table does not contain connected peer",
-            Warning);
-        RawSend(client, "0", 1);
-        close(client);
+        backlog = std::move(ready_.front());
+        ready_.pop_front();
       }
-    } catch (TcpException& exception) {
-      logger.Log("Caught exception " + std::string(exception.what()) +
-                     ".\nTrying to reconnect listener",
+    }
+    if (job) {
+      job();
+    } else {
+      Drain(std::move(backlog));
+    }
+  }
+}
+
+void TcpServer::OnListenerReadable() noexcept {
+  LServer logger(LServer::FLoopAccepter, this, logger_);
+
+  while (true) {
+    int client = accept(listener_, NULL, NULL);
+    if (client < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+      continue;
+    }
+    if (client < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (client < 0) {
+      logger.Log("Error occurred while accepting connection. Pausing accepter",
                  Warning);
+      TcpException(TcpException::Acceptance, logger_, errno);
       try {
-        close(listener_);
-        ConnectListener();
+        loop_->Modify(listener_, 0);
+        resume_timer_ = loop_->RunAfter(loop_period_, [this] {
+          resume_timer_ = 0;
+          loop_->Modify(listener_, EPOLLIN);
+        });
       } catch (TcpException& exception) {
-        logger.Log("Error occurred while reconnecting listener", Error);
-        CloseListener();
+        logger.Log("Cannot pause accepter", Error);
+      }
+      return;
+    }
+
+    if (handshakes_.size() >= uncomplete_client_.GetStats().capacity) {
+      logger.Log("Too many connections waiting for config. Closing", Warning);
+      rejected_.fetch_add(1);
+      close(client);
+      continue;
+    }
+
+    logger.Log("Connection accepted. Applying socket options", Debug);
+    if (!SetSocketOptions(client, options_)) {
+      logger.Log("Error occurred while applying socket options", Warning);
+      TcpException(TcpException::SocketCreation, logger_, errno);
+      close(client);
+      continue;
+    }
+
+    logger.Log("Waiting for client to send config", Debug);
+    WatchHandshake(client);
+  }
+}
+
+void TcpServer::WatchHandshake(int client) noexcept {
+  try {
+    Handshake& handshake = handshakes_[client];
+    handshake.deadline = loop_->RunAfter(ping_threshold_, [this, client] {
+      LServer logger(LServer::FLoopAccepter, this, logger_);
+      logger.Log("Waiting timeout. Sending term signal", Warning);
+      RawSend(client, "0", kMessageSize);
+      DropHandshake(client, true);
+    });
+    loop_->Watch(client, EPOLLIN, [this, client](uint32_t events) {
+      OnHandshakeReadable(client);
+    });
+  } catch (std::exception& exception) {
+    LServer(LServer::FLoopAccepter, this, logger_)
+        .Log("Cannot register connection in event loop", Warning);
+    DropHandshake(client, true);
+  }
+}
+
+void TcpServer::OnHandshakeReadable(int client) noexcept {
+  auto iter = handshakes_.find(client);
+  if (iter == handshakes_.end()) {
+    return;
+  }
+  Handshake& handshake = iter->second;
+
+  ssize_t answ = recv(client, handshake.message + handshake.size,
+                      kMessageSize - handshake.size, MSG_DONTWAIT);
+  if (answ < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (answ <= 0) {
+    LServer(LServer::FLoopAccepter, this, logger_)
+        .Log("Error occurred while receiving config. Closing connection",
+             Warning);
+    TcpException(TcpException::Receiving, logger_, errno);
+    DropHandshake(client, true);
+    return;
+  }
+
+  handshake.size += answ;
+  if (handshake.size == kMessageSize) {
+    std::string message(handshake.message);
+    DropHandshake(client, false);
+    OnHandshakeMessage(client, message);
+  }
+}
+
+void TcpServer::OnHandshakeMessage(int client,
+                                   const std::string& message) noexcept {
+  LServer logger(LServer::FLoopAccepter, this, logger_);
+
+  int64_t client_password = strtoll(message.c_str(), nullptr, 10);
+  logger.Log("Got client config", Debug);
+
+  int64_t flags = GetHandshakeFlags(message) & GetSupportedFlags();
+
+  if (client_password == 0) {
+    const char* reason = CheckAdmission();
+    if (reason != nullptr) {
+      Reject(client, reason);
+      return;
+    }
+    logger.Log("Client is in init mode. Sending password", Debug);
+    // random, so a peer cannot claim another client's heartbeat socket
+    uint64_t password = 0;
+    while (password == 0 || uncomplete_client_.Contains(password)) {
+      if (!GetSecureRandom(password)) {
+        logger.Log("Cannot generate password. Closing connection", Warning);
+        close(client);
         return;
       }
-      logger.Log("Listener reconnected successfully", Info);
+      password >>= 1;
+    }
+    if (RawSend(client, std::to_string(password) + " " + std::to_string(flags),
+                kMessageSize) != kMessageSize) {
+      logger.Log("Error occurred while sending password. Closing connection",
+                 Warning);
+      close(client);
+      return;
+    }
+    logger.Log("Password sent successfully", Debug);
+    try {
+      auto evicted = uncomplete_client_.Insert(
+          password, client,
+          HandshakeTable::Clock::now() +
+              std::chrono::milliseconds(ping_threshold_));
+      if (evicted.has_value()) {
+        logger.Log("Tmp table is full. Evicting oldest peer", Warning);
+        close(evicted.value());
+      }
+    } catch (std::exception& exception) {
+      logger.Log("Cannot store peer in tmp table. Closing connection",
+                 Warning);
+      close(client);
+    }
+    return;
+  }
+
+  auto client_recv = uncomplete_client_.Take(client_password);
+  if (!client_recv.has_value()) {
+    logger.Log(
+        "Client sent password. Tmp table does not contain connected peer",
+        Warning);
+    RawSend(client, "0", 1);
+    close(client);
+    return;
+  }
+  logger.Log("Client sent password. Tmp table contains connected peer", Debug);
+
+  if (pending_ >= kMaxClientLength) {
+    logger.Log("Accept queue is full. Sending term signal", Warning);
+    rejected_.fetch_add(1);
+    RawSend(client, "0", 1);
+    close(client);
+    close(client_recv.value());
+    return;
+  }
+
+  ShmChannel* shm_channel = nullptr;
+  if (RawSend(client, "1", 1) != 1 ||
+      !OfferShmChannel(client, flags, shm_channel)) {
+    logger.Log("Error occurred while sending run signal. Closing connections",
+               Warning);
+    close(client);
+    close(client_recv.value());
+    return;
+  }
+
+  logger.Log("Sent run signal. Creating TcpClient", Debug);
+  try {
+    PushAccepted(TcpClient(client_recv.value(), client, ping_threshold_,
+                           loop_period_, options_, flags, shm_channel,
+                           logger_));
+  } catch (std::exception& exception) {
+    logger.Log("Error occurred while creating TcpClient", Warning);
+  }
+}
+
+const char* TcpServer::CheckAdmission() noexcept {
+  size_t half_open = uncomplete_client_.GetStats().size;
+  // half-open peers are bounded by the tmp table; the accept queue is
+  // checked again when they complete
+  size_t pending = pending_;
+
+  size_t max_pending = kMaxClientLength;
+  if (options_.max_pending > 0) {
+    max_pending = std::min<size_t>(options_.max_pending, max_pending);
+  }
+  if (pending >= max_pending) {
+    return "Too many connections pending acceptance";
+  }
+  if (options_.max_connections > 0 &&
+      live_counter_->load() + half_open >=
+          static_cast<size_t>(options_.max_connections)) {
+    return "Connection limit reached";
+  }
+  if (!accept_bucket_.TryTake(TokenBucket::Clock::now())) {
+    return "Accept rate exceeded";
+  }
+  return nullptr;
+}
+
+void TcpServer::Reject(int client, const char* reason) noexcept {
+  LServer logger(LServer::FLoopAccepter, this, logger_);
+  if (logger.IsEnabled()) {
+    logger.Log(std::string(reason) + ". Sending term signal", Warning);
+  }
+  rejected_.fetch_add(1);
+  RawSend(client, "0", kMessageSize);
+  close(client);
+}
+
+void TcpServer::DropHandshake(int client, bool is_closing) noexcept {
+  auto iter = handshakes_.find(client);
+  if (iter == handshakes_.end()) {
+    return;
+  }
+  loop_->Unwatch(client);
+  loop_->Cancel(iter->second.deadline);
+  handshakes_.erase(iter);
+  if (is_closing) {
+    close(client);
+  }
+}
+
+void TcpServer::ExpireHalfOpen() noexcept {
+  LServer logger(LServer::FLoopAccepter, this, logger_);
+
+  auto expired = uncomplete_client_.Expire(HandshakeTable::Clock::now());
+  for (int socket : expired) {
+    close(socket);
+  }
+  if (!expired.empty() && logger.IsEnabled()) {
+    logger.Log("Closed " + std::to_string(expired.size()) +
+                   " peers that did not send password in time",
+               Warning);
+  }
+
+  try {
+    expiry_timer_ = loop_->RunAfter(std::max(ping_threshold_ / 4, 1),
+                                    [this] { ExpireHalfOpen(); });
+  } catch (std::exception& exception) {
+    logger.Log("Cannot schedule tmp table expiry", Error);
+  }
+}
+
+int64_t TcpServer::GetSupportedFlags() const noexcept {
+  int64_t flags = 0;
+#ifdef __linux
+  if (options_.shared_memory && !unix_path_.empty()) {
+    flags |= ShmTransport;
+  }
+  if (options_.piggyback_liveness) {
+    flags |= PiggybackLiveness;
+  }
+#endif
+  return flags;
+}
+
+bool TcpServer::OfferShmChannel(int client, int64_t flags,
+                                ShmChannel*& shm_channel) noexcept {
+  if ((flags & ShmTransport) == 0) {
+    return true;
+  }
+  LServer logger(LServer::FLoopAccepter, this, logger_);
+
+  logger.Log("Creating shared memory transport", Debug);
+  try {
+    shm_channel =
+        new ShmChannel(options_.shm_ring_size, options_.us_shm_spin, logger_);
+  } catch (std::exception& exception) {
+    logger.Log("Cannot create shared memory transport. Falling back to socket",
+               Warning);
+    return SendFds(client, nullptr, 0);
+  }
+  if (!SendFds(client, shm_channel->GetFds(), ShmChannel::kFdCount)) {
+    logger.Log("Error occurred while sending shared memory descriptors",
+               Warning);
+    delete shm_channel;
+    shm_channel = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void TcpServer::StartAccepting() {
+  try {
+    loop_->RunSync([this] { ResumeAccepting(); });
+  } catch (TcpException& exception) {
+    close(listener_);
+    throw;
+  }
+}
+
+void TcpServer::PauseAccepting() noexcept {
+  loop_->Unwatch(listener_);
+  loop_->Cancel(resume_timer_);
+  loop_->Cancel(expiry_timer_);
+  resume_timer_ = expiry_timer_ = 0;
+  for (auto& [client, handshake] : handshakes_) {
+    loop_->Unwatch(client);
+    loop_->Cancel(handshake.deadline);
+    handshake.deadline = 0;
+  }
+}
+
+void TcpServer::ResumeAccepting() {
+  loop_->Watch(listener_, EPOLLIN,
+               [this](uint32_t events) { OnListenerReadable(); });
+  expiry_timer_ = loop_->RunAfter(std::max(ping_threshold_ / 4, 1),
+                                  [this] { ExpireHalfOpen(); });
+  std::vector<int> clients;
+  for (auto& [client, handshake] : handshakes_) {
+    clients.push_back(client);
+  }
+  for (int client : clients) {
+    WatchHandshake(client);
+  }
+}
+
+int TcpServer::AwaitHandoff(const Handoff& handoff, Logger& logger) {
+  sockaddr_storage addr;
+  auto length = MakeAddress((kUnixPrefix + handoff.path).c_str(), 0, addr);
+  if (!length.has_value()) {
+    logger.Log("Cannot use " + handoff.path + " as socket path", Error);
+    throw TcpException(TcpException::Binding, logger_);
+  }
+  if (!UnlinkStaleSocket(handoff.path)) {
+    int error = errno;
+    logger.Log(handoff.path + " is in use", Error);
+    throw TcpException(TcpException::Binding, logger_, error);
+  }
+
+  int waiter = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (waiter < 0) {
+    throw TcpException(TcpException::SocketCreation, logger_, errno);
+  }
+  if (bind(waiter, (sockaddr*)&addr, length.value()) < 0 ||
+      listen(waiter, 1) < 0) {
+    int error = errno;
+    close(waiter);
+    logger.Log("Cannot listen for handoff", Error);
+    throw TcpException(TcpException::Binding, logger_, error);
+  }
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(handoff.ms_timeout);
+  int channel = -1;
+  int answ = 0;
+  int error = 0;
+  while (channel < 0) {
+    auto ms_left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       deadline - std::chrono::steady_clock::now())
+                       .count();
+    pollfd poll_fd = {.fd = waiter, .events = POLLIN};
+    answ = ms_left > 0 ? poll(&poll_fd, 1, ms_left) : 0;
+    if (answ <= 0) {
+      error = errno;
+      break;
+    }
+    channel = accept4(waiter, NULL, NULL, SOCK_CLOEXEC);
+    if (channel < 0) {
+      error = errno;
+      break;
+    }
+    if (!IsSameUser(channel)) {
+      logger.Log("Handoff peer runs as another user. Dropping it", Warning);
+      close(channel);
+      channel = -1;
+    }
+  }
+  close(waiter);
+  unlink(handoff.path.c_str());
+  if (answ == 0) {
+    logger.Log("Old process did not hand off in time", Error);
+    throw TcpException(TcpException::Timeout, logger_);
+  }
+  if (channel < 0) {
+    throw TcpException(TcpException::Acceptance, logger_, error);
+  }
+  return channel;
+}
+
+void TcpServer::ReceiveHandoff(int channel, int ms_timeout,
+                               std::vector<InheritedConnection>& connections,
+                               std::vector<InheritedHandshake>& handshakes,
+                               Logger& logger) {
+  char record[kHandoffRecordSize];
+  while (true) {
+    pollfd poll_fd = {.fd = channel, .events = POLLIN};
+    int answ = poll(&poll_fd, 1, ms_timeout);
+    if (answ == 0) {
+      logger.Log("Handoff stalled", Error);
+      throw TcpException(TcpException::Timeout, logger_);
+    }
+    size_t length = sizeof(record);
+    int fds[2] = {-1, -1};
+    int count = answ < 0 ? -1 : RecvRecord(channel, record, length, fds, 2);
+    if (count < 0 || length == 0) {
+      logger.Log("Old process broke handoff", Error);
+      throw TcpException(TcpException::Receiving, logger_, errno);
+    }
+
+    std::string message(record, length);
+    std::stringstream stream(message);
+    char kind;
+    stream >> kind;
+    if (kind == 'e') {
+      break;
+    }
+    if (kind == 'l' && count == 1 && listener_ < 0) {
+      stream >> port_ >> ping_threshold_ >> loop_period_;
+      std::getline(stream >> std::ws, unix_path_);
+      listener_ = fds[0];
+      logger.Log("Got listener", Debug);
+      continue;
+    }
+    uint64_t password = 0;
+    size_t partial_size = 0;
+    if (kind == 'h' && count == 1 && stream >> password >> partial_size &&
+        partial_size < message.size()) {
+      logger.Log("Got handshake", Debug);
+      handshakes.push_back(
+          {fds[0], password, message.substr(message.size() - partial_size)});
+      continue;
+    }
+    int64_t flags = 0;
+    int ping_threshold = ping_threshold_;
+    int loop_period = loop_period_;
+    if (kind == 'c' && count == 2 &&
+        stream >> ping_threshold >> loop_period >> flags >> partial_size &&
+        partial_size < message.size()) {
+      logger.Log("Got connection", Debug);
+      connections.push_back({fds[0], fds[1], ping_threshold, loop_period,
+                             flags & ~int64_t(ShmTransport),
+                             message.substr(message.size() - partial_size)});
+      continue;
+    }
+    logger.Log("Unexpected handoff record. Dropping it", Warning);
+    for (int i = 0; i < count; ++i) {
+      close(fds[i]);
+    }
+  }
+  if (listener_ < 0) {
+    logger.Log("Handoff has no listener", Error);
+    throw TcpException(TcpException::Receiving, logger_);
+  }
+}
+
+void TcpServer::AdoptHandoff(std::vector<InheritedConnection>& connections,
+                             std::vector<InheritedHandshake>& handshakes,
+                             Logger& logger) {
+  logger.Log("Registering inherited listener and handshakes in event loop",
+             Debug);
+  try {
+    loop_->RunSync([this, &handshakes] {
+      auto deadline = HandshakeTable::Clock::now() +
+                      std::chrono::milliseconds(ping_threshold_);
+      for (auto& handshake : handshakes) {
+        if (handshake.password == 0) {
+          Handshake& entry = handshakes_[handshake.socket];
+          entry.size = std::min(handshake.partial.size(), kMessageSize - 1);
+          memcpy(entry.message, handshake.partial.data(), entry.size);
+          continue;
+        }
+        auto evicted = uncomplete_client_.Insert(handshake.password,
+                                                 handshake.socket, deadline);
+        if (evicted.has_value()) {
+          close(evicted.value());
+        }
+      }
+      handshakes.clear();
+      ResumeAccepting();
+    });
+  } catch (std::exception& exception) {
+    logger.Log("Cannot register inherited listener", Error);
+    for (auto& connection : connections) {
+      close(connection.heartbeat_socket);
+      close(connection.main_socket);
+    }
+    for (auto& handshake : handshakes) {
+      close(handshake.socket);
+    }
+    StopListening(false);
+    throw;
+  }
+
+  logger.Log("Restarting heartbeats of inherited connections", Debug);
+  for (auto& connection : connections) {
+    try {
+      PushAccepted(TcpClient(connection.heartbeat_socket,
+                             connection.main_socket, connection.ping_threshold,
+                             connection.loop_period, options_,
+                             connection.flags, nullptr, logger_,
+                             HeartBeat::Pinger, connection.partial));
+    } catch (std::exception& exception) {
+      logger.Log("Error occurred while creating TcpClient", Warning);
     }
-    password = (password % LONG_LONG_MAX) + 1;
   }
 }
 
@@ -215,21 +1203,60 @@ void TcpServer::ConnectListener() {
   LServer logger(LServer::FConnectListener, this, logger_);
 
   logger.Log("Trying to create listener", Debug);
-  listener_ = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_storage addr;
+  socklen_t addr_length;
+  if (unix_path_.empty()) {
+    auto& inet6_addr = reinterpret_cast<sockaddr_in6&>(addr);
+    inet6_addr = {.sin6_family = AF_INET6,
+                  .sin6_port = htons(port_),
+                  .sin6_addr = in6addr_any};
+    addr_length = sizeof(sockaddr_in6);
+  } else {
+    auto length = MakeAddress((kUnixPrefix + unix_path_).c_str(), 0, addr);
+    if (!length.has_value()) {
+      logger.Log("Cannot use " + unix_path_ + " as socket path", Error);
+      throw TcpException(TcpException::Binding, logger_);
+    }
+    addr_length = length.value();
+    if (!UnlinkStaleSocket(unix_path_)) {
+      int error = errno;
+      logger.Log(unix_path_ + " is in use", Error);
+      throw TcpException(TcpException::Binding, logger_, error);
+    }
+  }
+
+  listener_ = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listener_ < 0 && addr.ss_family == AF_INET6 &&
+      errno == EAFNOSUPPORT) {
+    logger.Log("IPv6 is not supported. Listening on IPv4 only", Warning);
+    auto& inet_addr = reinterpret_cast<sockaddr_in&>(addr);
+    inet_addr = {.sin_family = AF_INET,
+                 .sin_port = htons(port_),
+                 .sin_addr = {htonl(INADDR_ANY)}};
+    addr_length = sizeof(sockaddr_in);
+    listener_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  }
   int enabling = 1;
-  if (listener_ < 0 || setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR,
-                                  &enabling, sizeof(enabling)) < 0) {
+  int disabling = 0;
+  if (listener_ < 0 ||
+      (addr.ss_family == AF_INET6 &&
+       setsockopt(listener_, IPPROTO_IPV6, IPV6_V6ONLY, &disabling,
+                  sizeof(disabling)) < 0) ||
+      setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enabling,
+                 sizeof(enabling)) < 0 ||
+      !SetSocketOptions(listener_, options_)) {
+    if (listener_ >= 0) {
+      close(listener_);
+    }
     logger.Log("Error occurred while creating socket", Error);
     throw TcpException(TcpException::SocketCreation, logger_, errno);
   }
   logger.Log("Socket created", Debug);
 
-  sockaddr_in addr = {.sin_family = AF_INET,
-                      .sin_port = htons(port_),
-                      .sin_addr = {htonl(INADDR_ANY)}};
-
-  logger.Log("Trying to bind to " + std::to_string(port_), Debug);
-  if (bind(listener_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+  std::string location =
+      unix_path_.empty() ? std::to_string(port_) : unix_path_;
+  logger.Log("Trying to bind to " + location, Debug);
+  if (bind(listener_, (sockaddr*)&addr, addr_length) < 0) {
     close(listener_);
     logger.Log("Error occurred while binding", Error);
     throw TcpException(TcpException::Binding, logger_, errno);
@@ -237,7 +1264,7 @@ void TcpServer::ConnectListener() {
   logger.Log("Bound", Debug);
 
   logger.Log("Trying to listen", Debug);
-  if (listen(listener_, kMaxClientLength) < 0) {
+  if (listen(listener_, options_.listen_backlog) < 0) {
     close(listener_);
     logger.Log("Error occurred while trying to start listening", Error);
     throw TcpException(TcpException::Listening, logger_, errno);
@@ -0,0 +1,332 @@
+#include "tcp-shm.hpp"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace TCP {
+
+namespace {
+
+int FutexWait(std::atomic<uint32_t>* address, uint32_t value,
+              int ms_timeout) noexcept {
+  timespec timeout = {ms_timeout / 1'000, (ms_timeout % 1'000) * 1'000'000};
+  return syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAIT,
+                 value, &timeout, nullptr, 0);
+}
+void FutexWake(std::atomic<uint32_t>* address) noexcept {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(address), FUTEX_WAKE, 1,
+          nullptr, nullptr, 0);
+}
+
+void Notify(int event) noexcept {
+  uint64_t value = 1;
+  write(event, &value, sizeof(value));
+}
+void Drain(int event) noexcept {
+  uint64_t value;
+  read(event, &value, sizeof(value));
+}
+
+int64_t MsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+}  // namespace
+
+ShmChannel::ShmChannel(size_t ring_size, int us_spin, logging_foo f_logger)
+    : is_server_(true), us_spin_(us_spin), logger_(f_logger) {
+  ring_size_ = 1;
+  while (ring_size_ < ring_size) {
+    ring_size_ <<= 1;
+  }
+  map_size_ = kHeaderSize + ring_size_ * 2;
+
+  fds_[0] = memfd_create("c_tcp-shm", MFD_CLOEXEC);
+  fds_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds_[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds_[0] < 0 || fds_[1] < 0 || fds_[2] < 0 ||
+      ftruncate(fds_[0], map_size_) < 0) {
+    int error = errno;
+    Close();
+    throw TcpException(TcpException::SocketCreation, logger_, error);
+  }
+
+  Map();
+  auto* header = new (memory_) Header();
+  header->ring_size = ring_size_;
+}
+ShmChannel::ShmChannel(const int* fds, int us_spin, logging_foo f_logger)
+    : is_server_(false), us_spin_(us_spin), logger_(f_logger) {
+  for (int i = 0; i < kFdCount; ++i) {
+    fds_[i] = fds[i];
+  }
+
+  struct stat memory_stat;
+  if (fstat(fds_[0], &memory_stat) < 0 ||
+      memory_stat.st_size <= (off_t)kHeaderSize) {
+    int error = errno;
+    Close();
+    throw TcpException(TcpException::SocketCreation, logger_, error);
+  }
+  map_size_ = memory_stat.st_size;
+  Map();
+}
+ShmChannel::~ShmChannel() { Close(); }
+
+void ShmChannel::Map() {
+  void* memory = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fds_[0], 0);
+  if (memory == MAP_FAILED) {
+    int error = errno;
+    Close();
+    throw TcpException(TcpException::SocketCreation, logger_, error);
+  }
+  memory_ = static_cast<char*>(memory);
+
+  if (!is_server_) {
+    ring_size_ = reinterpret_cast<Header*>(memory_)->ring_size;
+    if (ring_size_ == 0 || (ring_size_ & (ring_size_ - 1)) != 0 ||
+        kHeaderSize + ring_size_ * 2 != map_size_) {
+      Close();
+      throw TcpException(TcpException::SocketCreation, logger_);
+    }
+  }
+
+  // ring 0 carries client to server data, ring 1 the opposite direction
+  auto* header = reinterpret_cast<Header*>(memory_);
+  int tx_index = is_server_ ? 1 : 0;
+  tx_ = &header->rings[tx_index];
+  rx_ = &header->rings[1 - tx_index];
+  tx_data_ = memory_ + kHeaderSize + ring_size_ * tx_index;
+  rx_data_ = memory_ + kHeaderSize + ring_size_ * (1 - tx_index);
+  tx_event_ = fds_[1 + tx_index];
+  rx_event_ = fds_[2 - tx_index];
+}
+
+const int* ShmChannel::GetFds() const noexcept { return fds_; }
+
+size_t ShmChannel::Send(const char* data, size_t length,
+                        int ms_timeout) noexcept {
+  size_t sent = 0;
+  while (sent < length) {
+    if (tx_->closed.load() != 0 || rx_->closed.load() != 0) {
+      errno = EPIPE;
+      return sent;
+    }
+    uint64_t head;
+    uint64_t tail;
+    if (!LoadIndices(tx_, tx_tail_seen_, false, head, tail)) {
+      return sent;
+    }
+    size_t free_space = ring_size_ - (head - tail);
+    if (free_space == 0) {
+      if (!WaitForSpace(ms_timeout)) {
+        return sent;
+      }
+      continue;
+    }
+
+    size_t chunk = std::min(free_space, length - sent);
+    size_t offset = head & (ring_size_ - 1);
+    size_t first_part = std::min(chunk, ring_size_ - offset);
+    memcpy(tx_data_ + offset, data + sent, first_part);
+    memcpy(tx_data_, data + sent + first_part, chunk - first_part);
+    tx_->head.store(head + chunk);
+    sent += chunk;
+
+    if (tx_->reader_waiting.load() != 0) {
+      Notify(tx_event_);
+    }
+  }
+  return sent;
+}
+
+size_t ShmChannel::Recv(char* data, size_t length, int ms_timeout) noexcept {
+  size_t received = 0;
+  while (received < length) {
+    uint64_t head;
+    uint64_t tail;
+    if (!LoadIndices(rx_, rx_head_seen_, true, head, tail)) {
+      return received;
+    }
+    if (head == tail) {
+      if (rx_->closed.load() != 0 || tx_->closed.load() != 0) {
+        errno = EPIPE;
+        return received;
+      }
+      LClient logger(LClient::FRecv, this, logger_);
+      try {
+        if (!WaitForData(ms_timeout, logger).has_value()) {
+          return received;
+        }
+      } catch (TcpException& exception) {
+        return received;
+      }
+      continue;
+    }
+
+    size_t chunk = std::min<size_t>(head - tail, length - received);
+    size_t offset = tail & (ring_size_ - 1);
+    size_t first_part = std::min(chunk, ring_size_ - offset);
+    memcpy(data + received, rx_data_ + offset, first_part);
+    memcpy(data + received + first_part, rx_data_, chunk - first_part);
+    rx_->tail.store(tail + chunk);
+    received += chunk;
+
+    if (rx_->writer_waiting.load() != 0) {
+      rx_->space_seq.fetch_add(1);
+      FutexWake(&rx_->space_seq);
+    }
+  }
+  return received;
+}
+
+std::optional<int> ShmChannel::WaitForData(int ms_timeout, Logger& logger) {
+  auto start = std::chrono::steady_clock::now();
+  if (IsReadable()) {
+    return 0;
+  }
+
+  auto spin_end = start + std::chrono::microseconds(us_spin_);
+  while (std::chrono::steady_clock::now() < spin_end) {
+    if (IsReadable()) {
+      return MsSince(start);
+    }
+    std::this_thread::yield();
+  }
+
+  rx_->reader_waiting.store(1);
+  while (true) {
+    if (IsReadable()) {
+      rx_->reader_waiting.store(0);
+      Drain(rx_event_);
+      return MsSince(start);
+    }
+    int remaining = ms_timeout - MsSince(start);
+    if (remaining < 0) {
+      rx_->reader_waiting.store(0);
+      return {};
+    }
+    try {
+      TCP::WaitForData(rx_event_, remaining, logger, logger_);
+    } catch (...) {
+      rx_->reader_waiting.store(0);
+      throw;
+    }
+    Drain(rx_event_);
+  }
+}
+
+uint64_t ShmChannel::GetTrafficMark() const noexcept {
+  return rx_->head.load() + tx_->tail.load();
+}
+uint64_t ShmChannel::GetDeliveredMark() const noexcept {
+  return tx_->tail.load();
+}
+
+void ShmChannel::Shutdown() noexcept {
+  if (tx_ == nullptr) {
+    return;
+  }
+  tx_->closed.store(1);
+  rx_->closed.store(1);
+  Notify(tx_event_);
+  Notify(rx_event_);
+  tx_->space_seq.fetch_add(1);
+  FutexWake(&tx_->space_seq);
+  rx_->space_seq.fetch_add(1);
+  FutexWake(&rx_->space_seq);
+}
+void ShmChannel::Close() noexcept {
+  Shutdown();
+  tx_ = nullptr;
+  rx_ = nullptr;
+  if (memory_ != nullptr) {
+    munmap(memory_, map_size_);
+    memory_ = nullptr;
+  }
+  for (int& fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+}
+
+size_t ShmChannel::Peek(char* data, size_t length) noexcept {
+  uint64_t head;
+  uint64_t tail;
+  if (!LoadIndices(rx_, rx_head_seen_, true, head, tail)) {
+    return 0;
+  }
+  size_t chunk = std::min<size_t>(head - tail, length);
+  size_t offset = tail & (ring_size_ - 1);
+  size_t first_part = std::min(chunk, ring_size_ - offset);
+  memcpy(data, rx_data_ + offset, first_part);
+  memcpy(data + first_part, rx_data_, chunk - first_part);
+  return head - tail;
+}
+bool ShmChannel::IsClosed() const noexcept {
+  return rx_->closed.load() != 0 || tx_->closed.load() != 0;
+}
+
+bool ShmChannel::LoadIndices(Ring* ring, std::atomic<uint64_t>& seen,
+                             bool is_head_seen, uint64_t& head,
+                             uint64_t& tail) noexcept {
+  // loaded before the indices, so a racing reader cannot pass it
+  uint64_t last = seen.load(std::memory_order_acquire);
+  tail = ring->tail.load(std::memory_order_acquire);
+  head = ring->head.load(std::memory_order_acquire);
+  uint64_t peer_index = is_head_seen ? head : tail;
+  if (tail <= head && head - tail <= ring_size_ && peer_index >= last) {
+    while (last < peer_index &&
+           !seen.compare_exchange_weak(last, peer_index)) {
+    }
+    return true;
+  }
+
+  LClient(is_head_seen ? LClient::FRecv : LClient::FSend, this, logger_)
+      .Log("Peer corrupted shared memory ring. Closing channel", Error);
+  Shutdown();
+  errno = EPIPE;
+  return false;
+}
+
+bool ShmChannel::IsReadable() const noexcept {
+  return rx_->head.load() != rx_->tail.load(std::memory_order_relaxed) ||
+         rx_->closed.load() != 0 || tx_->closed.load() != 0;
+}
+
+bool ShmChannel::WaitForSpace(int ms_timeout) noexcept {
+  auto start = std::chrono::steady_clock::now();
+  tx_->writer_waiting.store(1);
+  while (true) {
+    uint32_t seq = tx_->space_seq.load();
+    if (tx_->head.load(std::memory_order_relaxed) - tx_->tail.load() <
+            ring_size_ ||
+        tx_->closed.load() != 0) {
+      tx_->writer_waiting.store(0);
+      return true;
+    }
+    int remaining = ms_timeout - MsSince(start);
+    if (remaining < 0) {
+      tx_->writer_waiting.store(0);
+      return false;
+    }
+    FutexWait(&tx_->space_seq, seq, remaining);
+  }
+}
+
+}  // namespace TCP
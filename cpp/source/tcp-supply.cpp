@@ -1,11 +1,22 @@
 #include "tcp-supply.hpp"
 
+#include <arpa/inet.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux
+#include <sys/random.h>
+#endif
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
 #include <vector>
 
@@ -15,7 +26,20 @@ void LoggerCap(const std::string& l_module, const std::string& l_action,
                const std::string& l_event, int priority) {}
 
 void Logger::Log(const std::string& event, int priority) {
-  logger_(GetModule(), GetAction(), event, priority);
+  if (IsEnabled()) {
+    logger_(GetModule(), GetAction(), event, priority);
+  }
+}
+void Logger::Log(const char* event, int priority) {
+  if (IsEnabled()) {
+    logger_(GetModule(), GetAction(), event, priority);
+  }
+}
+
+bool Logger::IsEnabled() const noexcept {
+  auto* target = logger_.target<void (*)(const std::string&, const std::string&,
+                                         const std::string&, int)>();
+  return logger_ && (target == nullptr || *target != &LoggerCap);
 }
 
 std::string GetAddress(void* pointer) {
@@ -46,6 +70,10 @@ std::string LServer::GetAction() const {
       return "LISTENER CONNECTOR";
     case FCloseListener:
       return "LISTENER CLOSER";
+    case FBroadcast:
+      return "BROADCASTER";
+    case FHandOff:
+      return "HANDOFF";
     default:
       return "CANNOT RECOGNIZE ACTION";
   }
@@ -83,6 +111,109 @@ std::string LClient::GetAction() const {
       return "CONNECTION CLOSER";
     case FIsConnected:
       return "CONNECTION CHECKER";
+    case FConnectMany:
+      return "MANY CONNECTOR";
+    default:
+      return "CANNOT RECOGNIZE ACTION";
+  }
+}
+
+LRpc::LRpc(TCP::LRpc::LAction action, void* pointer, TCP::logging_foo logger)
+    : action_(action), pointer_(pointer) {
+  logger_ = logger;
+}
+std::string LRpc::GetModule() const { return "TCP-RPC " + GetAddress(pointer_); }
+std::string LRpc::GetAction() const {
+  switch (action_) {
+    case FConstructor:
+      return "CONSTRUCTOR";
+    case FDestructor:
+      return "DESTRUCTOR";
+    case FCall:
+      return "CALLER";
+    case FReceiveLoop:
+      return "RECEIVER LOOP";
+    case FDispatch:
+      return "DISPATCHER";
+    case FReply:
+      return "REPLIER";
+    default:
+      return "CANNOT RECOGNIZE ACTION";
+  }
+}
+
+LEventLoop::LEventLoop(TCP::LEventLoop::LAction action, void* pointer,
+                       TCP::logging_foo logger)
+    : action_(action), pointer_(pointer) {
+  logger_ = logger;
+}
+std::string LEventLoop::GetModule() const {
+  return "TCP-EVENT-LOOP " + GetAddress(pointer_);
+}
+std::string LEventLoop::GetAction() const {
+  switch (action_) {
+    case FConstructor:
+      return "CONSTRUCTOR";
+    case FDestructor:
+      return "DESTRUCTOR";
+    case FLoop:
+      return "LOOP";
+    default:
+      return "CANNOT RECOGNIZE ACTION";
+  }
+}
+
+LResilient::LResilient(TCP::LResilient::LAction action, void* pointer,
+                       TCP::logging_foo logger)
+    : action_(action), pointer_(pointer) {
+  logger_ = logger;
+}
+std::string LResilient::GetModule() const {
+  return "TCP-RESILIENT " + GetAddress(pointer_);
+}
+std::string LResilient::GetAction() const {
+  switch (action_) {
+    case FConstructor:
+      return "CONSTRUCTOR";
+    case FDestructor:
+      return "DESTRUCTOR";
+    case FSend:
+      return "SENDER";
+    case FRecv:
+      return "RECEIVER";
+    case FReconnectLoop:
+      return "RECONNECT LOOP";
+    case FAccepter:
+      return "ACCEPTER";
+    case FSweeper:
+      return "SWEEPER";
+    default:
+      return "CANNOT RECOGNIZE ACTION";
+  }
+}
+
+LPubSub::LPubSub(TCP::LPubSub::LAction action, void* pointer,
+                 TCP::logging_foo logger)
+    : action_(action), pointer_(pointer) {
+  logger_ = logger;
+}
+std::string LPubSub::GetModule() const {
+  return "TCP-PUBSUB " + GetAddress(pointer_);
+}
+std::string LPubSub::GetAction() const {
+  switch (action_) {
+    case FConstructor:
+      return "CONSTRUCTOR";
+    case FDestructor:
+      return "DESTRUCTOR";
+    case FPublish:
+      return "PUBLISHER";
+    case FAccepter:
+      return "ACCEPTER";
+    case FController:
+      return "CONTROLLER";
+    case FSender:
+      return "SENDER";
     default:
       return "CANNOT RECOGNIZE ACTION";
   }
@@ -135,6 +266,12 @@ TcpException::TcpException(ExceptionType type, logging_foo f_logger, int error,
         break;
       case Multithreading:
         s_what_ = "multithreading";
+        break;
+      case Timeout:
+        s_what_ = "timeout";
+        break;
+      case Remote:
+        s_what_ = "remote error";
     }
   }
 
@@ -151,20 +288,379 @@ TcpException::ExceptionType TcpException::GetType() const noexcept {
 }
 int TcpException::GetErrno() const noexcept { return error_; }
 
+bool IsUnixAddress(const char* addr) noexcept {
+  return strncmp(addr, kUnixPrefix, sizeof(kUnixPrefix) - 1) == 0;
+}
+
+bool UnlinkStaleSocket(const std::string& path) noexcept {
+  struct stat status;
+  if (lstat(path.c_str(), &status) < 0) {
+    return errno == ENOENT;
+  }
+  sockaddr_storage addr;
+  auto length = MakeAddress((kUnixPrefix + path).c_str(), 0, addr);
+  if (!S_ISSOCK(status.st_mode) || !length.has_value()) {
+    errno = EADDRINUSE;
+    return false;
+  }
+
+  // only a socket nobody listens on refuses; a live one accepts or is busy
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (probe < 0) {
+    return false;
+  }
+  bool is_stale = connect(probe, (sockaddr*)&addr, length.value()) < 0 &&
+                  errno == ECONNREFUSED;
+  close(probe);
+  if (!is_stale) {
+    errno = EADDRINUSE;
+    return false;
+  }
+  return unlink(path.c_str()) == 0 || errno == ENOENT;
+}
+
+std::optional<socklen_t> MakeAddress(const char* addr, int port,
+                                     sockaddr_storage& storage) noexcept {
+  memset(&storage, 0, sizeof(storage));
+
+  if (IsUnixAddress(addr)) {
+    const char* path = addr + sizeof(kUnixPrefix) - 1;
+    auto& unix_addr = reinterpret_cast<sockaddr_un&>(storage);
+    if (*path == '\0' || strlen(path) >= sizeof(unix_addr.sun_path)) {
+      return {};
+    }
+    unix_addr.sun_family = AF_UNIX;
+    strcpy(unix_addr.sun_path, path);
+    return sizeof(sockaddr_un);
+  }
+
+  auto& inet_addr_v = reinterpret_cast<sockaddr_in&>(storage);
+  if (inet_pton(AF_INET, addr, &inet_addr_v.sin_addr) == 1) {
+    inet_addr_v.sin_family = AF_INET;
+    inet_addr_v.sin_port = htons(port);
+    return sizeof(sockaddr_in);
+  }
+
+  std::string inet6_str = addr;
+  if (inet6_str.size() > 2 && inet6_str.front() == '[' &&
+      inet6_str.back() == ']') {
+    inet6_str = inet6_str.substr(1, inet6_str.size() - 2);
+  }
+  auto& inet6_addr = reinterpret_cast<sockaddr_in6&>(storage);
+  if (inet_pton(AF_INET6, inet6_str.c_str(), &inet6_addr.sin6_addr) == 1) {
+    inet6_addr.sin6_family = AF_INET6;
+    inet6_addr.sin6_port = htons(port);
+    return sizeof(sockaddr_in6);
+  }
+  return {};
+}
+
+std::vector<Endpoint> ResolveAddress(const char* addr, int port,
+                                     Logger& logger) noexcept {
+  std::vector<Endpoint> endpoints(1);
+  auto length = MakeAddress(addr, port, endpoints[0].addr);
+  if (length.has_value()) {
+    endpoints[0].length = length.value();
+    return endpoints;
+  }
+  endpoints.clear();
+  if (IsUnixAddress(addr)) {
+    return endpoints;
+  }
+
+  if (logger.IsEnabled()) {
+    logger.Log("Resolving " + std::string(addr), Debug);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+  addrinfo* result = nullptr;
+  int answ = getaddrinfo(addr, std::to_string(port).c_str(), &hints, &result);
+  if (answ != 0) {
+    if (logger.IsEnabled()) {
+      logger.Log("Cannot resolve " + std::string(addr) + ": " +
+                     gai_strerror(answ),
+                 Error);
+    }
+    return endpoints;
+  }
+
+  std::vector<Endpoint> families[2];
+  int preferred = result->ai_family;
+  for (addrinfo* info = result; info != nullptr; info = info->ai_next) {
+    if (info->ai_addrlen > sizeof(sockaddr_storage)) {
+      continue;
+    }
+    Endpoint endpoint = {};
+    memcpy(&endpoint.addr, info->ai_addr, info->ai_addrlen);
+    endpoint.length = info->ai_addrlen;
+    families[info->ai_family == preferred ? 0 : 1].push_back(endpoint);
+  }
+  freeaddrinfo(result);
+
+  for (size_t i = 0; i < std::max(families[0].size(), families[1].size());
+       ++i) {
+    for (auto& family : families) {
+      if (i < family.size()) {
+        endpoints.push_back(family[i]);
+      }
+    }
+  }
+  return endpoints;
+}
+
+int ConnectFastest(const std::vector<Endpoint>& endpoints,
+                   const SocketOptions& options, size_t& winner) noexcept {
+  if (endpoints.size() == 1) {
+    int dp = socket(endpoints[0].addr.ss_family, SOCK_STREAM, 0);
+    if (dp < 0) {
+      return -1;
+    }
+    if (!SetSocketOptions(dp, options) ||
+        connect(dp, (sockaddr*)&endpoints[0].addr, endpoints[0].length) < 0) {
+      int error = errno;
+      close(dp);
+      errno = error;
+      return -1;
+    }
+    winner = 0;
+    return dp;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  std::vector<pollfd> attempts;
+  std::vector<size_t> indexes;
+  size_t next = 0;
+  int error = EHOSTUNREACH;
+  auto next_start = Clock::now();
+
+  auto finish = [&](size_t position) {
+    for (size_t i = 0; i < attempts.size(); ++i) {
+      if (i != position) {
+        close(attempts[i].fd);
+      }
+    }
+  };
+
+  while (true) {
+    auto now = Clock::now();
+    if (next < endpoints.size() && (attempts.empty() || now >= next_start)) {
+      const Endpoint& endpoint = endpoints[next];
+      size_t index = next++;
+      next_start = now + std::chrono::milliseconds(options.ms_attempt_delay);
+
+      int dp = socket(endpoint.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (dp < 0 || !SetSocketOptions(dp, options)) {
+        error = errno;
+        if (dp >= 0) {
+          close(dp);
+        }
+        continue;
+      }
+      int answ = connect(dp, (sockaddr*)&endpoint.addr, endpoint.length);
+      if (answ < 0 && errno != EINPROGRESS) {
+        error = errno;
+        close(dp);
+        continue;
+      }
+      attempts.push_back({.fd = dp, .events = POLLOUT});
+      indexes.push_back(index);
+      if (answ < 0) {
+        continue;
+      }
+      finish(attempts.size() - 1);
+      fcntl(dp, F_SETFL, fcntl(dp, F_GETFL) & ~O_NONBLOCK);
+      winner = index;
+      return dp;
+    }
+    if (attempts.empty()) {
+      errno = error;
+      return -1;
+    }
+
+    int ms_timeout = -1;
+    if (next < endpoints.size()) {
+      ms_timeout = std::max<int64_t>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(next_start -
+                                                                now)
+                  .count() +
+              1,
+          0);
+    }
+    if (poll(attempts.data(), attempts.size(), ms_timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = errno;
+      finish(attempts.size());
+      errno = error;
+      return -1;
+    }
+
+    for (size_t i = 0; i < attempts.size();) {
+      if (attempts[i].revents == 0) {
+        ++i;
+        continue;
+      }
+      int dp = attempts[i].fd;
+      int socket_error = 0;
+      socklen_t length = sizeof(socket_error);
+      if (getsockopt(dp, SOL_SOCKET, SO_ERROR, &socket_error, &length) < 0) {
+        socket_error = errno;
+      }
+      if (socket_error == 0) {
+        finish(i);
+        fcntl(dp, F_SETFL, fcntl(dp, F_GETFL) & ~O_NONBLOCK);
+        winner = indexes[i];
+        return dp;
+      }
+      error = socket_error;
+      close(dp);
+      attempts.erase(attempts.begin() + i);
+      indexes.erase(indexes.begin() + i);
+      next_start = Clock::now();
+    }
+  }
+}
+
+int64_t GetHandshakeFlags(const std::string& message) noexcept {
+  auto delimiter = message.find(' ');
+  if (delimiter == std::string::npos) {
+    return 0;
+  }
+  return strtoll(message.c_str() + delimiter + 1, nullptr, 10);
+}
+
+bool WriteAll(int fd, const char* data, size_t length) noexcept {
+  while (length > 0) {
+    ssize_t answ = write(fd, data, length);
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ <= 0) {
+      return false;
+    }
+    data += answ;
+    length -= answ;
+  }
+  return true;
+}
+
+bool DrainPipe(int pipe_out, int fd, size_t length, bool& direct) noexcept {
+  while (length > 0 && direct) {
+    ssize_t answ =
+        splice(pipe_out, nullptr, fd, nullptr, length, SPLICE_F_MOVE);
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ < 0 && errno == EINVAL) {
+      direct = false;
+      break;
+    }
+    if (answ <= 0) {
+      return false;
+    }
+    length -= answ;
+  }
+
+  char buffer[4096];
+  while (length > 0) {
+    ssize_t answ = read(pipe_out, buffer, std::min(length, sizeof(buffer)));
+    if (answ < 0 && errno == EINTR) {
+      continue;
+    }
+    if (answ <= 0 || !WriteAll(fd, buffer, answ)) {
+      return false;
+    }
+    length -= answ;
+  }
+  return true;
+}
+
+bool SendFds(int dp, const int* fds, int count) noexcept {
+  char payload = count > 0 ? '1' : '0';
+  return SendRecord(dp, &payload, 1, fds, count);
+}
+int RecvFds(int dp, int* fds, int count) noexcept {
+  char payload;
+  size_t length = 1;
+  int received = RecvRecord(dp, &payload, length, fds, count);
+  return length == 1 ? received : -1;
+}
+
+bool IsSameUser(int dp) noexcept {
+#ifdef __linux
+  ucred credentials = {};
+  socklen_t length = sizeof(credentials);
+  return getsockopt(dp, SOL_SOCKET, SO_PEERCRED, &credentials, &length) ==
+             0 &&
+         credentials.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  return getpeereid(dp, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+bool SendRecord(int dp, const char* data, size_t length, const int* fds,
+                int count) noexcept {
+  iovec io = {.iov_base = const_cast<char*>(data), .iov_len = length};
+  msghdr message = {.msg_iov = &io, .msg_iovlen = 1};
+
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+  if (count > 0) {
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+  }
+  return sendmsg(dp, &message, MSG_NOSIGNAL) == ssize_t(length);
+}
+int RecvRecord(int dp, char* data, size_t& length, int* fds,
+               int count) noexcept {
+  iovec io = {.iov_base = data, .iov_len = length};
+  std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+  msghdr message = {.msg_iov = &io,
+                    .msg_iovlen = 1,
+                    .msg_control = control.data(),
+                    .msg_controllen = control.size()};
+
+  ssize_t answ = recvmsg(dp, &message, MSG_CMSG_CLOEXEC);
+  if (answ <= 0) {
+    length = 0;
+    return -1;
+  }
+  length = answ;
+  cmsghdr* header = CMSG_FIRSTHDR(&message);
+  if (header == nullptr || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS) {
+    return 0;
+  }
+  int received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * std::min(received, count));
+  for (int i = count; i < received; ++i) {
+    int extra;
+    memcpy(&extra, CMSG_DATA(header) + sizeof(int) * i, sizeof(int));
+    close(extra);
+  }
+  return std::min(received, count);
+}
+
 std::optional<int> WaitForData(int dp, int ms_timeout, Logger& logger,
                                logging_foo log_foo) {
-  fd_set fd_set_v;
-  FD_ZERO(&fd_set_v);
-  FD_SET(dp, &fd_set_v);
-
-  timeval timeout = {ms_timeout / 1'000, (ms_timeout % 1'000) * 1'000};
-
-  logger.Log("Starting waiting for data " + std::to_string(timeout.tv_sec) +
-                 "." + std::to_string(timeout.tv_usec) + "s",
-             Debug);
-  auto time_start = std::chrono::system_clock::now();
-  int answ = select(dp + 1, &fd_set_v, nullptr, nullptr, &timeout);
-  auto time_stop = std::chrono::system_clock::now();
+  pollfd poll_fd = {.fd = dp, .events = POLLIN};
+
+  if (logger.IsEnabled()) {
+    logger.Log("Starting waiting for data " + std::to_string(ms_timeout) + "ms",
+               Debug);
+  }
+  auto time_start = std::chrono::steady_clock::now();
+  int answ = poll(&poll_fd, 1, ms_timeout);
+  auto time_stop = std::chrono::steady_clock::now();
   logger.Log("Stopped waiting", Debug);
 
   if (answ < 0) {
@@ -202,19 +698,92 @@ std::string RawRecv(int dp, size_t length) noexcept {
 }
 
 bool SetKeepIdle(int dp) noexcept {
-  int32_t on = 1, idle_interval = 60, idle_count = 3;
+  return SetSocketOptions(dp, kDefSocketOptions);
+}
+
+bool SetSocketOptions(int dp, const SocketOptions& options) noexcept {
+  int32_t on = 1;
+  int32_t keep_alive = options.keep_alive ? 1 : 0;
+
+  if (options.send_buffer > 0 &&
+      setsockopt(dp, SOL_SOCKET, SO_SNDBUF, &options.send_buffer,
+                 sizeof(options.send_buffer)) < 0) {
+    return false;
+  }
+  if (options.receive_buffer > 0 &&
+      setsockopt(dp, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer,
+                 sizeof(options.receive_buffer)) < 0) {
+    return false;
+  }
+
+  sockaddr_storage local;
+  socklen_t local_length = sizeof(local);
+  if (getsockname(dp, (sockaddr*)&local, &local_length) < 0) {
+    return false;
+  }
+  if (local.ss_family == AF_UNIX) {
+    return true;
+  }
 
-  return setsockopt(dp, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) >= 0 &&
+  if (options.no_delay &&
+      setsockopt(dp, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+    return false;
+  }
+  if (setsockopt(dp, SOL_SOCKET, SO_KEEPALIVE, &keep_alive,
+                 sizeof(keep_alive)) < 0) {
+    return false;
+  }
 #ifdef __linux
-         setsockopt(dp, SOL_TCP, TCP_KEEPIDLE, &idle_interval,
-                    sizeof(idle_interval)) >= 0 &&
-         setsockopt(dp, SOL_TCP, TCP_KEEPINTVL, &idle_interval,
-                    sizeof(idle_interval)) >= 0 &&
-         setsockopt(dp, SOL_TCP, TCP_KEEPCNT, &idle_count,
-                    sizeof(idle_count)) >= 0;
+  if (options.quick_ack &&
+      setsockopt(dp, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) < 0) {
+    return false;
+  }
+  if (options.busy_poll > 0) {
+    setsockopt(dp, SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll,
+               sizeof(options.busy_poll));
+  }
+  if (options.ms_user_timeout > 0 &&
+      setsockopt(dp, IPPROTO_TCP, TCP_USER_TIMEOUT, &options.ms_user_timeout,
+                 sizeof(options.ms_user_timeout)) < 0) {
+    return false;
+  }
+  if (!options.keep_alive) {
+    return true;
+  }
+  return setsockopt(dp, SOL_TCP, TCP_KEEPIDLE, &options.keep_idle,
+                    sizeof(options.keep_idle)) >= 0 &&
+         setsockopt(dp, SOL_TCP, TCP_KEEPINTVL, &options.keep_interval,
+                    sizeof(options.keep_interval)) >= 0 &&
+         setsockopt(dp, SOL_TCP, TCP_KEEPCNT, &options.keep_count,
+                    sizeof(options.keep_count)) >= 0;
 #elif __APPLE__
-         setsockopt(dp, IPPROTO_TCP, TCP_KEEPALIVE, &idle_interval,
-                    sizeof(idle_interval)) >= 0;
+  if (!options.keep_alive) {
+    return true;
+  }
+  return setsockopt(dp, IPPROTO_TCP, TCP_KEEPALIVE, &options.keep_idle,
+                    sizeof(options.keep_idle)) >= 0;
+#else
+  return true;
+#endif
+}
+
+void SetQuickAck(int dp) noexcept {
+#ifdef __linux
+  int32_t on = 1;
+  setsockopt(dp, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+#endif
+}
+
+bool GetSecureRandom(uint64_t& value) noexcept {
+#ifdef __linux
+  ssize_t length;
+  do {
+    length = getrandom(&value, sizeof(value), 0);
+  } while (length < 0 && errno == EINTR);
+  return length == sizeof(value);
+#else
+  arc4random_buf(&value, sizeof(value));
+  return true;
 #endif
 }
 
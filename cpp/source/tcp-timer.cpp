@@ -0,0 +1,202 @@
+#include "tcp-timer.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace TCP {
+
+namespace {
+
+const uint64_t kSlotMask = TimerWheel::kLevelSize - 1;
+
+uint64_t GetSlotRange(int first, int last) noexcept {
+  return (~0ULL >> (TimerWheel::kLevelSize - 1 - last)) & (~0ULL << first);
+}
+
+}  // namespace
+
+TimerWheel::TimerWheel() : start_(Clock::now()) {
+  std::fill(heads_, heads_ + kListCount, kNone);
+}
+
+TimerWheel::TimerId TimerWheel::Schedule(int64_t ms_delay, task_foo callback) {
+  int32_t index = free_;
+  if (index != kNone) {
+    free_ = nodes_[index].next;
+  } else {
+    index = nodes_.size();
+    nodes_.emplace_back();
+  }
+
+  int64_t now = GetTick(Clock::now());
+  if (size_ == 0) {
+    current_ = std::max(current_, now);
+  }
+
+  // one extra tick so a timer never fires before its delay has passed
+  ms_delay = std::clamp<int64_t>(ms_delay, 0, kMaxDelay - 1);
+  Node& node = nodes_[index];
+  node.callback = std::move(callback);
+  node.expires = std::max(now, current_) + ms_delay + 1;
+  Place(index);
+  ++size_;
+
+  return (uint64_t(node.generation) << 32) | uint32_t(index);
+}
+
+bool TimerWheel::Cancel(TimerId id) noexcept {
+  auto index = int32_t(id & 0xFFFFFFFF);
+  if (index < 0 || index >= int32_t(nodes_.size()) ||
+      nodes_[index].generation != id >> 32 || nodes_[index].list == kNone) {
+    return false;
+  }
+  Unlink(index);
+  Release(index);
+  return true;
+}
+
+bool TimerWheel::PopExpired(Clock::time_point now, task_foo& callback) {
+  int64_t target = GetTick(now);
+  while (heads_[kExpiredList] == kNone) {
+    if (current_ >= target) {
+      return false;
+    }
+    if (size_ == 0) {
+      current_ = target;
+      return false;
+    }
+
+    // skip empty ticks of the current level 0 round in one step
+    int64_t round_end = current_ | kSlotMask;
+    int64_t last = std::min(target, round_end);
+    if (last > current_) {
+      uint64_t due = occupied_[0] & GetSlotRange((current_ + 1) & kSlotMask,
+                                                 last & kSlotMask);
+      if (due == 0) {
+        current_ = last;
+        continue;
+      }
+      current_ = (current_ & ~kSlotMask) + std::countr_zero(due) - 1;
+    }
+    Step();
+  }
+
+  int32_t index = heads_[kExpiredList];
+  Unlink(index);
+  callback = std::move(nodes_[index].callback);
+  Release(index);
+  return true;
+}
+
+std::optional<int64_t> TimerWheel::GetMsToNext(
+    Clock::time_point now) const noexcept {
+  if (size_ == 0) {
+    return {};
+  }
+  if (heads_[kExpiredList] != kNone) {
+    return 0;
+  }
+
+  int64_t next = (current_ | kSlotMask) + 1;
+  int first = (current_ + 1) & kSlotMask;
+  if (first != 0) {
+    uint64_t due = occupied_[0] & GetSlotRange(first, kSlotMask);
+    if (due != 0) {
+      next = (current_ & ~kSlotMask) + std::countr_zero(due);
+    }
+  }
+  return std::max<int64_t>(next - GetTick(now), 0);
+}
+
+size_t TimerWheel::GetSize() const noexcept { return size_; }
+
+int64_t TimerWheel::GetTick(Clock::time_point time) const noexcept {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(time - start_)
+      .count();
+}
+
+void TimerWheel::Place(int32_t index) noexcept {
+  int64_t expires = nodes_[index].expires;
+  int64_t delta = std::max<int64_t>(expires - current_, 0);
+  for (int level = 0; level < kLevelCount; ++level) {
+    if (delta < (1LL << (kLevelBits * (level + 1))) ||
+        level == kLevelCount - 1) {
+      int slot = (expires >> (kLevelBits * level)) & kSlotMask;
+      Link(index, level * kLevelSize + slot);
+      return;
+    }
+  }
+}
+
+void TimerWheel::Link(int32_t index, int list) noexcept {
+  Node& node = nodes_[index];
+  node.list = list;
+  node.prev = kNone;
+  node.next = heads_[list];
+  if (node.next != kNone) {
+    nodes_[node.next].prev = index;
+  }
+  heads_[list] = index;
+  if (list != kExpiredList) {
+    occupied_[list / kLevelSize] |= 1ULL << (list % kLevelSize);
+  }
+}
+
+void TimerWheel::Unlink(int32_t index) noexcept {
+  Node& node = nodes_[index];
+  if (node.prev != kNone) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.list] = node.next;
+  }
+  if (node.next != kNone) {
+    nodes_[node.next].prev = node.prev;
+  }
+  if (heads_[node.list] == kNone && node.list != kExpiredList) {
+    occupied_[node.list / kLevelSize] &= ~(1ULL << (node.list % kLevelSize));
+  }
+  node.list = kNone;
+}
+
+void TimerWheel::Release(int32_t index) noexcept {
+  Node& node = nodes_[index];
+  node.callback = nullptr;
+  ++node.generation;
+  node.next = free_;
+  free_ = index;
+  --size_;
+}
+
+void TimerWheel::Step() noexcept {
+  ++current_;
+  int slot = current_ & kSlotMask;
+  if (slot == 0) {
+    for (int level = 1; level < kLevelCount; ++level) {
+      int level_slot = (current_ >> (kLevelBits * level)) & kSlotMask;
+      Cascade(level, level_slot);
+      if (level_slot != 0) {
+        break;
+      }
+    }
+  }
+
+  while (heads_[slot] != kNone) {
+    int32_t index = heads_[slot];
+    Unlink(index);
+    Link(index, kExpiredList);
+  }
+}
+
+void TimerWheel::Cascade(int level, int slot) noexcept {
+  int list = level * kLevelSize + slot;
+  int32_t index = heads_[list];
+  heads_[list] = kNone;
+  occupied_[level] &= ~(1ULL << slot);
+  while (index != kNone) {
+    int32_t next = nodes_[index].next;
+    Place(index);
+    index = next;
+  }
+}
+
+}  // namespace TCP
@@ -0,0 +1,199 @@
+#include "tcp-trace.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace TCP {
+
+namespace {
+
+struct TraceEvent {
+  std::atomic<uint64_t> message;
+  std::atomic<int64_t> begin;
+  std::atomic<int64_t> duration;
+  std::atomic<int> stage;
+};
+
+struct TraceRing {
+  size_t thread;
+  std::atomic<uint64_t> head = 0;
+  std::atomic<uint64_t> cleared = 0;
+  // guarded by rings_mutex, a ring outlives its thread until it is reused
+  bool is_owned = true;
+  TraceEvent events[Tracer::kRingSize];
+};
+
+std::mutex rings_mutex;
+std::vector<TraceRing*> rings;
+
+std::atomic<uint32_t> sample_period = 1;
+std::atomic<bool> is_stamping = false;
+std::atomic<uint64_t> next_message = 1;
+
+struct RingHandle {
+  TraceRing* ring = nullptr;
+  uint64_t counter = 0;
+
+  ~RingHandle() {
+    if (ring != nullptr) {
+      std::lock_guard<std::mutex> lock(rings_mutex);
+      ring->is_owned = false;
+    }
+  }
+};
+
+thread_local RingHandle handle;
+
+TraceRing* GetRing() {
+  if (handle.ring != nullptr) {
+    return handle.ring;
+  }
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (TraceRing* ring : rings) {
+    if (!ring->is_owned) {
+      ring->is_owned = true;
+      handle.ring = ring;
+      return ring;
+    }
+  }
+  handle.ring = new TraceRing();
+  handle.ring->thread = rings.size();
+  rings.push_back(handle.ring);
+  return handle.ring;
+}
+
+const char* GetStageName(int stage) noexcept {
+  switch (stage) {
+    case TSerialize:
+      return "serialize";
+    case TFrame:
+      return "frame";
+    case TKernelSend:
+      return "kernel send";
+    case TWire:
+      return "wire";
+    case TWait:
+      return "wait";
+    case TKernelRecv:
+      return "kernel recv";
+    case TDeserialize:
+      return "deserialize";
+    default:
+      return "unknown";
+  }
+}
+
+void AppendMicros(std::string& output, int64_t ns) {
+  output += std::to_string(ns / 1000);
+  std::string fraction = std::to_string(ns % 1000);
+  output += '.';
+  output.append(3 - fraction.size(), '0');
+  output += fraction;
+}
+
+}  // namespace
+
+void Tracer::Enable(uint32_t period, bool is_stamped) {
+  sample_period = std::max<uint32_t>(period, 1);
+  is_stamping = is_stamped;
+  is_enabled_ = period != 0;
+}
+void Tracer::Disable() noexcept { is_enabled_ = false; }
+
+std::string Tracer::ExportChrome() {
+  std::string output = "{\"traceEvents\":[";
+  std::string pid = std::to_string(getpid());
+  bool is_first = true;
+
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (TraceRing* ring : rings) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t begin = std::max<uint64_t>(
+        ring->cleared.load(), head > kRingSize ? head - kRingSize : 0);
+    for (uint64_t i = begin; i < head; ++i) {
+      TraceEvent& event = ring->events[i % kRingSize];
+      if (!is_first) {
+        output += ',';
+      }
+      is_first = false;
+      output += "{\"name\":\"";
+      output += GetStageName(event.stage.load(std::memory_order_relaxed));
+      output += "\",\"cat\":\"tcp\",\"ph\":\"X\",\"pid\":" + pid +
+                ",\"tid\":" + std::to_string(ring->thread) + ",\"ts\":";
+      AppendMicros(output, event.begin.load(std::memory_order_relaxed));
+      output += ",\"dur\":";
+      AppendMicros(output, event.duration.load(std::memory_order_relaxed));
+      output += ",\"args\":{\"message\":" +
+                std::to_string(event.message.load(std::memory_order_relaxed)) +
+                "}}";
+    }
+  }
+  output += "],\"displayTimeUnit\":\"ns\"}";
+  return output;
+}
+
+void Tracer::Clear() noexcept {
+  std::lock_guard<std::mutex> lock(rings_mutex);
+  for (TraceRing* ring : rings) {
+    ring->cleared = ring->head.load();
+  }
+}
+
+int64_t Tracer::Now() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::Begin(int64_t start, int64_t stamp) noexcept {
+  message_ = 0;
+  if (!IsEnabled() ||
+      (stamp == 0 && ++handle.counter % sample_period.load() != 0)) {
+    return;
+  }
+  message_ = next_message.fetch_add(1, std::memory_order_relaxed);
+  if (stamp != 0) {
+    int64_t wire = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count() -
+                   stamp;
+    mark_ = Now() - std::max<int64_t>(wire, 0);
+    Record(TWire);
+  }
+  mark_ = start;
+}
+
+int64_t Tracer::GetStamp() noexcept {
+  if (message_ == 0 || !is_stamping.load(std::memory_order_relaxed)) {
+    return 0;
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+void Tracer::Record(TraceStage stage) noexcept {
+  int64_t now = Now();
+  TraceRing* ring;
+  try {
+    ring = GetRing();
+  } catch (...) {
+    message_ = 0;
+    return;
+  }
+
+  uint64_t index = ring->head.load(std::memory_order_relaxed);
+  TraceEvent& event = ring->events[index % kRingSize];
+  event.message.store(message_, std::memory_order_relaxed);
+  event.stage.store(stage, std::memory_order_relaxed);
+  event.begin.store(mark_, std::memory_order_relaxed);
+  event.duration.store(now - mark_, std::memory_order_relaxed);
+  ring->head.store(index + 1, std::memory_order_release);
+  mark_ = now;
+}
+
+}  // namespace TCP
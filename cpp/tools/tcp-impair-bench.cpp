@@ -0,0 +1,177 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "tcp-impair.hpp"
+#include "tcp-server.hpp"
+
+// Paired runs of the same workload over a clean and an impaired loopback
+// path: the heartbeat ping estimate, how soon a stalled peer is dropped and
+// the throughput under a bandwidth cap.
+//   tcp-impair-bench [base_port]
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char kLoopback[] = "127.0.0.1";
+
+int server_port = 47000;
+int proxy_port = 47500;
+
+struct Link {
+  Link(int ms_ping_threshold, int ms_loop_period,
+       const TCP::SocketOptions& options, const TCP::ImpairOptions& impair)
+      : server(++server_port, ms_ping_threshold, ms_loop_period, options),
+        proxy(++proxy_port, kLoopback, server_port, impair),
+        client(kLoopback, proxy_port, ms_ping_threshold, ms_loop_period,
+               options),
+        peer(server.AcceptConnection()) {}
+
+  TCP::TcpServer server;
+  TCP::ImpairProxy proxy;
+  TCP::TcpClient client;
+  TCP::TcpClient peer;
+};
+
+int64_t GetMs(Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+      .count();
+}
+
+void BenchPing() {
+  // GetPing reports half of the round trip
+  std::cout << "ping estimate, ms\n";
+  for (int latency : {0, 10, 25, 50}) {
+    TCP::ImpairOptions impair;
+    impair.main.ms_latency = impair.heartbeat.ms_latency = latency;
+    impair.main.ms_jitter = impair.heartbeat.ms_jitter = latency / 5;
+    Link link(TCP::kDefPingThreshold, TCP::kDefLoopPeriod,
+              TCP::kDefSocketOptions, impair);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    int64_t client_ping = 0;
+    int64_t server_ping = 0;
+    const int samples = 10;
+    for (int i = 0; i < samples; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      client_ping += link.client.GetPing();
+      server_ping += link.peer.GetPing();
+    }
+    std::cout << "  latency " << std::setw(2) << latency << " +-"
+              << std::setw(2) << latency / 5 << ": client "
+              << std::setw(4) << client_ping / samples << ", server "
+              << std::setw(4) << server_ping / samples << '\n';
+  }
+}
+
+void BenchStall(const char* name, double phi_threshold) {
+  const int ping_threshold = 500;
+  const int stall_period = 1500;
+  std::cout << "stall detection, " << name << ", threshold "
+            << ping_threshold << " ms\n";
+
+  TCP::SocketOptions options;
+  options.phi_threshold = phi_threshold;
+  for (int stall : {200, 400, 1000}) {
+    TCP::ImpairOptions impair;
+    impair.main.ms_stall_period = impair.heartbeat.ms_stall_period =
+        stall_period;
+    impair.main.ms_stall = impair.heartbeat.ms_stall = stall;
+    auto start = Clock::now();
+    Link link(ping_threshold, TCP::kDefLoopPeriod, options, impair);
+    auto stall_start = start + std::chrono::milliseconds(stall_period - stall);
+
+    int64_t client_lost = -1;
+    int64_t server_lost = -1;
+    while (Clock::now() < start + std::chrono::milliseconds(stall_period) +
+                              std::chrono::milliseconds(ping_threshold)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      if (client_lost < 0 && !link.client.IsConnected()) {
+        client_lost = GetMs(Clock::now() - stall_start);
+      }
+      if (server_lost < 0 && !link.peer.IsConnected()) {
+        server_lost = GetMs(Clock::now() - stall_start);
+      }
+    }
+    std::cout << "  stall " << std::setw(4) << stall << ": ";
+    if (client_lost < 0 && server_lost < 0) {
+      std::cout << "survived\n";
+    } else {
+      std::cout << "client lost after " << client_lost
+                << ", server lost after " << server_lost << '\n';
+    }
+  }
+}
+
+void BenchThroughput() {
+  const size_t message_size = 1 << 16;
+  const size_t total = 8 << 20;
+  std::cout << "throughput, " << (total >> 20) << " MiB in "
+            << (message_size >> 10) << " KiB messages\n";
+
+  for (size_t rate : {size_t(0), size_t(32) << 20, size_t(4) << 20}) {
+    for (int latency : {0, 20}) {
+      TCP::ImpairOptions impair;
+      impair.main.rate = rate;
+      impair.main.ms_latency = impair.heartbeat.ms_latency = latency;
+      Link link(TCP::kDefPingThreshold, TCP::kDefLoopPeriod,
+                TCP::kBulkThroughputOptions, impair);
+
+      std::string message(message_size, 'x');
+      auto start = Clock::now();
+      std::thread sender([&link, &message, total, message_size] {
+        try {
+          for (size_t sent = 0; sent < total; sent += message_size) {
+            link.client.Send(message);
+          }
+        } catch (const TCP::TcpException&) {
+        }
+      });
+      std::string received;
+      size_t count = 0;
+      while (count < total / message_size &&
+             link.peer.Receive(2 * TCP::kDefPingThreshold, received)) {
+        ++count;
+      }
+      auto duration = Clock::now() - start;
+      sender.join();
+
+      double seconds = std::chrono::duration<double>(duration).count();
+      std::cout << "  cap ";
+      if (rate == 0) {
+        std::cout << "none";
+      } else {
+        std::cout << std::setw(4) << (rate >> 20);
+      }
+      std::cout << " MiB/s, latency " << std::setw(2) << latency << " ms: "
+                << std::fixed << std::setprecision(1)
+                << count * message_size / seconds / (1 << 20) << " MiB/s"
+                << (link.client.IsConnected() ? "" : ", disconnected")
+                << '\n';
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    server_port = std::atoi(argv[1]);
+    proxy_port = server_port + 500;
+  }
+
+  try {
+    BenchPing();
+    BenchStall("fixed threshold", 0);
+    BenchStall("phi accrual", TCP::kDefSocketOptions.phi_threshold);
+    BenchThroughput();
+  } catch (const TCP::TcpException& exception) {
+    std::cerr << exception.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
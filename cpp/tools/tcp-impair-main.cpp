@@ -0,0 +1,90 @@
+#include <signal.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "tcp-impair.hpp"
+
+// tcp-impair listen_port target_addr target_port [options]
+//   --latency MS --jitter MS --rate BYTES_PER_SEC --stall PERIOD_MS:MS
+// apply to both sockets of a client. With the hb- prefix an option applies
+// to the heartbeat socket only, with the main- prefix to the main one
+
+namespace {
+
+void PrintUsage(const char* name) {
+  std::cerr << "USAGE:\n"
+            << name << " listen_port target_addr target_port [options]\n"
+            << "  [--|--main-|--hb-]latency MS\n"
+            << "  [--|--main-|--hb-]jitter MS\n"
+            << "  [--|--main-|--hb-]rate BYTES_PER_SEC\n"
+            << "  [--|--main-|--hb-]stall PERIOD_MS:MS\n";
+}
+
+bool SetOption(TCP::Impairment& impairment, const std::string& name,
+               const char* value) {
+  if (name == "latency") {
+    impairment.ms_latency = std::atoi(value);
+  } else if (name == "jitter") {
+    impairment.ms_jitter = std::atoi(value);
+  } else if (name == "rate") {
+    impairment.rate = std::strtoull(value, nullptr, 10);
+  } else if (name == "stall") {
+    char* delimiter;
+    impairment.ms_stall_period = std::strtol(value, &delimiter, 10);
+    if (*delimiter != ':') {
+      return false;
+    }
+    impairment.ms_stall = std::atoi(delimiter + 1);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 4 || (argc - 4) % 2 != 0) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+
+  TCP::ImpairOptions options;
+  for (int i = 4; i < argc; i += 2) {
+    std::string name = argv[i];
+    bool is_set = false;
+    if (name.starts_with("--hb-")) {
+      is_set = SetOption(options.heartbeat, name.substr(5), argv[i + 1]);
+    } else if (name.starts_with("--main-")) {
+      is_set = SetOption(options.main, name.substr(7), argv[i + 1]);
+    } else if (name.starts_with("--")) {
+      is_set = SetOption(options.main, name.substr(2), argv[i + 1]) &&
+               SetOption(options.heartbeat, name.substr(2), argv[i + 1]);
+    }
+    if (!is_set) {
+      std::cerr << "Unknown option " << name << ' ' << argv[i + 1] << '\n';
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  try {
+    TCP::ImpairProxy proxy(std::atoi(argv[1]), argv[2], std::atoi(argv[3]),
+                           options);
+    int signal;
+    sigwait(&signals, &signal);
+  } catch (const TCP::TcpException& exception) {
+    std::cerr << exception.what() << '\n';
+    return 1;
+  }
+  return 0;
+}
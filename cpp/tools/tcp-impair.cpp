@@ -0,0 +1,328 @@
+#include "tcp-impair.hpp"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <random>
+
+namespace TCP {
+
+namespace {
+
+class LImpair : public Logger {
+ public:
+  enum LAction { FConstructor, FDestructor, FAccepter, FPump };
+
+  LImpair(LAction action, void* pointer, logging_foo logger)
+      : action_(action), pointer_(pointer) {
+    logger_ = logger;
+  }
+
+ private:
+  LAction action_;
+  void* pointer_ = nullptr;
+
+  std::string GetModule() const override {
+    return "TCP-IMPAIR " + GetAddress(pointer_);
+  }
+  std::string GetAction() const override {
+    switch (action_) {
+      case FConstructor:
+        return "CONSTRUCTOR";
+      case FDestructor:
+        return "DESTRUCTOR";
+      case FAccepter:
+        return "ACCEPTER";
+      case FPump:
+        return "PUMP";
+      default:
+        return "CANNOT RECOGNIZE ACTION";
+    }
+  }
+};
+
+struct Chunk {
+  std::chrono::steady_clock::time_point due;
+  std::string data;
+  size_t sent = 0;
+};
+
+}  // namespace
+
+ImpairProxy::ImpairProxy(int listen_port, const char* target_addr,
+                         int target_port, const ImpairOptions& options,
+                         logging_foo f_logger)
+    : target_addr_(target_addr),
+      target_port_(target_port),
+      logger_(f_logger),
+      options_(options) {
+  LImpair logger(LImpair::FConstructor, this, logger_);
+
+  listener_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener_ < 0) {
+    throw TcpException(TcpException::SocketCreation, logger_, errno);
+  }
+  int enabling = 1;
+  setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &enabling,
+             sizeof(enabling));
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(listen_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    int error = errno;
+    close(listener_);
+    throw TcpException(TcpException::Binding, logger_, error);
+  }
+  if (listen(listener_, kDefSocketOptions.listen_backlog) < 0) {
+    int error = errno;
+    close(listener_);
+    throw TcpException(TcpException::Listening, logger_, error);
+  }
+
+  accept_thread_ = std::thread(&ImpairProxy::AcceptLoop, this);
+  logger.Log("Relaying port " + std::to_string(listen_port) + " to " +
+                 target_addr_ + ":" + std::to_string(target_port_),
+             Info);
+}
+
+ImpairProxy::~ImpairProxy() {
+  LImpair logger(LImpair::FDestructor, this, logger_);
+  Stop();
+  logger.Log("Proxy stopped", Info);
+}
+
+void ImpairProxy::SetOptions(const ImpairOptions& options) {
+  std::lock_guard<std::mutex> lock(options_mutex_);
+  options_ = options;
+}
+ImpairOptions ImpairProxy::GetOptions() {
+  std::lock_guard<std::mutex> lock(options_mutex_);
+  return options_;
+}
+
+size_t ImpairProxy::GetConnectionCount() noexcept {
+  std::lock_guard<std::mutex> lock(relays_mutex_);
+  return std::count_if(relays_.begin(), relays_.end(), [](Relay* relay) {
+    return relay->running.load() != 0;
+  });
+}
+
+void ImpairProxy::Stop() noexcept {
+  if (!is_active_.exchange(false)) {
+    return;
+  }
+  if (accept_thread_.joinable()) {
+    accept_thread_.join();
+  }
+  close(listener_);
+
+  {
+    std::lock_guard<std::mutex> lock(relays_mutex_);
+    for (Relay* relay : relays_) {
+      shutdown(relay->sockets[0], SHUT_RDWR);
+      shutdown(relay->sockets[1], SHUT_RDWR);
+    }
+  }
+  Reap(true);
+}
+
+void ImpairProxy::AcceptLoop() noexcept {
+  LImpair logger(LImpair::FAccepter, this, logger_);
+  SocketOptions options;
+  options.no_delay = true;
+  options.keep_alive = false;
+
+  while (is_active_) {
+    Reap(false);
+    pollfd listener = {listener_, POLLIN, 0};
+    if (poll(&listener, 1, kPollPeriod) <= 0) {
+      continue;
+    }
+    int client = accept(listener_, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+
+    size_t winner = 0;
+    auto endpoints =
+        ResolveAddress(target_addr_.c_str(), target_port_, logger);
+    int target = endpoints.empty()
+                     ? -1
+                     : ConnectFastest(endpoints, options, winner);
+    if (target < 0) {
+      logger.Log("Cannot reach target, dropping connection", Warning);
+      close(client);
+      continue;
+    }
+    SetSocketOptions(client, options);
+
+    Relay* relay = new Relay;
+    relay->sockets[0] = client;
+    relay->sockets[1] = target;
+    relay->pumps[0] = std::thread(&ImpairProxy::Pump, this, std::ref(*relay),
+                                  0);
+    relay->pumps[1] = std::thread(&ImpairProxy::Pump, this, std::ref(*relay),
+                                  1);
+    std::lock_guard<std::mutex> lock(relays_mutex_);
+    relays_.push_back(relay);
+    logger.Log("Relaying new connection", Debug);
+  }
+}
+
+void ImpairProxy::Pump(Relay& relay, int direction) noexcept {
+  LImpair logger(LImpair::FPump, this, logger_);
+  int source = relay.sockets[direction];
+  int destination = relay.sockets[1 - direction];
+
+  std::mt19937 random(std::random_device{}());
+  std::deque<Chunk> queue;
+  size_t queued = 0;
+  Clock::time_point last_due = Clock::now();
+  Clock::time_point link_free = last_due;
+  bool is_eof = false;
+  bool is_broken = false;
+
+  while (is_active_ && !is_broken && !(is_eof && queue.empty())) {
+    Impairment impairment = GetImpairment(relay.role);
+    auto now = Clock::now();
+    auto stall_end = GetStallEnd(impairment, now);
+    while (!queue.empty() && queue.front().due <= now && stall_end <= now) {
+      Chunk& chunk = queue.front();
+      ssize_t sent = send(destination, chunk.data.data() + chunk.sent,
+                          chunk.data.size() - chunk.sent,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (sent < 0 && errno == EAGAIN) {
+        break;
+      }
+      if (sent <= 0) {
+        is_broken = true;
+        break;
+      }
+      chunk.sent += sent;
+      if (chunk.sent == chunk.data.size()) {
+        queued -= chunk.data.size();
+        queue.pop_front();
+      }
+    }
+    if (is_broken || (is_eof && queue.empty())) {
+      break;
+    }
+
+    int ms_timeout = kPollPeriod;
+    if (!queue.empty()) {
+      auto wake = std::max(queue.front().due, stall_end);
+      ms_timeout = std::clamp<int>(
+          std::chrono::ceil<std::chrono::milliseconds>(wake - now).count(), 0,
+          kPollPeriod);
+    }
+    bool is_reading = !is_eof && queued < kMaxQueued;
+    bool is_due = !queue.empty() && ms_timeout == 0;
+    pollfd fds[2] = {{is_reading ? source : -1, POLLIN, 0},
+                     {is_due ? destination : -1, POLLOUT, 0}};
+    if (poll(fds, 2, is_due ? kPollPeriod : ms_timeout) <= 0 ||
+        !(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+
+    size_t length = kChunkSize;
+    if (impairment.rate != 0) {
+      // about 10ms of the cap, so the rate stays smooth
+      length = std::clamp<size_t>(impairment.rate / 100, 1, kChunkSize);
+    }
+    Chunk chunk;
+    chunk.data.resize(length);
+    ssize_t received = recv(source, chunk.data.data(), length, 0);
+    if (received <= 0) {
+      is_eof = true;
+      continue;
+    }
+    chunk.data.resize(received);
+
+    if (direction == 0 && relay.role == RUnknown) {
+      relay.role = chunk.data.starts_with("0 ") ? RHeartBeat : RMain;
+      logger.Log(relay.role == RHeartBeat ? "Heartbeat connection"
+                                          : "Main connection",
+                 Debug);
+      impairment = GetImpairment(relay.role);
+    }
+
+    now = Clock::now();
+    if (impairment.rate != 0) {
+      link_free = std::max(link_free, now) +
+                  std::chrono::nanoseconds(received * 1000000000 /
+                                           impairment.rate);
+    } else {
+      link_free = now;
+    }
+    int ms_delay = impairment.ms_latency;
+    if (impairment.ms_jitter > 0) {
+      ms_delay += std::uniform_int_distribution<int>(
+          -impairment.ms_jitter, impairment.ms_jitter)(random);
+    }
+    chunk.due = std::max(link_free + std::chrono::milliseconds(
+                                         std::max(ms_delay, 0)),
+                         last_due);
+    last_due = chunk.due;
+    queued += chunk.data.size();
+    queue.push_back(std::move(chunk));
+  }
+
+  if (is_eof && !is_broken) {
+    shutdown(destination, SHUT_WR);
+  } else {
+    shutdown(source, SHUT_RDWR);
+    shutdown(destination, SHUT_RDWR);
+  }
+  --relay.running;
+}
+
+void ImpairProxy::Reap(bool is_all) noexcept {
+  std::list<Relay*> finished;
+  {
+    std::lock_guard<std::mutex> lock(relays_mutex_);
+    for (auto iter = relays_.begin(); iter != relays_.end();) {
+      if (is_all || (*iter)->running.load() == 0) {
+        finished.push_back(*iter);
+        iter = relays_.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+  for (Relay* relay : finished) {
+    relay->pumps[0].join();
+    relay->pumps[1].join();
+    close(relay->sockets[0]);
+    close(relay->sockets[1]);
+    delete relay;
+  }
+}
+
+Impairment ImpairProxy::GetImpairment(Role role) {
+  std::lock_guard<std::mutex> lock(options_mutex_);
+  return role == RHeartBeat ? options_.heartbeat : options_.main;
+}
+
+ImpairProxy::Clock::time_point ImpairProxy::GetStallEnd(
+    const Impairment& impairment, Clock::time_point now) const noexcept {
+  if (impairment.ms_stall_period <= 0 || impairment.ms_stall <= 0) {
+    return now;
+  }
+  // stalls close every period, so a fresh connection has a clean start
+  auto period = std::chrono::milliseconds(impairment.ms_stall_period);
+  auto phase = (now - start_) % period;
+  if (phase < period - std::chrono::milliseconds(impairment.ms_stall)) {
+    return now;
+  }
+  return now - phase + period;
+}
+
+}  // namespace TCP
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "tcp-supply.hpp"
+
+namespace TCP {
+
+struct Impairment {
+  // one way, added in each direction
+  int ms_latency = 0;
+  // the delay of every chunk varies by up to this much around ms_latency.
+  // Chunks never overtake each other, as on a real TCP path
+  int ms_jitter = 0;
+  // bytes per second in each direction, 0 for no cap
+  size_t rate = 0;
+  // the last ms_stall of every ms_stall_period, counted from the start of
+  // the proxy, the path delivers nothing
+  int ms_stall_period = 0;
+  int ms_stall = 0;
+};
+
+// A client opens its heartbeat socket with the init mode "0 flags", which
+// tells it apart from the main socket that starts with the password
+struct ImpairOptions {
+  Impairment main;
+  Impairment heartbeat;
+};
+
+const ImpairOptions kDefImpairOptions = {};
+
+// Relays every connection made to listen_port on loopback to the target,
+// delaying, throttling and stalling the bytes on the way. Meant for local
+// benchmarks of heartbeat and throughput tuning
+class ImpairProxy {
+ public:
+  ImpairProxy(int listen_port, const char* target_addr, int target_port,
+              const ImpairOptions& options = kDefImpairOptions,
+              logging_foo f_logger = LoggerCap);
+  ImpairProxy(const ImpairProxy&) = delete;
+  ~ImpairProxy();
+
+  ImpairProxy& operator=(const ImpairProxy&) = delete;
+
+  // applies to bytes read from now on
+  void SetOptions(const ImpairOptions& options);
+  ImpairOptions GetOptions();
+
+  size_t GetConnectionCount() noexcept;
+  // closes the listener and every relayed connection
+  void Stop() noexcept;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr int kPollPeriod = 100;
+  static constexpr size_t kChunkSize = 1 << 14;
+  // bytes a direction may hold back before it stops reading its source
+  static constexpr size_t kMaxQueued = 4 << 20;
+
+  enum Role { RUnknown, RMain, RHeartBeat };
+
+  struct Relay {
+    // the accepted client side first, the target side second
+    int sockets[2] = {-1, -1};
+    std::atomic<Role> role = RUnknown;
+    std::atomic<int> running = 2;
+    std::thread pumps[2];
+  };
+
+  std::string target_addr_;
+  int target_port_;
+  logging_foo logger_;
+
+  std::mutex options_mutex_;
+  ImpairOptions options_;
+  Clock::time_point start_ = Clock::now();
+
+  int listener_ = -1;
+  std::atomic<bool> is_active_ = true;
+
+  std::mutex relays_mutex_;
+  std::list<Relay*> relays_;
+
+  std::thread accept_thread_;
+
+  void AcceptLoop() noexcept;
+  void Pump(Relay& relay, int direction) noexcept;
+  void Reap(bool is_all) noexcept;
+
+  Impairment GetImpairment(Role role);
+  // when the current stall ends, or now outside of stalls
+  Clock::time_point GetStallEnd(const Impairment& impairment,
+                                Clock::time_point now) const noexcept;
+};
+
+}  // namespace TCP
@@ -0,0 +1,306 @@
+import asyncio
+import collections
+import time
+from typing import Deque, List, Optional
+
+kULLMaxDigits = 20
+kMessageSize = kULLMaxDigits + 1
+kControlBlockSize = kMessageSize * 2
+kBlockSize = 1024
+encoding = 'utf-8'
+
+
+def Pad(data: bytes, size: int) -> bytes:
+    return data[:size].ljust(size, b'\0')
+
+
+def GetNum(data) -> int:
+    num = 0
+    for byte in bytes(data):
+        if byte < ord('0') or byte > ord('9'):
+            break
+        num = num * 10 + byte - ord('0')
+    return num
+
+
+def ToBytes(args) -> bytes:
+    parts = []
+    for arg in args:
+        if isinstance(arg, (bytes, bytearray, memoryview)):
+            parts.append(bytes(arg))
+        else:
+            parts.append(str(arg).encode(encoding))
+    return b' '.join(parts)
+
+
+def GetMsTime() -> float:
+    return time.monotonic() * 1000
+
+
+class _HeartBeatProtocol(asyncio.BufferedProtocol):
+    # Fixed size messages: the password first, pings from the server after it
+
+    def __init__(self, client: 'TcpClient'):
+        self.client = client
+        self.transport: Optional[asyncio.Transport] = None
+        self.password: asyncio.Future = \
+            asyncio.get_running_loop().create_future()
+        self.__buffer = bytearray(kMessageSize)
+        self.__size = 0
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def get_buffer(self, sizehint: int):
+        return memoryview(self.__buffer)[self.__size:]
+
+    def buffer_updated(self, nbytes: int):
+        self.__size += nbytes
+        if self.__size < kMessageSize:
+            return
+        self.__size = 0
+        if not self.password.done():
+            self.password.set_result(bytes(self.__buffer))
+            return
+        self.client._OnPing(GetNum(self.__buffer))
+        self.transport.write(Pad(b'0', kMessageSize))
+
+    def connection_lost(self, exc):
+        if not self.password.done():
+            self.password.set_exception(
+                ConnectionResetError("Connection closed during handshake"))
+        self.client._Disconnect()
+
+
+class _MainProtocol(asyncio.BufferedProtocol):
+    # Receives straight into a preallocated buffer that only grows when a
+    # message does not fit
+
+    def __init__(self, client: 'TcpClient', capacity: int):
+        self.client = client
+        self.transport: Optional[asyncio.Transport] = None
+        self.signal: asyncio.Future = \
+            asyncio.get_running_loop().create_future()
+        self.__buffer = bytearray(capacity)
+        self.__size = 0
+        self.__frame_size: Optional[int] = None
+        self.__is_writable = asyncio.Event()
+        self.__is_writable.set()
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def get_buffer(self, sizehint: int):
+        needed = kControlBlockSize
+        if self.__frame_size is not None:
+            needed += self.__frame_size + 1
+        needed = max(needed, self.__size + max(sizehint, kBlockSize))
+        if needed > len(self.__buffer):
+            self.__buffer.extend(bytes(needed - len(self.__buffer)))
+        return memoryview(self.__buffer)[self.__size:]
+
+    def buffer_updated(self, nbytes: int):
+        self.__size += nbytes
+        view = memoryview(self.__buffer)
+        offset = 0
+        if not self.signal.done():
+            self.signal.set_result(GetNum(view[:1]))
+            offset = 1
+
+        while True:
+            available = self.__size - offset
+            if self.__frame_size is None:
+                if available < kControlBlockSize:
+                    break
+                header = bytes(view[offset:offset + kControlBlockSize])
+                delimiter = header.find(b' ')
+                self.__frame_size = \
+                    GetNum(header[:delimiter]) * kBlockSize + \
+                    GetNum(header[delimiter + 1:])
+                offset += kControlBlockSize
+                continue
+            if available < self.__frame_size + 1:
+                break
+            message = bytes(view[offset:offset + self.__frame_size])
+            offset += self.__frame_size + 1
+            self.__frame_size = None
+            self.client._OnMessage(message.rstrip(b'\0'))
+
+        view.release()
+        if offset != 0:
+            self.__buffer[:self.__size - offset] = \
+                self.__buffer[offset:self.__size]
+            self.__size -= offset
+
+    def pause_writing(self):
+        self.__is_writable.clear()
+
+    def resume_writing(self):
+        self.__is_writable.set()
+
+    async def Drain(self):
+        await self.__is_writable.wait()
+
+    def connection_lost(self, exc):
+        if not self.signal.done():
+            self.signal.set_exception(
+                ConnectionResetError("Connection closed during handshake"))
+        self.__is_writable.set()
+        self.client._Disconnect()
+
+
+class TcpClient:
+    # asyncio implementation of tcp_client.TcpClient. Create it with
+    # await TcpClient.Connect(...); the heartbeat runs on event loop timers
+
+    block_size = kBlockSize
+
+    def __init__(self, ms_ping_threshold: int, ms_loop_period: int):
+        self.__ping_threshold = ms_ping_threshold
+        self.__loop_period = ms_loop_period
+        self.__loop = asyncio.get_running_loop()
+
+        self.__heartbeat: Optional[_HeartBeatProtocol] = None
+        self.__main: Optional[_MainProtocol] = None
+        self.__timer: Optional[asyncio.TimerHandle] = None
+
+        self.__messages: Deque[bytes] = collections.deque()
+        self.__waiter: Optional[asyncio.Future] = None
+
+        self.__is_active = False
+        self.__ms_ping = 0
+        self.__last_ping = GetMsTime()
+
+    @classmethod
+    async def Connect(cls, host: str, port: int, ms_ping_threshold=1000,
+                      ms_loop_period=100, receive_buffer=64 * 1024):
+        client = cls(ms_ping_threshold, ms_loop_period)
+        try:
+            await client.__Handshake(host, port, receive_buffer)
+        except BaseException:
+            client.StopClient()
+            raise
+        return client
+
+    async def __Handshake(self, host: str, port: int, receive_buffer: int):
+        timeout = self.__ping_threshold / 1000
+
+        _, self.__heartbeat = await self.__loop.create_connection(
+            lambda: _HeartBeatProtocol(self), host, port)
+        self.__heartbeat.transport.write(Pad(b'0', kMessageSize))
+        try:
+            password = await asyncio.wait_for(
+                asyncio.shield(self.__heartbeat.password), timeout)
+        except asyncio.TimeoutError:
+            raise TimeoutError("Password waiting timeout")
+        if GetNum(password) == 0:
+            raise RuntimeError("Signal is term")
+
+        peer = self.__heartbeat.transport.get_extra_info('peername')
+        _, self.__main = await self.__loop.create_connection(
+            lambda: _MainProtocol(self, receive_buffer), peer[0], peer[1])
+        self.__main.transport.write(password)
+        try:
+            signal = await asyncio.wait_for(
+                asyncio.shield(self.__main.signal), timeout)
+        except asyncio.TimeoutError:
+            raise TimeoutError("Signal waiting timeout")
+        if signal != 1:
+            raise RuntimeError("Signal is term")
+
+        self.__is_active = True
+        self.__last_ping = GetMsTime()
+        self.__timer = self.__loop.call_later(self.__loop_period / 1000,
+                                              self.__OnTimer)
+
+    def StopClient(self):
+        self.__is_active = False
+        if self.__timer is not None:
+            self.__timer.cancel()
+            self.__timer = None
+        for protocol in (self.__heartbeat, self.__main):
+            if protocol is not None and protocol.transport is not None:
+                protocol.transport.close()
+        self.__WakeWaiter()
+
+    def IsConnected(self) -> bool:
+        return self.__is_active and self.__ms_ping >= 0
+
+    def IsAvailable(self) -> bool:
+        if len(self.__messages) != 0:
+            return True
+        if not self.IsConnected():
+            raise ConnectionResetError("Peer is not connected")
+        return False
+
+    def GetPing(self) -> int:
+        if not self.IsConnected():
+            raise ConnectionResetError("Peer is not connected")
+        return self.__ms_ping
+
+    def GetMsPingThreshold(self) -> int:
+        return self.__ping_threshold
+
+    async def Send(self, *args):
+        if not self.IsConnected():
+            raise ConnectionResetError("Peer is not connected")
+
+        data = ToBytes(args)
+        full_block_num = len(data) // self.block_size
+        part_block_size = len(data) - full_block_num * self.block_size
+        header = Pad(b'%d %d' % (full_block_num, part_block_size),
+                     kControlBlockSize)
+
+        self.__main.transport.writelines((header, data, b'\0'))
+        await self.__main.Drain()
+        if not self.IsConnected():
+            raise ConnectionResetError("Peer is not connected")
+
+    async def ReceiveView(self, timeout: int) -> Optional[memoryview]:
+        # timeout in milliseconds; None when nothing arrived in time
+        if len(self.__messages) == 0:
+            if not self.IsConnected():
+                raise ConnectionResetError("Peer is not connected")
+            self.__waiter = self.__loop.create_future()
+            try:
+                await asyncio.wait_for(self.__waiter, timeout / 1000)
+            except asyncio.TimeoutError:
+                return None
+            finally:
+                self.__waiter = None
+            if len(self.__messages) == 0:
+                raise ConnectionResetError("Peer is not connected")
+        return memoryview(self.__messages.popleft())
+
+    async def Receive(self, timeout: int) -> List[str]:
+        message = await self.ReceiveView(timeout)
+        if message is None:
+            return []
+        return str(message, encoding, 'surrogateescape').split(' ')
+
+    def _OnPing(self, ms_ping: int):
+        self.__ms_ping = ms_ping
+        self.__last_ping = GetMsTime()
+
+    def _OnMessage(self, message: bytes):
+        self.__messages.append(message)
+        self.__WakeWaiter()
+
+    def _Disconnect(self):
+        self.__ms_ping = -1
+        if self.__is_active:
+            self.StopClient()
+
+    def __OnTimer(self):
+        self.__timer = None
+        if not self.__is_active:
+            return
+        if GetMsTime() - self.__last_ping > self.__ping_threshold:
+            self._Disconnect()
+            return
+        self.__timer = self.__loop.call_later(self.__loop_period / 1000,
+                                              self.__OnTimer)
+
+    def __WakeWaiter(self):
+        if self.__waiter is not None and not self.__waiter.done():
+            self.__waiter.set_result(None)